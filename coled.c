@@ -18,7 +18,17 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 
 /*** defines ***/
 
@@ -27,8 +37,29 @@
 #define COLED_VERSION "0.0.1"
 #define COLED_TAB_STOP 8
 #define COLED_QUIT_TIMES 3
+#define COLED_GAP_MIN 16
+#define COLED_SCAN_CHUNK (4 << 20)
+#define COLED_SCAN_THREADS 16
+#define COLED_ROW_BLOCK 1024
+#define COLED_BG_SAVE_BYTES (8 << 20)
 #define MAXPASSLEN 32
 #define IDLEN 20
+#define COLED_HELLO "hello bin"
+#define COLED_VARINT_MAX 5
+#define COLED_NETBUF (64 << 10)
+#define COLED_FLUSH_MS 10
+#define COLED_FLUSH_BYTES (16 << 10)
+#define COLED_FRAME_MS 16
+#define COLED_APPLY_BATCH 1024
+#define COLED_LOG_MAX (4 << 20)
+#define COLED_RESUME_TRIES 3
+#define COLED_CURSOR_MS 50
+/* seqtest builds with these tiny, to split and merge all the time */
+#ifndef COLED_SEQ_BLOCK
+#define COLED_SEQ_BLOCK 128
+#define COLED_SEQ_SPAN 1024
+#endif
+#define COLED_MIRROR_SITE (1 << 30)
 
 enum editorKey {
   BACKSPACE = 127,
@@ -43,22 +74,230 @@ enum editorKey {
   PAGE_DOWN
 };
 
+enum rowStorage {
+  ROW_OWNED = 0,
+  ROW_MAPPED,
+  ROW_SAVING
+};
+
+enum escSeq {
+  ESC_HIDE_CURSOR,
+  ESC_SHOW_CURSOR,
+  ESC_ERASE_LINE,
+  ESC_REVERSE,
+  ESC_RESET_ATTR
+};
+
+enum netOp {
+  OP_CREATE = 1,
+  OP_JOIN,
+  OP_REPLY,
+  OP_REQUEST,
+  OP_SNAPSHOT,
+  OP_ROW,
+  OP_CHAR,
+  OP_NEWLINE,
+  OP_DELETE,
+  OP_INSERT,
+  OP_DELRANGE,
+  /* 12 was replace-lines, which nothing sent */
+  OP_SEQ_INSERT = 13,
+  OP_SEQ_DELETE,
+  OP_SEQ_RUNS,
+  OP_ACK,
+  OP_CHUNKS,
+  OP_CHUNK,
+  OP_RESUME,
+  OP_SYNC,
+  OP_CURSOR
+};
+
+enum netJoinFlag {
+  JOIN_CHUNKS = 1,
+  JOIN_PACKED = 2,
+  JOIN_SINCE = 4
+};
+
 /*** data ***/
+typedef struct netReader {
+  char *buf;
+  size_t cap;
+  size_t head, tail;
+  char *scratch;
+  size_t scratchcap;
+} netReader;
+
+typedef struct seqId {
+  int site;
+  unsigned int clock;
+} seqId;
+
+typedef struct seqRun {
+  seqId id;
+  int len;
+  int nl, tail;
+  char dead;
+} seqRun;
+
+/* runs in order; nl and tail sum up the live ones like a run's unless stale */
+typedef struct seqBlock {
+  seqRun *runs;
+  int n, cap;
+  int nl, tail;
+  char stale;
+} seqBlock;
+
+/* a run starting at clock and the block holding it */
+typedef struct seqRef {
+  unsigned int clock;
+  seqBlock *b;
+} seqRef;
+
+/* the runs of site with clocks in span, by their first clock */
+typedef struct seqSlot {
+  int site;
+  unsigned int span;
+  seqRef *refs;
+  int n, cap;
+} seqSlot;
+
+typedef struct seqDoc {
+  seqBlock **blocks;
+  int nblocks, blockcap;
+  int n;
+  /* open addressed, nslots a power of 2, used of them taken */
+  seqSlot *slots;
+  int nslots, used;
+  int site;
+  unsigned int clock;
+  /* the id the next mirrored char gets */
+  seqId mirror;
+} seqDoc;
+
+typedef struct netPending {
+  int op;
+  int a, b;
+  seqId id, origin;
+  unsigned int base;
+  int ex, ey;
+  int len, cap;
+  char *payload;
+} netPending;
+
+typedef struct netQueue {
+  netPending *ops;
+  int n, cap;
+  size_t bytes;
+  /* flushed ops from sent on, kept until acked to send again after a drop */
+  char *buf;
+  size_t sent, len, bufcap;
+} netQueue;
+
+typedef struct loggedOp {
+  int op;
+  int a, b;
+  int len;
+  size_t off;
+} loggedOp;
+
+typedef struct opLog {
+  loggedOp *ops;
+  int head, n, cap;
+  char *data;
+  size_t datalen, datacap;
+} opLog;
+
+/* the cursor of another site, after the char at or, while that is not
+ * known here, where it was when sent */
+typedef struct netCursor {
+  int site;
+  seqId at;
+  int cx, cy;
+} netCursor;
+
 typedef struct netConfig {
   char *serverIp;
   int serverPort, server;
-  char connected;
+  char connected, listening;
   char *id, *pass;
   time_t connectInterval;
+  netReader in;
+  netQueue out;
+  opLog log;
+  seqDoc seq;
+  unsigned int rev;
+  int unacked;
+  int flushInterval;
+  int flushTimer, retryTimer;
+  /* the cursors of the others, and the char ours was last sent after */
+  netCursor *cursors;
+  int ncursors, cursorcap;
+  seqId cursorAt;
+  char cursorSent, cursorWait;
+  int cursorTimer;
 } netConfig;
 
+typedef struct netFrame {
+  int op;
+  int a, b;
+  int len;
+  char *payload;
+} netFrame;
+
+/* a chunked snapshot as it comes in, kept over a dropped connection */
+typedef struct netSnap {
+  char *data;
+  size_t len, cap;
+  int rev, next, count;
+} netSnap;
+
 typedef struct erow {
   int size;
-  int rsize;
+  int gap, gaplen;
+  int rsize, rcap;
+  int rvalid;
+  char rstale;
+  char storage;
   char *chars;
   char *render;
 } erow;
 
+/* rows from first on; an unsplit block is only its stretch of a mapping */
+typedef struct rowBlock {
+  int first, n, cap;
+  erow *rows;
+  char *start;
+  size_t len, cr, size;
+} rowBlock;
+
+struct abuf {
+  char *b;
+  int len, cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+/* cells, when overlaid, holds the background color digit of each cell or 0 */
+typedef struct screenLine {
+  char *chars, *cells;
+  int len, cap;
+  char overlaid;
+} screenLine;
+
+typedef struct saveJob {
+  pthread_t tid;
+  char *filename, *tmpname;
+  int fd;
+  struct iovec *iov;
+  int iovcnt;
+  size_t len;
+  int dirty;
+  int err;
+  int done[2];
+  char **retired;
+  int nretired;
+} saveJob;
+
 struct editorConfig {
   struct termios orig_termios;
   int screenrows, screencols, screenHeight, screenWidth;
@@ -66,36 +305,102 @@ struct editorConfig {
   int rx;
   int rowoff, coloff;
   int numrows;
-  erow *row;
+  rowBlock *blocks;
+  int nblocks, blockcap;
+  int lastblock, stale;
+  char *map;
+  size_t maplen;
+  saveJob *saving;
   int dirty;
   char *filename;
   char statusmsg[80];
-  time_t statusmsg_time;
-  int statusmsg_interval;
-  char processing;
-  char netProcessing;
+  int epfd, sigfd, statusTimer;
+  screenLine *screen;
+  int screenlines, screenrowoff;
+  int frameTimer, frameInterval;
+  char framePending;
+  long lastFrame;
+  long frames, coalesced;
+  struct abuf frame, line, cells;
 };
 
 struct editorConfig E;
 netConfig netConf;
 
+const struct {
+  const char *s;
+  int len;
+} escSeqs[] = {
+  [ESC_HIDE_CURSOR] = {"\x1b[?25l", 6},
+  [ESC_SHOW_CURSOR] = {"\x1b[?25h", 6},
+  [ESC_ERASE_LINE] = {"\x1b[K", 3},
+  [ESC_REVERSE] = {"\x1b[7m", 4},
+  [ESC_RESET_ATTR] = {"\x1b[m", 3}
+};
+
 /*** prototypes ***/
 void editorSetStatusMessage(int, const char *, ...);
+void editorWatch(int fd);
+void editorUnwatch(int fd);
+void editorArmTimer(int fd, int ms, int interval);
+void editorWait();
+void editorFinishSave();
 void editorRefreshScreen();
+void editorRequestRefresh();
+void editorInvalidateScreen();
 char *editorPrompt(char *, size_t);
-void delay(time_t);
 int multipleChoice(const char *, int, ...);
 void createSession();
 int connectToServer();
 int serverSend(char* buf, size_t len);
 int disconnectFromServer();
 char *serverReceive(int *len);
-void setAndFreeze(char *msg, int sec);
+int serverSendFrame(int op, int a, int b, const char *payload, size_t len);
+int serverReceiveFrame(netFrame *f);
+void netResetReader();
+int netFrameIs(netFrame *f, const char *s);
+int netReceiveSnapshot(netSnap *snap, netFrame *head);
+int netRejoin(int rev, int next, int flags);
+void netSerializeQueue();
+size_t netFrameAt(char *buf, size_t off, size_t len, netFrame *f);
+int netLoadSnapshot(char *s, size_t len);
+int netUnpack(const char *src, int len, char *dst, int cap);
+unsigned int netCrc32(const char *s, size_t len);
+int netGetVarint(const char *s, int len, unsigned int *v);
+int netGetIds(const char *s, int len, unsigned int *v, int n);
 void joinSession();
 void listenServer();
 void netInsertChar(int c, int cx, int cy);
+void netInsertText(int cx, int cy, char *s, int len);
+void netDeleteText(int cx, int cy, char *s, int len);
+int netQueueOp(int op, int a, int b, seqId id, seqId origin,
+               const char *payload, int len);
+void netReceive();
+int netOpsPending();
+void netApplyOps(int max);
+void netFlush();
+void netReconnect();
+void netDisconnect();
+void netCursorMoved();
 void netInsertNewline(int cx, int cy);
 void netDelChar(int cx, int cy);
+void netDeleteSpan(int cx, int cy, int ex, int ey);
+void netSeqInsert(int cx, int cy, char *payload, int len);
+void netSeqDelete(int cx, int cy, char *payload, int len);
+void netTextEnd(const char *s, int len, int *x, int *y);
+void editorInsertText(int cx, int cy, char *s, int len);
+void editorDeleteSpan(int cx, int cy, int ex, int ey);
+void seqInsertAt(int x, int y, char *s, int len, int send);
+void seqDeleteAt(int x, int y, int ex, int ey, const char *s, int send);
+int seqDeleteIds(seqId id, int len);
+seqRun *seqFind(seqId id, int *x, int *y, int *k, int *bi, int *ri);
+void seqAdvanceRows(int *x, int *y, int k);
+seqId seqOriginAt(int x, int y);
+int seqIntegrate(seqId id, seqId origin, const char *s, int len, int exact,
+                 int *px, int *py);
+void seqReset();
+size_t seqEncode(char **buf);
+int seqLoad(const char *s, int len);
 
 /*** terminal ***/
 void die(const char *s) {
@@ -135,7 +440,9 @@ void enableRawMode() {
 int editorReadKey() {
   int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+  while (1) {
+    editorWait();
+    if ((nread = read(STDIN_FILENO, &c, 1)) == 1) break;
     if (nread == -1 && errno != EAGAIN) {
       die("read");
     }
@@ -184,6 +491,12 @@ int editorReadKey() {
   }
 }
 
+int editorInputPending() {
+  int n = 0;
+  ioctl(STDIN_FILENO, FIONREAD, &n);
+  return n > 0;
+}
+
 int getCursorPosition(int *rows, int *cols) {
   char buf[32];
   unsigned int i = 0;
@@ -221,206 +534,738 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
+/*** event loop ***/
+
+/*
+ * The editor runs on one thread around one epoll set: the terminal, the
+ * server socket, a signalfd for SIGWINCH and timerfds for status expiry,
+ * flushing and reconnecting. Whoever waits for a key waits in editorWait,
+ * which handles everything else as it comes, so prompts and status pauses
+ * keep the session live.
+ */
+void editorWatch(int fd) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  epoll_ctl(E.epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void editorUnwatch(int fd) {
+  epoll_ctl(E.epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* ms == 0 disarms */
+void editorArmTimer(int fd, int ms, int interval) {
+  struct itimerspec its;
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  its.it_interval.tv_sec = interval / 1000;
+  its.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+  timerfd_settime(fd, 0, &its, NULL);
+}
+
+void editorResize() {
+  struct signalfd_siginfo si;
+  while (read(E.sigfd, &si, sizeof(si)) == sizeof(si));
+  if (getWindowSize(&E.screenHeight, &E.screenWidth) == -1) return;
+  E.screenrows = E.screenHeight - 2;
+  E.screencols = E.screenWidth;
+  editorInvalidateScreen();
+}
+
+long editorNowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* returns once stdin is readable; pending ops are applied a batch per pass */
+void editorWait() {
+  struct epoll_event evs[8];
+  while (1) {
+    int n = epoll_wait(E.epfd, evs, 8, netOpsPending() ? 0 : -1);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      die("epoll_wait");
+    }
+
+    int input = 0, redraw = 0;
+    for (int i = 0; i < n; i++) {
+      int fd = evs[i].data.fd;
+      uint64_t expired;
+      if (fd == STDIN_FILENO) {
+        input = 1;
+      } else if (fd == E.sigfd) {
+        editorResize();
+        redraw = 1;
+      } else if (fd == E.frameTimer) {
+        read(fd, &expired, sizeof(expired));
+        E.framePending = 0;
+        redraw = 1;
+      } else if (fd == E.statusTimer) {
+        read(fd, &expired, sizeof(expired));
+        E.statusmsg[0] = '\0';
+        redraw = 1;
+      } else if (E.saving && fd == E.saving->done[0]) {
+        editorFinishSave();
+        redraw = 1;
+      } else if (netConf.connected && fd == netConf.server) {
+        netReceive();
+        redraw = 1;
+      } else if (fd == netConf.flushTimer) {
+        read(fd, &expired, sizeof(expired));
+        netFlush();
+        netCursorMoved();
+      } else if (fd == netConf.retryTimer) {
+        read(fd, &expired, sizeof(expired));
+        netReconnect();
+        redraw = 1;
+      } else if (fd == netConf.cursorTimer) {
+        read(fd, &expired, sizeof(expired));
+        netConf.cursorWait = 0;
+        netCursorMoved();
+      }
+    }
+
+    if (netOpsPending()) {
+      netApplyOps(COLED_APPLY_BATCH);
+      redraw = 1;
+    }
+
+    if (input) return;
+    if (redraw) editorRequestRefresh();
+  }
+}
+
 /*** row operations ***/
 
+/*
+ * Each row keeps its text in a gap buffer: chars[0..gap) and
+ * chars[gap + gaplen..size + gaplen) hold the text, the hole in between
+ * follows the cursor so typing is amortized O(1) however long the row is.
+ */
+
+char editorRowCharAt(erow *row, int at) {
+  return at < row->gap ? row->chars[at] : row->chars[at + row->gaplen];
+}
+
+void editorRowDetach(erow *);
+
+void editorRowMoveGap(erow *row, int at) {
+  if (at != row->gap) editorRowDetach(row);
+  if (at < row->gap) {
+    memmove(&row->chars[at + row->gaplen], &row->chars[at], row->gap - at);
+  } else if (at > row->gap) {
+    memmove(&row->chars[row->gap], &row->chars[row->gap + row->gaplen],
+      at - row->gap);
+  }
+  row->gap = at;
+}
+
+void editorRowReserve(erow *row, int len) {
+  if (row->gaplen >= len) return;
+
+  int cap = row->size + row->gaplen;
+  int newcap = cap * 2;
+  if (newcap < row->size + len + COLED_GAP_MIN) {
+    newcap = row->size + len + COLED_GAP_MIN;
+  }
+  row->chars = realloc(row->chars, newcap);
+
+  int tail = row->size - row->gap;
+  memmove(&row->chars[newcap - tail], &row->chars[row->gap + row->gaplen], tail);
+  row->gaplen = newcap - row->size;
+}
+
+char *editorRowChars(erow *row) {
+  editorRowMoveGap(row, row->size);
+  return row->chars;
+}
+
+/*
+ * Rows loaded by editorOpen point into the file mapping, and rows being
+ * written by a background save lend their buffer to it. Either way the
+ * row gets its own copy before it is changed.
+ */
+void editorRetireChars(char *);
+
+void editorRowDetach(erow *row) {
+  if (row->storage == ROW_OWNED) return;
+  char *chars = malloc(row->size + COLED_GAP_MIN);
+  memcpy(chars, row->chars, row->gap);
+  memcpy(&chars[row->gap], &row->chars[row->gap + row->gaplen], row->size - row->gap);
+  if (row->storage == ROW_SAVING) editorRetireChars(row->chars);
+  row->chars = chars;
+  row->gap = row->size;
+  row->gaplen = COLED_GAP_MIN;
+  row->storage = ROW_OWNED;
+}
+
 int editorRowCxToRx(erow *row, int cx) {
   int rx = 0;
-  for (int j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t') rx += (COLED_TAB_STOP - 1) - (rx % COLED_TAB_STOP);
-    rx++;
+  int j = 0;
+  while (j < cx) {
+    int end = (j < row->gap && cx > row->gap) ? row->gap : cx;
+    char *p = j < row->gap ? &row->chars[j] : &row->chars[j + row->gaplen];
+    char *tab = memchr(p, '\t', end - j);
+    if (tab == NULL) {
+      rx += end - j;
+      j = end;
+      continue;
+    }
+    rx += tab - p;
+    j += tab - p + 1;
+    rx += COLED_TAB_STOP - (rx % COLED_TAB_STOP);
   }
 
   return rx;
 }
 
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
+/*
+ * row->render holds the expansion of the first rvalid chars only. Edits
+ * just pull rvalid back to the edit point; the expansion is redone lazily
+ * by editorRowRender, from that point and only as far as the screen shows.
+ */
+void editorRowInvalidate(erow *row, int at) {
+  if (at >= row->rvalid) return;
+  row->rvalid = at;
+  row->rstale = 1;
+}
 
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') tabs++;
+void editorRowRender(erow *row, int upto) {
+  if (row->rstale) {
+    row->rsize = editorRowCxToRx(row, row->rvalid);
+    row->rstale = 0;
   }
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (COLED_TAB_STOP - 1) + 1);
+  while (row->rvalid < row->size && row->rsize < upto) {
+    if (row->rsize + COLED_TAB_STOP > row->rcap) {
+      row->rcap = row->rcap * 2 + COLED_TAB_STOP;
+      row->render = realloc(row->render, row->rcap);
+    }
 
-  int idx = 0;
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % COLED_TAB_STOP != 0) row->render[idx++] = ' ';
+    char c = editorRowCharAt(row, row->rvalid++);
+    if (c == '\t') {
+      row->render[row->rsize++] = ' ';
+      while (row->rsize % COLED_TAB_STOP != 0) row->render[row->rsize++] = ' ';
     } else {
-      row->render[idx++] = row->chars[j];
+      row->render[row->rsize++] = c;
     }
+  }
+}
 
+/*
+ * The rows are kept in blocks of at most 2 * COLED_ROW_BLOCK, so adding
+ * or removing rows moves a block's worth at most. Each block knows the
+ * index of its first row; after a change those of the blocks from
+ * E.stale on are redone lazily, the next time a row past them is looked
+ * up. A block of a mapped file starts out unsplit, as its stretch of the
+ * mapping alone, and gets rows the first time one of them is asked for.
+ */
+void editorMapRows(erow *rows, int n, char *line) {
+  char *mapend = E.map + E.maplen;
+  for (int i = 0; i < n; i++) {
+    char *nl = memchr(line, '\n', mapend - line);
+    char *lineend = nl ? nl : mapend;
+    int len = lineend - line;
+    while (len > 0 && line[len - 1] == '\r') len--;
+
+    erow *row = &rows[i];
+    row->size = len;
+    row->gap = len;
+    row->gaplen = 0;
+    row->chars = line;
+    row->storage = ROW_MAPPED;
+    row->rsize = 0;
+    row->rcap = 0;
+    row->rvalid = 0;
+    row->rstale = 0;
+    row->render = NULL;
+
+    line = lineend + 1;
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows) return;
+void editorSplitBlock(rowBlock *b) {
+  b->cap = b->n;
+  b->rows = malloc(sizeof(erow) * b->cap);
+  editorMapRows(b->rows, b->n, b->start);
+}
+
+/* the block holding row at, the last one for at == E.numrows */
+int editorBlockAt(int at) {
+  int i = E.lastblock;
+  if (i < E.stale && i < E.nblocks && at >= E.blocks[i].first &&
+      at < E.blocks[i].first + E.blocks[i].n) {
+    return i;
+  }
+
+  for (; E.stale < E.nblocks; E.stale++) {
+    rowBlock *b = &E.blocks[E.stale];
+    b->first = E.stale ? b[-1].first + b[-1].n : 0;
+  }
+  int lo = 0, hi = E.nblocks - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (E.blocks[mid].first <= at) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  E.lastblock = lo;
+  return lo;
+}
+
+erow *editorRowAt(int at) {
+  rowBlock *b = &E.blocks[editorBlockAt(at)];
+  if (b->rows == NULL) editorSplitBlock(b);
+  return &b->rows[at - b->first];
+}
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+void editorAddBlocks(int at, int count) {
+  if (E.nblocks + count > E.blockcap) {
+    E.blockcap = (E.nblocks + count) * 2;
+    E.blocks = realloc(E.blocks, sizeof(rowBlock) * E.blockcap);
+  }
+  memmove(&E.blocks[at + count], &E.blocks[at],
+    sizeof(rowBlock) * (E.nblocks - at));
+  memset(&E.blocks[at], 0, sizeof(rowBlock) * count);
+  E.nblocks += count;
+  if (E.stale > at) E.stale = at;
+}
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+void editorRemoveBlocks(int at, int count) {
+  memmove(&E.blocks[at], &E.blocks[at + count],
+    sizeof(rowBlock) * (E.nblocks - at - count));
+  E.nblocks -= count;
+  if (E.stale > at) E.stale = at;
+}
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  editorUpdateRow(&E.row[at]);
+void editorReserveRows(rowBlock *b, int n) {
+  if (b->cap >= n) return;
+  int cap = b->cap ? b->cap * 2 : COLED_GAP_MIN;
+  if (cap > 2 * COLED_ROW_BLOCK) cap = 2 * COLED_ROW_BLOCK;
+  if (cap < n) cap = n;
+  b->cap = cap;
+  b->rows = realloc(b->rows, sizeof(erow) * b->cap);
+}
 
-  E.numrows++;
+/*
+ * Makes room for count rows at at, for the caller to fill. Rows that
+ * would overflow their block go into new blocks, and the rows after them
+ * into one of their own, so a big paste moves those once.
+ */
+void editorOpenRows(int at, int count) {
+  if (E.nblocks == 0) editorAddBlocks(0, 1);
+  int i = editorBlockAt(at);
+  rowBlock *b = &E.blocks[i];
+  if (b->rows == NULL) editorSplitBlock(b);
+  int k = at - b->first;
+  E.numrows += count;
   E.dirty++;
+
+  if (b->n + count <= 2 * COLED_ROW_BLOCK) {
+    editorReserveRows(b, b->n + count);
+    memmove(&b->rows[k + count], &b->rows[k], sizeof(erow) * (b->n - k));
+    b->n += count;
+    if (E.stale > i + 1) E.stale = i + 1;
+    return;
+  }
+
+  int tail = k > 0 ? b->n - k : 0;
+  int nblocks = (count + COLED_ROW_BLOCK - 1) / COLED_ROW_BLOCK + (tail > 0);
+  if (k > 0) i++;
+  editorAddBlocks(i, nblocks);
+  if (tail > 0) {
+    rowBlock *from = &E.blocks[i - 1], *to = &E.blocks[i + nblocks - 1];
+    to->n = to->cap = tail;
+    to->rows = malloc(sizeof(erow) * tail);
+    memcpy(to->rows, &from->rows[k], sizeof(erow) * tail);
+    from->n = k;
+  }
+  for (int j = i; count > 0; j++) {
+    rowBlock *nb = &E.blocks[j];
+    nb->n = nb->cap = count < COLED_ROW_BLOCK ? count : COLED_ROW_BLOCK;
+    nb->rows = malloc(sizeof(erow) * nb->cap);
+    count -= nb->n;
+  }
+}
+
+void editorInitRow(erow *row, char *s, size_t len) {
+  row->size = len;
+  row->chars = malloc(len + COLED_GAP_MIN);
+  memcpy(row->chars, s, len);
+  row->gap = len;
+  row->gaplen = COLED_GAP_MIN;
+
+  row->rsize = 0;
+  row->rcap = 0;
+  row->rvalid = 0;
+  row->rstale = 0;
+  row->storage = ROW_OWNED;
+  row->render = NULL;
+}
+
+/* the size of the text, a newline after every row */
+size_t editorTextSize() {
+  size_t len = 0;
+  for (int i = 0; i < E.nblocks; i++) {
+    rowBlock *b = &E.blocks[i];
+    if (b->rows == NULL) {
+      len += b->size;
+      continue;
+    }
+    for (int j = 0; j < b->n; j++) len += b->rows[j].size + 1;
+  }
+  return len;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numrows) return;
+  editorOpenRows(at, 1);
+  editorInitRow(editorRowAt(at), s, len);
 }
 
 void editorFreeRow(erow *row) {
   free(row->render);
-  free(row->chars);
+  if (row->storage == ROW_OWNED) free(row->chars);
+  if (row->storage == ROW_SAVING) editorRetireChars(row->chars);
 }
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  E.numrows--;
+void editorFreeBlock(rowBlock *b) {
+  if (b->rows == NULL) return;
+  for (int j = 0; j < b->n; j++) editorFreeRow(&b->rows[j]);
+  free(b->rows);
+}
+
+/* deletes count rows from at on; whole blocks go without being split */
+void editorDelRows(int at, int count) {
+  if (at < 0 || count <= 0 || at + count > E.numrows) return;
+  E.numrows -= count;
   E.dirty++;
+
+  while (count > 0) {
+    int i = editorBlockAt(at);
+    rowBlock *b = &E.blocks[i];
+    int k = at - b->first;
+    if (k == 0 && count >= b->n) {
+      int j = i;
+      for (; j < E.nblocks && count >= E.blocks[j].n; j++) {
+        editorFreeBlock(&E.blocks[j]);
+        count -= E.blocks[j].n;
+      }
+      editorRemoveBlocks(i, j - i);
+      continue;
+    }
+
+    if (b->rows == NULL) editorSplitBlock(b);
+    int m = b->n - k < count ? b->n - k : count;
+    for (int j = k; j < k + m; j++) editorFreeRow(&b->rows[j]);
+    memmove(&b->rows[k], &b->rows[k + m], sizeof(erow) * (b->n - k - m));
+    b->n -= m;
+    count -= m;
+    if (E.stale > i + 1) E.stale = i + 1;
+  }
+}
+
+void editorDelRow(int at) {
+  editorDelRows(at, 1);
 }
 
 void editorRowInsertChar(erow *row, int at, int c) {
   if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  editorRowDetach(row);
+  editorRowReserve(row, 1);
+  editorRowMoveGap(row, at);
+  row->chars[row->gap++] = c;
+  row->gaplen--;
   row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
+  editorRowInvalidate(row, at);
+  E.dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, char *s, size_t len) {
+  if (at < 0 || at > row->size) at = row->size;
+  editorRowDetach(row);
+  editorRowReserve(row, len);
+  editorRowMoveGap(row, at);
+  memcpy(&row->chars[row->gap], s, len);
+  row->gap += len;
+  row->gaplen -= len;
+  row->size += len;
+  editorRowInvalidate(row, at);
   E.dirty++;
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
+  editorRowDetach(row);
+  editorRowReserve(row, len);
+  editorRowMoveGap(row, row->size);
+  memcpy(&row->chars[row->gap], s, len);
+  row->gap += len;
+  row->gaplen -= len;
   row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
   E.dirty++;
 }
 
 void editorRowDelChar(erow *row, int at) {
   if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+  editorRowDetach(row);
+  if (at == row->gap - 1) {
+    row->gap--;
+  } else {
+    editorRowMoveGap(row, at);
+  }
+  row->gaplen++;
   row->size--;
-  editorUpdateRow(row);
+  editorRowInvalidate(row, at);
+  E.dirty++;
+}
+
+void editorRowTruncate(erow *row, int at) {
+  if (at < 0 || at >= row->size) return;
+  editorRowDetach(row);
+  editorRowMoveGap(row, at);
+  row->gaplen += row->size - at;
+  row->size = at;
+  editorRowInvalidate(row, at);
+}
+
+void editorRowDelRange(erow *row, int at, int len) {
+  if (at < 0 || len <= 0 || at + len > row->size) return;
+  editorRowDetach(row);
+  editorRowMoveGap(row, at);
+  row->gaplen += len;
+  row->size -= len;
+  editorRowInvalidate(row, at);
   E.dirty++;
 }
 
 /*** editor operations ***/
 void editorInsertChar(int c) {
-	if (netConf.connected) {//more complex condition?
-		char cmd[] = "char";
-		char msg[sizeof(cmd) + 3];
-		snprintf(msg, sizeof msg, "%s %c ", cmd, c);
-		serverSend(msg, sizeof(msg)-1);
-		
-		size_t maxnumlen = 10;
-   	char cx[maxnumlen + 2];
-    size_t l = snprintf(cx, sizeof cx, "%d ", E.cx);
-    serverSend(cx, l);
-    
-    char cy[maxnumlen + 2];
-    l = snprintf(cy, sizeof cy, "%d\n", E.cy);
-    serverSend(cy, l);
+	if (netConf.listening) {
+		char ch = c;
+		seqInsertAt(E.cx, E.cy, &ch, 1, 1);
 	}
 	
   if (E.cy == E.numrows) {
     editorInsertRow(E.numrows, "", 0);
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
   E.cx++;
 }
 
 void editorInsertNewline() {
-	if (netConf.connected) {
-		char cmd[] = "newline"; 
-		serverSend(cmd, sizeof(cmd)-1);
-		serverSend(" ", 1);
-		
-		size_t maxnumlen = 10;
-   	char cx[maxnumlen + 2];
-    size_t l = snprintf(cx, sizeof cx, "%d ", E.cx);
-    serverSend(cx, l);
-    
-    char cy[maxnumlen + 2];
-    l = snprintf(cy, sizeof cy, "%d\n", E.cy);
-    serverSend(cy, l);
+	if (netConf.listening) {
+		/* on the row past the end the newline only makes that row */
+		seqInsertAt(E.cx, E.cy, "\n", E.cy < E.numrows, 1);
 	}
 	
   if (E.cx == 0) {
     editorInsertRow(E.cy, "", 0);
   } else {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->chars = realloc(row->chars, E.cx + 1); //freeing &row->chars[E.cx]
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    erow *row = editorRowAt(E.cy);
+    editorInsertRow(E.cy + 1, &editorRowChars(row)[E.cx], row->size - E.cx);
+    editorRowTruncate(editorRowAt(E.cy), E.cx);
 
   }
   E.cy++;
   E.cx = 0;
 }
 
+/* remote edits can leave the cursor past the end of its row */
+void editorClampCursor() {
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  int size = E.cy < E.numrows ? editorRowAt(E.cy)->size : 0;
+  if (E.cx > size) E.cx = size;
+}
+
 void editorDelChar() {
   if (E.cy == E.numrows) return;
   if (E.cx == 0 && E.cy == 0) return;
   
-  if (netConf.connected) {
-  	char cmd[] = "delete"; 
-		serverSend(cmd, sizeof(cmd)-1);
-		serverSend(" ", 1);
-		
-		size_t maxnumlen = 10;
-   	char cx[maxnumlen + 2];
-    size_t l = snprintf(cx, sizeof cx, "%d ", E.cx);
-    serverSend(cx, l);
-    
-    char cy[maxnumlen + 2];
-    l = snprintf(cy, sizeof cy, "%d\n", E.cy);
-    serverSend(cy, l);
-  }
-
-  erow *row = &E.row[E.cy];
+  erow *row = editorRowAt(E.cy);
+  if (netConf.listening) {
+    if (E.cx > 0) {
+      char c = editorRowCharAt(row, E.cx - 1);
+      seqDeleteAt(E.cx - 1, E.cy, E.cx, E.cy, &c, 1);
+    } else {
+      seqDeleteAt(editorRowAt(E.cy - 1)->size, E.cy - 1, E.cx, E.cy, "\n", 1);
+    }
+  }
+
   if (E.cx > 0) {
     editorRowDelChar(row, E.cx - 1);
     E.cx--;
   } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+    E.cx = editorRowAt(E.cy - 1)->size;
+    editorRowAppendString(editorRowAt(E.cy - 1), editorRowChars(row), row->size);
     editorDelRow(E.cy);
     E.cy--;
   }
 }
 
+/*
+ * Text ops are applied to the rows in one go: the rows at either end are
+ * edited once each and the rows in between inserted or deleted whole, so
+ * a pasted block costs one render per row however long it is.
+ */
+void editorInsertText(int cx, int cy, char *s, int len) {
+	if (cy > E.numrows) return;
+  if (cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+  erow *row = editorRowAt(cy);
+  if (cx > row->size) return;
+
+  char *end = s + len;
+  char *nl = memchr(s, '\n', len);
+  if (nl == NULL) {
+    editorRowInsertString(row, cx, s, len);
+    return;
+  }
+
+  /* the rest of the row moves behind the last inserted line */
+  int lines = 0;
+  for (char *p = nl; p; p = memchr(p + 1, '\n', end - p - 1)) lines++;
+  editorOpenRows(cy + 1, lines);
+  row = editorRowAt(cy);
+  editorInitRow(editorRowAt(cy + lines), &editorRowChars(row)[cx], row->size - cx);
+  editorRowTruncate(row, cx);
+  editorRowAppendString(row, s, nl - s);
+
+  int at = cy + 1;
+  char *p = nl + 1;
+  while ((nl = memchr(p, '\n', end - p)) != NULL) {
+    editorInitRow(editorRowAt(at++), p, nl - p);
+    p = nl + 1;
+  }
+  editorRowInsertString(editorRowAt(at), 0, p, end - p);
+}
+
+/* deletes the text from (cx, cy) up to (ex, ey) */
+void editorDeleteSpan(int cx, int cy, int ex, int ey) {
+  erow *row = editorRowAt(cy);
+  if (ey == cy) {
+    editorRowDelRange(row, cx, ex - cx);
+    return;
+  }
+
+  erow *last = editorRowAt(ey);
+  editorRowTruncate(row, cx);
+  editorRowAppendString(row, &editorRowChars(last)[ex], last->size - ex);
+  editorDelRows(cy + 1, ey - cy);
+}
+
 /*** file i/o ***/
 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1;
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+/*
+ * The blocks of a mapped file are found in two passes over chunks of the
+ * mapping, in parallel for big files: count the lines each chunk starts,
+ * then note where every COLED_ROW_BLOCK-th line starts and the '\r' each
+ * block drops from line ends. A chunk owns the lines starting right after
+ * its newlines; the first one also owns line 0. No row is made, so a file
+ * costs a block per COLED_ROW_BLOCK lines until it is looked at.
+ */
+typedef struct lineScan {
+  char *start, *end;
+  int first;
+  int count;
+  int line;
+} lineScan;
+
+void *threadCountLines(void *arg) {
+  lineScan *scan = arg;
+  char *mapend = E.map + E.maplen;
+  char *p = scan->start;
+  scan->count = scan->first;
+  while ((p = memchr(p, '\n', scan->end - p)) != NULL) {
+    if (++p == mapend) break;
+    scan->count++;
+  }
+  return NULL;
+}
+
+void *threadIndexLines(void *arg) {
+  lineScan *scan = arg;
+  if (scan->count == 0) return NULL;
+
+  char *mapend = E.map + E.maplen;
+  char *line = scan->start;
+  if (!scan->first) line = (char *) memchr(line, '\n', scan->end - line) + 1;
+
+  for (int i = 0; i < scan->count; i++) {
+    int at = scan->line + i;
+    rowBlock *b = &E.blocks[at / COLED_ROW_BLOCK];
+    if (at % COLED_ROW_BLOCK == 0) b->start = line;
+
+    char *nl = memchr(line, '\n', mapend - line);
+    char *lineend = nl ? nl : mapend;
+    char *end = lineend;
+    while (end > line && end[-1] == '\r') end--;
+    /* a block can span two chunks */
+    if (end < lineend) __atomic_fetch_add(&b->cr, lineend - end, __ATOMIC_RELAXED);
+
+    line = lineend + 1;
+  }
+  return NULL;
+}
+
+int editorMapFile(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) return -1;
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return -1;
+  E.map = map;
+  E.maplen = st.st_size;
+
+  int nthreads = E.maplen / COLED_SCAN_CHUNK + 1;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu > 0 && nthreads > ncpu) nthreads = ncpu;
+  if (nthreads > COLED_SCAN_THREADS) nthreads = COLED_SCAN_THREADS;
+
+  lineScan scans[COLED_SCAN_THREADS];
+  pthread_t tids[COLED_SCAN_THREADS];
+  size_t chunk = E.maplen / nthreads;
+  for (int t = 0; t < nthreads; t++) {
+    scans[t].start = E.map + chunk * t;
+    scans[t].end = t == nthreads - 1 ? E.map + E.maplen : scans[t].start + chunk;
+    scans[t].first = t == 0;
+  }
+
+  for (int t = 1; t < nthreads; t++) {
+    pthread_create(&tids[t], NULL, threadCountLines, &scans[t]);
+  }
+  threadCountLines(&scans[0]);
+  for (int t = 1; t < nthreads; t++) pthread_join(tids[t], NULL);
+
+  int numrows = 0;
+  for (int t = 0; t < nthreads; t++) {
+    scans[t].line = numrows;
+    numrows += scans[t].count;
+  }
+
+  int nblocks = (numrows + COLED_ROW_BLOCK - 1) / COLED_ROW_BLOCK;
+  editorAddBlocks(0, nblocks);
+
+  for (int t = 1; t < nthreads; t++) {
+    pthread_create(&tids[t], NULL, threadIndexLines, &scans[t]);
   }
-  return buf;
+  threadIndexLines(&scans[0]);
+  for (int t = 1; t < nthreads; t++) pthread_join(tids[t], NULL);
+
+  for (int i = 0; i < nblocks; i++) {
+    rowBlock *b = &E.blocks[i];
+    char *end = i + 1 < nblocks ? b[1].start : E.map + E.maplen;
+    b->n = i + 1 < nblocks ? COLED_ROW_BLOCK : numrows - i * COLED_ROW_BLOCK;
+    b->len = end - b->start;
+    /* the rows and a newline after each, the last one's not in the file */
+    b->size = b->len - b->cr + (end[-1] != '\n');
+  }
+  E.numrows = numrows;
+  return 0;
 }
 
 void editorOpen(char *filename) {
@@ -430,6 +1275,12 @@ void editorOpen(char *filename) {
   FILE *fp = fopen(filename, "r");
   if (!fp) die("fopen");
 
+  if (E.numrows == 0 && editorMapFile(fileno(fp)) == 0) {
+    fclose(fp);
+    E.dirty = 0;
+    return;
+  }
+
   char *line = NULL;
   size_t linecap = 0;
   ssize_t linelen;
@@ -445,7 +1296,251 @@ void editorOpen(char *filename) {
   E.dirty = 0;
 }
 
+/*
+ * Saving streams the rows straight from their buffers with writev into a
+ * temp file next to the target, then fsyncs and renames it into place, so
+ * the old file stays intact until the new one is complete. Consecutive
+ * mapped rows are still contiguous in the mapping, newlines included, and
+ * collapse into a single iovec; an unsplit block goes out as it is
+ * without being split, unless it has '\r' to drop.
+ */
+int editorAppendIov(struct iovec *iov, int cnt, char *base, size_t len) {
+  if (len == 0) return cnt;
+  if (cnt > 0 && (char *) iov[cnt - 1].iov_base + iov[cnt - 1].iov_len == base) {
+    iov[cnt - 1].iov_len += len;
+    return cnt;
+  }
+  iov[cnt].iov_base = base;
+  iov[cnt].iov_len = len;
+  return cnt + 1;
+}
+
+int editorRowsToIov(int *at, struct iovec *iov, int max, size_t *len) {
+  static char newline = '\n';
+  int cnt = 0;
+
+  while (*at < E.numrows && cnt + 3 <= max) {
+    rowBlock *b = &E.blocks[editorBlockAt(*at)];
+    if (b->rows == NULL && b->cr == 0) {
+      cnt = editorAppendIov(iov, cnt, b->start, b->len);
+      if (b->start[b->len - 1] != '\n') cnt = editorAppendIov(iov, cnt, &newline, 1);
+      *len += b->size;
+      *at += b->n;
+      continue;
+    }
+
+    erow *row = editorRowAt(*at);
+    char *tail = &row->chars[row->gap + row->gaplen];
+    cnt = editorAppendIov(iov, cnt, row->chars, row->gap);
+    cnt = editorAppendIov(iov, cnt, tail, row->size - row->gap);
+
+    char *end = &row->chars[row->size + row->gaplen];
+    if (row->storage == ROW_OWNED && row->gap == row->size && row->gaplen > 0) {
+      end = &row->chars[row->size];
+      *end = '\n';
+      cnt = editorAppendIov(iov, cnt, end, 1);
+    } else if (row->storage == ROW_MAPPED && end < E.map + E.maplen && *end == '\n') {
+      cnt = editorAppendIov(iov, cnt, end, 1);
+    } else {
+      cnt = editorAppendIov(iov, cnt, &newline, 1);
+    }
+
+    *len += row->size + 1;
+    (*at)++;
+  }
+  return cnt;
+}
+
+int editorWritev(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t w = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t) w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (w > 0) {
+      iov->iov_base = (char *) iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
+
+int editorCommitSave(int fd, char *tmpname, char *filename, size_t len) {
+  if (tmpname == NULL) {
+    if (ftruncate(fd, len) == -1 || fsync(fd) == -1) return -1;
+    close(fd);
+    return 0;
+  }
+  if (fsync(fd) == -1) return -1;
+  if (rename(tmpname, filename) == -1) return -1;
+  close(fd);
+
+  char *slash = strrchr(filename, '/');
+  char *dir = slash ? strndup(filename, slash - filename + 1) : strdup(".");
+  int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+  free(dir);
+  if (dirfd != -1) {
+    fsync(dirfd);
+    close(dirfd);
+  }
+  return 0;
+}
+
+/*
+ * filename is the file itself, symlinks resolved, so a link stays a link.
+ * The temp file gets the owner and mode of the file it replaces. A file
+ * whose owner can't be kept, that has other hard links or whose directory
+ * we can't write to is written in place instead, which is not atomic:
+ * *tmpname is NULL then.
+ */
+int editorOpenTemp(char *filename, char **tmpname) {
+  struct stat st;
+  int exists = stat(filename, &st) == 0;
+  *tmpname = NULL;
+  if (exists && st.st_nlink > 1) return open(filename, O_WRONLY);
+
+  *tmpname = malloc(strlen(filename) + 8);
+  sprintf(*tmpname, "%s.XXXXXX", filename);
+  int fd = mkstemp(*tmpname);
+  if (fd == -1 || !exists) {
+    if (fd == -1 && exists && errno == EACCES) {
+      free(*tmpname);
+      *tmpname = NULL;
+      return open(filename, O_WRONLY);
+    }
+    mode_t mask = umask(0);
+    umask(mask);
+    if (fd != -1) fchmod(fd, 0644 & ~mask);
+    return fd;
+  }
+
+  if ((st.st_uid != geteuid() || st.st_gid != getegid()) &&
+      fchown(fd, st.st_uid, st.st_gid) == -1) {
+    close(fd);
+    unlink(*tmpname);
+    free(*tmpname);
+    *tmpname = NULL;
+    return open(filename, O_WRONLY);
+  }
+  fchmod(fd, st.st_mode & 07777);
+  return fd;
+}
+
+/* gives every row a copy of its text before the mapped file is written over */
+void editorUnmapRows() {
+  if (E.map == NULL) return;
+  for (int i = 0; i < E.nblocks; i++) {
+    rowBlock *b = &E.blocks[i];
+    if (b->rows == NULL) editorSplitBlock(b);
+    for (int j = 0; j < b->n; j++) editorRowDetach(&b->rows[j]);
+  }
+  munmap(E.map, E.maplen);
+  E.map = NULL;
+  E.maplen = 0;
+}
+
+void *threadSave(void *arg) {
+  saveJob *job = arg;
+  job->err = 0;
+  if (editorWritev(job->fd, job->iov, job->iovcnt) == -1 ||
+      editorCommitSave(job->fd, job->tmpname, job->filename, job->len) == -1) {
+    job->err = errno;
+    close(job->fd);
+    if (job->tmpname) unlink(job->tmpname);
+  }
+  write(job->done[1], "", 1);
+  return NULL;
+}
+
+void editorRetireChars(char *chars) {
+  saveJob *job = E.saving;
+  job->retired = realloc(job->retired, sizeof(char *) * (job->nretired + 1));
+  job->retired[job->nretired++] = chars;
+}
+
+/*
+ * Big documents are written from a thread. The iovec list is built up
+ * front and every heap row lends its buffer to the save (ROW_SAVING):
+ * editing such a row copies it first and the old buffer is retired until
+ * the save is done.
+ */
+void editorBackgroundSave(int fd, char *filename, char *tmpname) {
+  saveJob *job = malloc(sizeof(saveJob));
+  job->filename = filename;
+  job->tmpname = tmpname;
+  job->fd = fd;
+  job->len = 0;
+  job->dirty = E.dirty;
+  job->retired = NULL;
+  job->nretired = 0;
+
+  int cap = IOV_MAX;
+  job->iov = malloc(sizeof(struct iovec) * cap);
+  job->iovcnt = 0;
+  int at = 0;
+  while (at < E.numrows) {
+    if (cap - job->iovcnt < IOV_MAX) {
+      cap *= 2;
+      job->iov = realloc(job->iov, sizeof(struct iovec) * cap);
+    }
+    job->iovcnt += editorRowsToIov(&at, &job->iov[job->iovcnt], IOV_MAX, &job->len);
+  }
+
+  for (int i = 0; i < E.nblocks; i++) {
+    rowBlock *b = &E.blocks[i];
+    for (int j = 0; b->rows && j < b->n; j++) {
+      if (b->rows[j].storage == ROW_OWNED) b->rows[j].storage = ROW_SAVING;
+    }
+  }
+
+  if (pipe(job->done) == -1) die("pipe");
+  editorWatch(job->done[0]);
+  E.saving = job;
+  pthread_create(&job->tid, NULL, threadSave, job);
+  editorSetStatusMessage(5, "Saving %zu bytes in background...", job->len);
+}
+
+void editorFinishSave() {
+  saveJob *job = E.saving;
+  pthread_join(job->tid, NULL);
+
+  for (int i = 0; i < job->nretired; i++) free(job->retired[i]);
+  for (int i = 0; i < E.nblocks; i++) {
+    rowBlock *b = &E.blocks[i];
+    for (int j = 0; b->rows && j < b->n; j++) {
+      if (b->rows[j].storage == ROW_SAVING) b->rows[j].storage = ROW_OWNED;
+    }
+  }
+
+  if (job->err == 0) {
+    editorSetStatusMessage(5, "%zu bytes written to disk", job->len);
+    E.dirty -= job->dirty;
+  } else {
+    editorSetStatusMessage(5, "Can't save! I/O error: %s", strerror(job->err));
+  }
+
+  E.saving = NULL;
+  editorUnwatch(job->done[0]);
+  close(job->done[0]);
+  close(job->done[1]);
+  free(job->retired);
+  free(job->iov);
+  free(job->filename);
+  free(job->tmpname);
+  free(job);
+}
+
 void editorSave() {
+  if (E.saving) {
+    editorSetStatusMessage(5, "Save already in progress");
+    return;
+  }
   if (E.filename == NULL) {
     E.filename = editorPrompt("Save as: %s (ESC to cancel)", 0);
     if (E.filename == NULL) {
@@ -453,22 +1548,39 @@ void editorSave() {
       return;
     }
   }
-  int len;
-  char *buf = editorRowsToString(&len);
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+
+  size_t len = editorTextSize();
+  char *filename = realpath(E.filename, NULL);
+  if (filename == NULL) filename = strdup(E.filename);
+  char *tmpname;
+  int fd = editorOpenTemp(filename, &tmpname);
   if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        editorSetStatusMessage(5, "%d bytes written to disk", len);
-        E.dirty = 0;
-        return;
-      }
+    if (tmpname == NULL) editorUnmapRows();
+    if (len >= COLED_BG_SAVE_BYTES) {
+      editorBackgroundSave(fd, filename, tmpname);
+      return;
+    }
+
+    struct iovec iov[IOV_MAX];
+    int at = 0, err = 0;
+    while (at < E.numrows && !err) {
+      size_t batch = 0;
+      err = editorWritev(fd, iov, editorRowsToIov(&at, iov, IOV_MAX, &batch));
+    }
+    if (!err && editorCommitSave(fd, tmpname, filename, len) == 0) {
+      free(filename);
+      free(tmpname);
+      editorSetStatusMessage(5, "%zu bytes written to disk", len);
+      E.dirty = 0;
+      return;
     }
+    int saved = errno;
     close(fd);
+    if (tmpname) unlink(tmpname);
+    errno = saved;
   }
-  free(buf);
+  free(filename);
+  free(tmpname);
   editorSetStatusMessage(5, "Can't save! I/O error: %s", strerror(errno));
 }
 
@@ -481,8 +1593,6 @@ void network() {
     int decision = multipleChoice(msg, 2, "y", "n");
     if (decision == 0) {
       editorSave();
-      editorRefreshScreen();
-      delay(2);
       break;
     }
 
@@ -519,82 +1629,80 @@ void network() {
 
 void createSession() {
   if (!netConf.connected && connectToServer() < 0) {
-    setAndFreeze("Error with connecting to server", 4);
+    editorSetStatusMessage(4, "Error with connecting to server");
     return;
   }
 
   char *pass = editorPrompt("Set password: %s (ESC to cancel)", MAXPASSLEN);
   if (!pass) return;
 
-  char *cmd = "create";
-  char msg[strlen(cmd) + strlen(pass) + 3];
-  size_t l = snprintf(msg, sizeof(msg),
-    "%s %s\n", cmd, pass);
-
   //create session request to server with password
   editorSetStatusMessage(2, "Sending...");
   editorRefreshScreen();
 
-  if (serverSend(msg, sizeof(msg) - 1) < 0) {
-    setAndFreeze("Send error", 2);
-    netConf.connected = 0;
+  if (serverSendFrame(OP_CREATE, 0, 0, pass, strlen(pass)) < 0) {
+    editorSetStatusMessage(2, "Send error");
+    netDisconnect();
     return;
   }
 
   editorSetStatusMessage(2, "Receiving...");
   editorRefreshScreen();
 
-  int anslen = 0;
-  char *id = serverReceive(&anslen);
-  if (anslen <= 0) {
-    setAndFreeze("Receive error", 5);
-    netConf.connected = 0;
+  netFrame ans;
+  if (serverReceiveFrame(&ans) < 0 || ans.op != OP_REPLY || ans.len == 0) {
+    editorSetStatusMessage(5, "Receive error");
+    netDisconnect();
     return;
   }
+  char *id = strndup(ans.payload, ans.len);
 
   free(netConf.id);
   free(netConf.pass);
   netConf.id = id;
   netConf.pass = pass;
 
-  cmd = "your id is";
-  char msg2[strlen(cmd) + strlen(id) + 2];
-  l = snprintf(msg2, sizeof(msg2), "%s %s", cmd, id);
+  netConf.seq.site = ans.a;
+  netConf.rev = 0;
+  seqReset();
   listenServer();
-  setAndFreeze(msg2, 5);
+  editorSetStatusMessage(5, "your id is %s", id);
 }
 
 void joinSession() {
   if (!netConf.connected && connectToServer() < 0) {
-    setAndFreeze("Error with connecting to server", 4);
+    editorSetStatusMessage(4, "Error with connecting to server");
     return;
   }
 
   char needid = 1, needpass = 1;
   char *id, *pass;
+  char *idmsg = "Enter id: %s (ESC to cancel)";
+  char *passmsg = "Enter password: %s (ESC to cancel)";
 
   while (1) {
     if (needid) {
-      id = editorPrompt("Enter id: %s (ESC to cancel)", IDLEN);
+      id = editorPrompt(idmsg, IDLEN);
       if (!id) return;
     }
 
     if (needpass) {
-      pass = editorPrompt("Enter password: %s (ESC to cancel)", MAXPASSLEN);
+      pass = editorPrompt(passmsg, MAXPASSLEN);
       if (!pass) return;
     }
 
-    char *cmd = "join";
-    char msg[strlen(cmd) + strlen(id) + strlen(pass) + 4];
-    size_t l = snprintf(msg, sizeof(msg),
-      "%s %s %s\n", cmd, id, pass);
+    size_t idlen = strlen(id), passlen = strlen(pass);
+    char msg[idlen + passlen];
+    memcpy(msg, id, idlen);
+    memcpy(&msg[idlen], pass, passlen);
 
     editorSetStatusMessage(2, "Sending...");
     editorRefreshScreen();
 
-    if (serverSend(msg, sizeof(msg)-1) < 0) {
-      setAndFreeze("Send error", 2);
-      netConf.connected = 0;
+    if (serverSendFrame(OP_JOIN, idlen, JOIN_CHUNKS | JOIN_PACKED,
+                        msg, sizeof(msg)) < 0) {
+      editorSetStatusMessage(2, "Send error");
+      netDisconnect();
       free(id);
       free(pass);
       return;
@@ -603,37 +1711,47 @@ void joinSession() {
     editorSetStatusMessage(2, "Receiving...");
     editorRefreshScreen();
 
-    int anslen = 0;
-    char *ans = serverReceive(&anslen);
-    if (anslen <= 0) {
-      setAndFreeze("Receive error", 5);
-      netConf.connected = 0;
+    netFrame ans;
+    if (serverReceiveFrame(&ans) < 0 || ans.op != OP_REPLY) {
+      editorSetStatusMessage(5, "Receive error");
+      netDisconnect();
       free(id);
       free(pass);
       return;
     }
 
-    if (strcmp(ans, "invalid id") == 0) {
-      setAndFreeze("Invalid id", 4);
+    if (netFrameIs(&ans, "invalid id")) {
+      idmsg = "Invalid id. Enter id: %s (ESC to cancel)";
+      free(id);
       needid = 1;
       needpass = 0;
       continue;
     }
 
-    if (strcmp(ans, "invalid pass") == 0) {
-      setAndFreeze("Invalid pass", 4);
+    if (netFrameIs(&ans, "invalid pass")) {
+      passmsg = "Invalid pass. Enter password: %s (ESC to cancel)";
+      free(pass);
       needid = 0;
       needpass = 1;
       continue;
     }
 
-    if (strcmp(ans, "success") == 0) {
-      editorSetStatusMessage(4, "Successful join");
-      editorRefreshScreen();
+    if (netFrameIs(&ans, "no text")) {
+      editorSetStatusMessage(4, "The host has not sent the text, try later");
+      netDisconnect();
+      free(id);
+      free(pass);
+      return;
+    }
+
+    if (netFrameIs(&ans, "success")) {
+      netConf.seq.site = ans.a;
+      editorSetStatusMessage(4, "Successful join");
+      editorRefreshScreen();
       break;
     }
 
-    setAndFreeze("Unknown server response", 4);
+    editorSetStatusMessage(4, "Unknown server response");
     return;
   }
 
@@ -642,57 +1760,245 @@ void joinSession() {
   netConf.id = id;
   netConf.pass = pass;
 
-  int sizeN = 0;
-  char *numrowsbuf = serverReceive(&sizeN);
-  if (sizeN <= 0) {
-    free(numrowsbuf);
-    setAndFreeze("Receive numrows error", 4);
+  /* a dropped snapshot goes on from the last chunk that came in whole */
+  netSnap snap = {NULL, 0, 0, 0, 0, 0};
+  int res = netReceiveSnapshot(&snap, NULL);
+  for (int tries = 0; res == 0 && tries < COLED_RESUME_TRIES; tries++) {
+    editorSetStatusMessage(4, "Resuming at chunk %d of %d", snap.next, snap.count);
+    editorRefreshScreen();
+    netDisconnect();
+    if (netRejoin(snap.rev, snap.next, JOIN_CHUNKS | JOIN_PACKED) < 0) break;
+    res = netReceiveSnapshot(&snap, NULL);
+  }
+
+  if (res <= 0 || netLoadSnapshot(snap.data, snap.len) < 0) {
+    free(snap.data);
     free(id);
     free(pass);
     netConf.id = NULL;
     netConf.pass = NULL;
-    netConf.connected = 0;
+    netDisconnect();
+    editorSetStatusMessage(4, "Receive snapshot error");
     return;
   }
-  
-  int numrows = atoi(numrowsbuf);
-  int oldnum = E.numrows;
-  for (int i = 0; i < numrows; i++) {
-    int anslen = 0;
-    char *ans = serverReceive(&anslen);
-    if (anslen < 0) {
-      free(numrowsbuf);
-      free(ans);
-      free(id);
-      free(pass);
-      netConf.id = NULL;
-      netConf.pass = NULL;
-      netConf.connected = 0;
-      setAndFreeze("Receive rows error", 4);
-      return;
+  free(snap.data);
+
+  //cx, cy = 0, 0?
+  editorRefreshScreen();
+  listenServer();
+}
+
+/*
+ * Snapshots come in chunks of the text as the server holds it: the row
+ * count, each row after its length, then the sequence runs. A chunk has
+ * its index, its unpacked length if the server packed it and the CRC-32
+ * of its bytes in front of them. The head names the revision of the
+ * snapshot and the chunk it starts from, the one asked for when resuming
+ * if the server still has that snapshot and the first otherwise. head is
+ * that frame if it has been read already.
+ *
+ * 1 once it is all in, 0 if the connection dropped or a chunk came in
+ * damaged, either of which can be resumed, and -1 on anything else.
+ */
+int netReceiveSnapshot(netSnap *snap, netFrame *head) {
+  netFrame f;
+  unsigned int start;
+  if (head) {
+    f = *head;
+  } else if (serverReceiveFrame(&f) < 0) {
+    return 0;
+  }
+  if (f.op != OP_CHUNKS || netGetVarint(f.payload, f.len, &start) == 0) return -1;
+  if (start == 0 || f.b != snap->rev) {
+    snap->len = 0;
+    snap->next = 0;
+  }
+  if ((int) start != snap->next) return -1;
+  snap->rev = f.b;
+  snap->count = f.a;
+
+  while (snap->next < snap->count) {
+    if (serverReceiveFrame(&f) < 0) return 0;
+    if (f.op != OP_CHUNK || f.a != snap->next || f.len < 4) return -1;
+
+    int raw = f.b ? f.b : f.len - 4;
+    if (snap->len + raw > snap->cap) {
+      snap->cap = snap->cap * 2 > snap->len + raw ? snap->cap * 2 : snap->len + raw;
+      snap->data = realloc(snap->data, snap->cap);
+    }
+    char *dst = &snap->data[snap->len];
+    unsigned char *p = (unsigned char *) f.payload;
+    unsigned int crc = p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+    if (f.b) {
+      if (netUnpack(&f.payload[4], f.len - 4, dst, raw) != raw) return 0;
+    } else {
+      memcpy(dst, &f.payload[4], raw);
     }
+    if (netCrc32(dst, raw) != crc) return 0;
 
-    if (i < oldnum) {
-      editorDelRow(i);
+    snap->len += raw;
+    snap->next++;
+    if (snap->next % 16 == 0) {
+      editorSetStatusMessage(2, "Receiving %d of %d chunks", snap->next, snap->count);
+      editorRefreshScreen();
     }
-    editorInsertRow(i, ans, anslen);
-    free(ans);
   }
-  
-  for (int i = oldnum - 1; numrows >= 0 && i >= numrows; i--) {
-  	editorDelRow(i);
+  return 1;
+}
+
+/*
+ * Joins the session again on a new connection, saying it got to chunk
+ * next of the snapshot at revision rev, or with JOIN_SINCE that it has
+ * applied the edits up to rev. 0 once in, -1 if the connection failed
+ * and -2 if the session turned us away.
+ */
+int netRejoin(int rev, int next, int flags) {
+  if (!netConf.connected && connectToServer() < 0) return -1;
+
+  size_t idlen = strlen(netConf.id), passlen = strlen(netConf.pass);
+  char msg[idlen + passlen];
+  memcpy(msg, netConf.id, idlen);
+  memcpy(&msg[idlen], netConf.pass, passlen);
+
+  netFrame ans;
+  if (serverSendFrame(OP_RESUME, rev, next, NULL, 0) < 0 ||
+      serverSendFrame(OP_JOIN, idlen, flags, msg, sizeof(msg)) < 0 ||
+      serverReceiveFrame(&ans) < 0 || ans.op != OP_REPLY) {
+    return -1;
   }
-  
-  //cx, cy = 0, 0?
-  editorRefreshScreen();
-  free(numrowsbuf);
+  if (!netFrameIs(&ans, "success")) return -2;
+  netConf.seq.site = ans.a;
+  return 0;
+}
+
+/*
+ * Takes the session up again after the connection dropped. What came in
+ * is applied first, so the revision we say we got to covers it, and the
+ * server sends the edits made since if its history still has them all,
+ * a snapshot otherwise. Then the ops that were never acked are sent
+ * again, since they may have been lost with the connection, and those
+ * queued meanwhile after them; their ids make the ones that got through
+ * a no-op. A snapshot may be missing any of them, so they are put on it
+ * first. -1 if the connection failed again, -2 if the session is gone.
+ */
+int netResync() {
+  netApplyOps(netConf.log.n - netConf.log.head);
+  int res = netRejoin(netConf.rev, 0, JOIN_CHUNKS | JOIN_PACKED | JOIN_SINCE);
+  if (res < 0) return res;
+
+  netFrame f;
+  if (serverReceiveFrame(&f) < 0) return -1;
+  netQueue *q = &netConf.out;
+  if (f.op == OP_SYNC) {
+    editorSetStatusMessage(3, "Reconnected at revision %d", f.a);
+  } else {
+    netSnap snap = {NULL, 0, 0, 0, 0, 0};
+    res = netReceiveSnapshot(&snap, &f) > 0 ? netLoadSnapshot(snap.data, snap.len) : -1;
+    free(snap.data);
+    if (res < 0) return -1;
+
+    netSerializeQueue();
+    for (size_t off = q->sent; off < q->len; ) {
+      off = netFrameAt(q->buf, off, q->len, &f);
+      if (f.op == OP_SEQ_INSERT) netSeqInsert(f.a, f.b, f.payload, f.len);
+      if (f.op == OP_SEQ_DELETE) netSeqDelete(f.a, f.b, f.payload, f.len);
+    }
+    editorClampCursor();
+    editorSetStatusMessage(3, "Reconnected with a snapshot");
+  }
+
   listenServer();
+  netSerializeQueue();
+  if (q->len > q->sent && serverSend(&q->buf[q->sent], q->len - q->sent) < 0) return -1;
+  return 0;
+}
+
+/* unpacks a chunk the server packed; its length, -1 if it is malformed */
+int netUnpack(const char *src, int len, char *dst, int cap) {
+  const unsigned char *s = (const unsigned char *) src;
+  int i = 0, o = 0;
+  while (i < len) {
+    int token = s[i++];
+    int n = token >> 4, c;
+    if (n == 15) {
+      do {
+        if (i == len) return -1;
+        n += c = s[i++];
+      } while (c == 255);
+    }
+    if (n > len - i || n > cap - o) return -1;
+    memcpy(&dst[o], &s[i], n);
+    i += n;
+    o += n;
+    if (i == len) break;
+
+    if (len - i < 2) return -1;
+    int off = s[i] | s[i + 1] << 8;
+    i += 2;
+    int m = token & 15;
+    if (m == 15) {
+      do {
+        if (i == len) return -1;
+        m += c = s[i++];
+      } while (c == 255);
+    }
+    m += 4;
+    if (off == 0 || off > o || m > cap - o) return -1;
+    /* byte by byte, a match may overlap what it copies */
+    for (int k = 0; k < m; k++, o++) dst[o] = dst[o - off];
+  }
+  return o;
 }
 
+unsigned int netCrc32(const char *s, size_t len) {
+  static unsigned int table[256];
+  if (table[1] == 0) {
+    for (unsigned int i = 0; i < 256; i++) {
+      unsigned int c = i;
+      for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  }
+  unsigned int crc = 0xffffffff;
+  for (size_t i = 0; i < len; i++) {
+    crc = table[(crc ^ (unsigned char) s[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc ^ 0xffffffff;
+}
+
+/* takes over the rows and runs of a snapshot; -1 if they don't parse */
+int netLoadSnapshot(char *s, size_t len) {
+  unsigned int numrows, rowlen = 0;
+  size_t off = netGetVarint(s, len, &numrows), end = off;
+  if (off == 0) return -1;
+  for (unsigned int i = 0; i < numrows; i++) {
+    int res = netGetVarint(&s[end], len - end, &rowlen);
+    if (res == 0 || rowlen > len - end - res) return -1;
+    end += res + rowlen;
+  }
+
+  editorDelRows(0, E.numrows);
+  for (int i = 0; i < (int) numrows; i++) {
+    off += netGetVarint(&s[off], len - off, &rowlen);
+    editorInsertRow(i, &s[off], rowlen);
+    off += rowlen;
+  }
+
+  /* without runs that add up the ids start over and edits fall back to positions */
+  if (!seqLoad(&s[off], len - off)) seqReset();
+  return 0;
+}
+
+/*
+ * Connections open with a one-line "hello bin" handshake; from then on
+ * both directions speak frames: an opcode byte, then the row/col args and
+ * the payload length as LEB128 varints, then the payload. The server keeps
+ * the line protocol for clients that skip the handshake.
+ */
 int connectToServer() {
   netConf.server = socket(AF_INET, SOCK_STREAM, 0);
   if (netConf.server < 0) {
-    setAndFreeze("Socket error", 2);
+    editorSetStatusMessage(2, "Socket error");
     return netConf.server;
   }
 
@@ -704,9 +2010,27 @@ int connectToServer() {
   int res = connect(netConf.server, (const struct sockaddr *) &peer, sizeof(peer));
 
   if (res < 0) {
-    setAndFreeze("Connect error", 2);
+    close(netConf.server);
+    netConf.server = -1;
+    editorSetStatusMessage(2, "Connect error");
     return res;
   }
+  netResetReader();
+  int on = 1;
+  setsockopt(netConf.server, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  int anslen = 0;
+  char *ans = NULL;
+  if (serverSend(COLED_HELLO "\n", sizeof(COLED_HELLO)) < 0 ||
+      (ans = serverReceive(&anslen)) == NULL || anslen <= 0 ||
+      strcmp(ans, "bin") != 0) {
+    free(ans);
+    close(netConf.server);
+    netConf.server = -1;
+    editorSetStatusMessage(2, "Handshake error");
+    return -1;
+  }
+  free(ans);
   netConf.connected = 1;
 
   return 1;
@@ -716,13 +2040,13 @@ int disconnectFromServer() {
   netConf.connected = 0;
   int res = shutdown(netConf.server, 1);
   if (res < 0) {
-    setAndFreeze("Disconnect error", 2);
+    editorSetStatusMessage(2, "Disconnect error");
     return res;
   }
 
   res = close(netConf.server);
   if (res < 0) {
-    setAndFreeze("Close socket error", 2);
+    editorSetStatusMessage(2, "Close socket error");
     return res;
   }
 
@@ -730,44 +2054,463 @@ int disconnectFromServer() {
 }
 
 int serverSend(char *buf, size_t len) {
-  int count = 0;
   while (len > 0) {
-    /*if (count > 0) {
-      editorSetStatusMessage(5, "%s send count %d", buf, count);
-      editorRefreshScreen();
-      delay(3);
-    }*/
     int i = send(netConf.server, buf, len, 0);
     if (i < 1) return -1;
     buf += i;
     len -= i;
-    count++;
   }
   return 1;
 }
 
-char *serverReceive(int *len) {
-  size_t bufsize = 32;
-  char *buf = malloc(bufsize);
-  size_t buflen = 0;
-  buf[0] = 0;
+size_t netPutVarint(char *buf, unsigned int v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    buf[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  buf[n++] = v;
+  return n;
+}
+
+size_t netPutHeader(char *head, int op, int a, int b, size_t len) {
+  size_t n = 0;
+  head[n++] = op;
+  n += netPutVarint(&head[n], a);
+  n += netPutVarint(&head[n], b);
+  n += netPutVarint(&head[n], len);
+  return n;
+}
+
+int serverSendFrame(int op, int a, int b, const char *payload, size_t len) {
+  char head[1 + 3 * COLED_VARINT_MAX];
+  size_t n = netPutHeader(head, op, a, b, len);
+
+  struct iovec iov[2];
+  iov[0].iov_base = head;
+  iov[0].iov_len = n;
+  iov[1].iov_base = (char *) payload;
+  iov[1].iov_len = len;
+  if (editorWritev(netConf.server, iov, len ? 2 : 1) == -1) return -1;
+  return 1;
+}
+
+/*
+ * Edits are not sent from the keypress path. They go into an outbound
+ * queue that is flushed COLED_FLUSH_MS after the first queued op, when
+ * flushTimer fires, or as soon as COLED_FLUSH_BYTES pile up, as one write. Typing, pasting
+ * and newlines are OP_SEQ_INSERTs of text and deletions OP_SEQ_DELETEs
+ * carrying the text they remove, so an op that continues the last queued
+ * one in both position and ids is merged into it: a burst of typing goes
+ * out as one multi-line insert, a run of backspaces as one range, and a
+ * backspace over what was just typed cancels it before it is ever sent.
+ *
+ * Each op also records the revision it was made at, the number of edits
+ * of the session applied here so far, which the server transforms its
+ * position from. Ops made at different revisions aren't merged. The ids
+ * and revision go in front of the text when the queue is flushed; ops
+ * are never held back waiting for acks, which only count them off. The
+ * flushed bytes stay until then, to be sent again after a drop. While
+ * the connection is down the queue keeps filling, and is flushed once
+ * netResync has taken the session up again.
+ */
+/* moves (*x, *y) past the text s */
+void netTextEnd(const char *s, int len, int *x, int *y) {
+  const char *end = s + len, *nl;
+  while ((nl = memchr(s, '\n', end - s)) != NULL) {
+    *x = 0;
+    (*y)++;
+    s = nl + 1;
+  }
+  *x += end - s;
+}
+
+/* 1 if the op took back the end of the last queued insert */
+int netQueueOp(int op, int a, int b, seqId id, seqId origin,
+               const char *payload, int len) {
+  netQueue *q = &netConf.out;
+  netPending *last = q->n ? &q->ops[q->n - 1] : NULL;
+  int same = last && last->base == netConf.rev;
+  int prepend = 0;
+  int ex = a, ey = b;
+  netTextEnd(payload, len, &ex, &ey);
+
+  if (same && last->op == OP_SEQ_INSERT && op == OP_SEQ_INSERT &&
+      last->ex == a && last->ey == b &&
+      id.clock == last->id.clock + last->len &&
+      origin.site == id.site && origin.clock == id.clock - 1) {
+    /* continues the insert */
+  } else if (last && last->op == OP_SEQ_INSERT && op == OP_SEQ_DELETE &&
+             len == 1 && last->ex == ex && last->ey == ey &&
+             id.site == last->id.site &&
+             id.clock == last->id.clock + last->len - 1) {
+    /* deletes the last char of the insert */
+    last->len--;
+    q->bytes--;
+    last->ex = last->a;
+    last->ey = last->b;
+    netTextEnd(last->payload, last->len, &last->ex, &last->ey);
+    if (last->len == 0) q->n--;
+    return 1;
+  } else if (same && last->op == OP_SEQ_DELETE && op == OP_SEQ_DELETE &&
+             last->a == a && last->b == b && id.site == last->id.site &&
+             id.clock == last->id.clock + last->len) {
+    /* forward delete, the range grows at its end */
+  } else if (same && last->op == OP_SEQ_DELETE && op == OP_SEQ_DELETE &&
+             last->a == ex && last->b == ey && id.site == last->id.site &&
+             id.clock + len == last->id.clock) {
+    /* backspace, the range grows at its start */
+    prepend = 1;
+    last->a = a;
+    last->b = b;
+    last->id = id;
+  } else {
+    if (q->n == q->cap) {
+      q->cap = q->cap ? q->cap * 2 : 16;
+      q->ops = realloc(q->ops, sizeof(netPending) * q->cap);
+      for (int i = q->n; i < q->cap; i++) {
+        q->ops[i].cap = 0;
+        q->ops[i].payload = NULL;
+      }
+    }
+    if (q->n == 0) editorArmTimer(netConf.flushTimer, netConf.flushInterval, 0);
+    last = &q->ops[q->n++];
+    last->op = op;
+    last->a = a;
+    last->b = b;
+    last->id = id;
+    last->origin = origin;
+    last->base = netConf.rev;
+    last->len = 0;
+  }
+
+  if (last->len + len > last->cap) {
+    last->cap = (last->len + len) * 2;
+    last->payload = realloc(last->payload, last->cap);
+  }
+  if (prepend) {
+    memmove(&last->payload[len], last->payload, last->len);
+    memcpy(last->payload, payload, len);
+  } else if (len) {
+    memcpy(&last->payload[last->len], payload, len);
+  }
+  last->len += len;
+  if (op == OP_SEQ_INSERT) {
+    last->ex = ex;
+    last->ey = ey;
+  }
+
+  q->bytes += len;
+  if (q->bytes >= COLED_FLUSH_BYTES) netFlush();
+  return 0;
+}
+
+/* moves the queued ops into buf, behind those waiting for acks */
+void netSerializeQueue() {
+  netQueue *q = &netConf.out;
+  size_t need = q->len + q->bytes + q->n * (1 + 8 * COLED_VARINT_MAX);
+  if (need > q->bufcap && q->sent > 0) {
+    memmove(q->buf, &q->buf[q->sent], q->len - q->sent);
+    need -= q->sent;
+    q->len -= q->sent;
+    q->sent = 0;
+  }
+  if (need > q->bufcap) {
+    q->bufcap = need * 2;
+    q->buf = realloc(q->buf, q->bufcap);
+  }
+
+  size_t len = q->len;
+  for (int i = 0; i < q->n; i++) {
+    netPending *p = &q->ops[i];
+    char ids[5 * COLED_VARINT_MAX];
+    size_t n = netPutVarint(ids, p->id.site);
+    n += netPutVarint(&ids[n], p->id.clock);
+    if (p->op == OP_SEQ_INSERT) {
+      n += netPutVarint(&ids[n], p->origin.site);
+      n += netPutVarint(&ids[n], p->origin.clock);
+    }
+    n += netPutVarint(&ids[n], p->base);
+    len += netPutHeader(&q->buf[len], p->op, p->a, p->b, n + p->len);
+    memcpy(&q->buf[len], ids, n);
+    len += n;
+    memcpy(&q->buf[len], p->payload, p->len);
+    len += p->len;
+  }
+  q->len = len;
+  netConf.unacked += q->n;
+  q->n = 0;
+  q->bytes = 0;
+}
+
+int netFlushPending() {
+  netQueue *q = &netConf.out;
+  editorArmTimer(netConf.flushTimer, 0, 0);
+  size_t from = q->len;
+  netSerializeQueue();
+  if (q->len == from) return 1;
+  return serverSend(&q->buf[from], q->len - from);
+}
+
+/* 1 if the char of id is in an insert still queued */
+int netQueuedId(seqId id) {
+  netQueue *q = &netConf.out;
+  for (int i = 0; i < q->n; i++) {
+    netPending *p = &q->ops[i];
+    if (p->op == OP_SEQ_INSERT && p->id.site == id.site &&
+        id.clock >= p->id.clock && id.clock - p->id.clock < (unsigned int) p->len) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Our cursor goes out as the id of the char before it, so it stays put
+ * for the others through their edits, and at most once per
+ * COLED_CURSOR_MS: a move made sooner waits for cursorTimer, and only
+ * where the cursor is by then is sent. A cursor after a char still
+ * queued waits for the batch, and goes out behind it when flushTimer
+ * fires, so the others know the char by the time the cursor names it
+ * and typing is not sent a key at a time.
+ */
+void netCursorMoved() {
+  if (!netConf.connected || !netConf.listening || netConf.cursorWait) return;
+  seqId at = seqOriginAt(E.cx, E.cy);
+  if (netConf.cursorSent && at.site == netConf.cursorAt.site &&
+      at.clock == netConf.cursorAt.clock) return;
+  if (netQueuedId(at)) return;
+
+  char ids[2 * COLED_VARINT_MAX];
+  size_t n = netPutVarint(ids, at.site);
+  n += netPutVarint(&ids[n], at.clock);
+  if (serverSendFrame(OP_CURSOR, E.cx, E.cy, ids, n) < 0) {
+    netDisconnect();
+    return;
+  }
+  netConf.cursorAt = at;
+  netConf.cursorSent = 1;
+  netConf.cursorWait = 1;
+  editorArmTimer(netConf.cursorTimer, COLED_CURSOR_MS, 0);
+}
+
+/* the cursor of another site moved, or left with it when no id follows */
+void netRemoteCursor(int cx, int cy, char *payload, int len) {
+  unsigned int v[3];
+  if (netGetIds(payload, len, v, 1) < 0) return;
+  int i = 0;
+  while (i < netConf.ncursors && netConf.cursors[i].site != (int) v[0]) i++;
+  if (netGetIds(payload, len, v, 3) < 0) {
+    if (i < netConf.ncursors) {
+      netConf.cursors[i] = netConf.cursors[--netConf.ncursors];
+    }
+    return;
+  }
+
+  if (i == netConf.ncursors) {
+    if (netConf.ncursors == netConf.cursorcap) {
+      netConf.cursorcap = netConf.cursorcap ? netConf.cursorcap * 2 : 8;
+      netConf.cursors = realloc(netConf.cursors,
+                                sizeof(netCursor) * netConf.cursorcap);
+    }
+    netConf.ncursors++;
+  }
+  netCursor *c = &netConf.cursors[i];
+  c->site = v[0];
+  c->at.site = v[1];
+  c->at.clock = v[2];
+  c->cx = cx;
+  c->cy = cy;
+}
+
+/* where a remote cursor is in the rows now */
+void netCursorPos(netCursor *c, int *x, int *y) {
+  *x = 0;
+  *y = 0;
+  if (!c->at.site && !c->at.clock) return;
+  int k, bi, ri;
+  seqRun *r = seqFind(c->at, x, y, &k, &bi, &ri);
+  if (r == NULL) {
+    *x = c->cx;
+    *y = c->cy;
+  } else if (!r->dead) {
+    seqAdvanceRows(x, y, k + 1);
+  }
+}
+
+/* reads the head of the frame at off of buf; the offset of the next one */
+size_t netFrameAt(char *buf, size_t off, size_t len, netFrame *f) {
+  unsigned int v[3];
+  int n = netGetIds(&buf[off + 1], len - off - 1, v, 3);
+  f->op = (unsigned char) buf[off];
+  f->a = v[0];
+  f->b = v[1];
+  f->len = v[2];
+  f->payload = &buf[off + 1 + n];
+  return off + 1 + n + v[2];
+}
+
+/* an ack counts off the oldest op waiting for one */
+void netAcked() {
+  netQueue *q = &netConf.out;
+  if (netConf.unacked == 0 || q->sent == q->len) return;
+  netFrame f;
+  netConf.unacked--;
+  q->sent = netFrameAt(q->buf, q->sent, q->len, &f);
+  if (q->sent >= q->len) {
+    q->sent = 0;
+    q->len = 0;
+  }
+}
+
+/* forgets every edit not sent or not acked, on leaving the session */
+void netDropQueue() {
+  netConf.out.n = 0;
+  netConf.out.bytes = 0;
+  netConf.out.sent = 0;
+  netConf.out.len = 0;
+  netConf.unacked = 0;
+}
+
+/* offline the queue waits for the connection to be taken up again */
+void netFlush() {
+  if (netConf.connected && netFlushPending() < 0) netDisconnect();
+}
+
+/*
+ * Incoming bytes land in a per-connection ring buffer filled with one
+ * large readv at a time. Frames are handed out as views into the ring and
+ * only copied to scratch when they wrap around its end; a view is valid
+ * until the next netFill.
+ */
+void netResetReader() {
+  netReader *r = &netConf.in;
+  if (r->buf == NULL) {
+    r->cap = COLED_NETBUF;
+    r->buf = malloc(r->cap);
+  }
+  r->head = 0;
+  r->tail = 0;
+}
+
+void netGrowReader(size_t need) {
+  netReader *r = &netConf.in;
+  size_t cap = r->cap;
+  while (cap < need) cap *= 2;
+  if (cap == r->cap) return;
+
+  char *buf = malloc(cap);
+  size_t avail = r->tail - r->head;
+  for (size_t i = 0; i < avail; i++) buf[i] = r->buf[(r->head + i) & (r->cap - 1)];
+  free(r->buf);
+  r->buf = buf;
+  r->cap = cap;
+  r->head = 0;
+  r->tail = avail;
+}
+
+int netFill() {
+  netReader *r = &netConf.in;
+  if (r->tail == r->head) {
+    r->head = 0;
+    r->tail = 0;
+  }
+  if (r->tail - r->head == r->cap) netGrowReader(r->cap * 2);
+
+  size_t mask = r->cap - 1;
+  size_t t = r->tail & mask, h = r->head & mask;
+  struct iovec iov[2];
+  iov[0].iov_base = &r->buf[t];
+  iov[0].iov_len = t >= h ? r->cap - t : h - t;
+  iov[1].iov_base = r->buf;
+  iov[1].iov_len = t >= h ? h : 0;
+
+  ssize_t n = readv(netConf.server, iov, iov[1].iov_len ? 2 : 1);
+  if (n > 0) r->tail += n;
+  return n;
+}
+
+int netParseVarint(size_t *off, int *v) {
+  netReader *r = &netConf.in;
+  unsigned int res = 0;
+  for (int shift = 0; shift < 7 * COLED_VARINT_MAX; shift += 7) {
+    if (r->head + *off >= r->tail) return 0;
+    unsigned char c = r->buf[(r->head + (*off)++) & (r->cap - 1)];
+    res |= (unsigned int) (c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      *v = res;
+      return 1;
+    }
+  }
+  return -1;
+}
+
+/* 1 and a frame view if one is buffered, 0 if more bytes are needed */
+int netNextFrame(netFrame *f) {
+  netReader *r = &netConf.in;
+  size_t off = 1;
+  int res;
+  if (r->tail == r->head) return 0;
+  if ((res = netParseVarint(&off, &f->a)) <= 0 ||
+      (res = netParseVarint(&off, &f->b)) <= 0 ||
+      (res = netParseVarint(&off, &f->len)) <= 0) {
+    return res;
+  }
+  if (f->len < 0) return -1;
+
+  if (off + f->len > r->cap) netGrowReader(off + f->len);
+  if (r->tail - r->head < off + f->len) return 0;
+
+  size_t mask = r->cap - 1;
+  f->op = (unsigned char) r->buf[r->head & mask];
+  size_t start = (r->head + off) & mask;
+  if (start + f->len <= r->cap) {
+    f->payload = &r->buf[start];
+  } else {
+    if ((size_t) f->len > r->scratchcap) {
+      r->scratchcap = f->len;
+      r->scratch = realloc(r->scratch, r->scratchcap);
+    }
+    size_t first = r->cap - start;
+    memcpy(r->scratch, &r->buf[start], first);
+    memcpy(&r->scratch[first], r->buf, f->len - first);
+    f->payload = r->scratch;
+  }
+  r->head += off + f->len;
+  return 1;
+}
 
+int serverReceiveFrame(netFrame *f) {
+  int res;
+  while ((res = netNextFrame(f)) == 0) {
+    if (netFill() <= 0) return -1;
+  }
+  return res;
+}
+
+int netFrameIs(netFrame *f, const char *s) {
+  return (size_t) f->len == strlen(s) && memcmp(f->payload, s, f->len) == 0;
+}
+
+/* A line from the ring, for the handshake; malloc'd, NULL on error. */
+char *serverReceive(int *len) {
+  netReader *r = &netConf.in;
+  size_t i = 0;
   while (1) {
-    int res = recv(netConf.server, buf + (buflen++), 1, 0);
-    buf[buflen] = 0;
+    for (; r->head + i < r->tail; i++) {
+      if (r->buf[(r->head + i) & (r->cap - 1)] != '\n') continue;
+
+      char *line = malloc(i + 1);
+      for (size_t j = 0; j < i; j++) line[j] = r->buf[(r->head + j) & (r->cap - 1)];
+      line[i] = '\0';
+      r->head += i + 1;
+      if (len != NULL) *len = i;
+      return line;
+    }
+    int res = netFill();
     if (res <= 0) {
       if (len != NULL) *len = res;
-      return buf;
-    }
-    if (buf[buflen-1] == '\n') {
-      if (len != NULL) *len = buflen-1;
-      buf[buflen-1] = 0;
-      return buf;
-      // return realloc(buf, buflen); //memory leak? realloc(buflen)
-    }
-    if (buflen == bufsize - 1) {
-      bufsize *= 2;
-      buf = realloc(buf, bufsize);
+      return NULL;
     }
   }
 }
@@ -789,180 +2532,1249 @@ char **splitStr(char *str, size_t *len) {
   return arr;
 }
 
-void *threadListen() {
-  time_t *lastTry = NULL;
-  while (1) {
-    E.netProcessing = 0;//only if buffer is empty
-    if (!netConf.connected && (!lastTry || *lastTry + netConf.connectInterval < time(NULL))) {
-      *lastTry = time(NULL);
-      connectToServer();
-    }
-    int anslen = 0;
-    char *ans = serverReceive(&anslen);
-    if (anslen <= 0) continue;
-    while (E.processing);
-    E.netProcessing = 1;
-
-    if (strcmp(ans, "request") == 0) {
-      editorSetStatusMessage(2, "Received request");
-      editorRefreshScreen();
-      
-      int res = serverSend("response\n", 9);
-      if (res <= 0) {
-        editorSetStatusMessage(2, "Server send response error");
-        editorRefreshScreen();
-        free(ans);
-        netConf.connected = 0;
-        continue;
-      }
-      
-      size_t maxnumlen = 10;
-    	char msg[maxnumlen + 1];
-    	size_t l = snprintf(msg, sizeof(msg),
-      "%d", E.numrows);
-      res = serverSend(msg, l);
-      if (res <= 0) {
-        editorSetStatusMessage(2, "Server send numrows error");
-        editorRefreshScreen();
-        free(ans);
-        netConf.connected = 0;
-        continue;
-      }
-      res = serverSend("\n", 1);
-      if (res <= 0) {
-        editorSetStatusMessage(2, "Server send \\n error");
-        editorRefreshScreen();
-        free(ans);
-        netConf.connected = 0;
-        continue;
-      }
-      
-      int i;
-      for (i = 0; i < E.numrows; i++) {
-        res = serverSend(E.row[i].chars, E.row[i].size);
-        if (res <= 0) {
-          editorSetStatusMessage(2, "Server send %d row error", i);
-          editorRefreshScreen();
-          delay(4);
-          netConf.connected = 0;
-          break;
-        }
-        res = serverSend("\n", 1);
-        if (res <= 0) {
-          editorSetStatusMessage(2, "Server send %d row error \\n", i);
-          editorRefreshScreen();
-          delay(4);
-          netConf.connected = 0;
-          break;
-        }
-        //setAndFreeze(E.row[i].chars, 3);
-      }
-      editorSetStatusMessage(5, "Successful send %d rows", i);
-    } else if (strcmp(ans, "char") == 0) {
-    	char *c = serverReceive(NULL);  //check for errors
-    	
-    	char *cx = serverReceive(NULL);
-    	char *cy = serverReceive(NULL);
-    	netInsertChar(*c, atoi(cx), atoi(cy));
-    	free(c);
-    	free(cx);
-    	free(cy);
-    } else if (strcmp(ans, "newline") == 0) {
-    	char *cx = serverReceive(NULL);
-    	char *cy = serverReceive(NULL);
-    	
-    	netInsertNewline(atoi(cx), atoi(cy));
-    	free(cx);
-    	free(cy);
-    } else if (strcmp(ans, "delete") == 0) {
-    	char *cx = serverReceive(NULL);
-    	char *cy = serverReceive(NULL);
-    	
-    	netDelChar(atoi(cx), atoi(cy));
-    	free(cx);
-    	free(cy);
+/*
+ * Uploads the text a session starts from, which the server asks for once
+ * after create and keeps up to date from then on; joiners get theirs from
+ * the server. Queued ops are already applied locally, so they go out
+ * ahead of it. The rows are followed by the runs of the sequence, which b
+ * of the snapshot frame announces, and the socket is corked meanwhile so
+ * the row frames leave in full segments despite TCP_NODELAY. Quiet on
+ * success so the id of the session stays shown.
+ */
+void sendSnapshot() {
+  int on = 1, off = 0;
+  setsockopt(netConf.server, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+  int res = netFlushPending();
+  if (res > 0) res = serverSendFrame(OP_SNAPSHOT, E.numrows, 1, NULL, 0);
+
+  int i;
+  for (i = 0; res > 0 && i < E.numrows; i++) {
+    erow *row = editorRowAt(i);
+    res = serverSendFrame(OP_ROW, 0, 0, editorRowChars(row), row->size);
+  }
+  if (res > 0) {
+    char *runs;
+    size_t len = seqEncode(&runs);
+    res = serverSendFrame(OP_SEQ_RUNS, 0, 0, runs, len);
+    free(runs);
+  }
+  setsockopt(netConf.server, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+
+  if (res < 0) {
+    editorSetStatusMessage(4, "Server send snapshot error");
+    netDisconnect();
+  }
+}
+
+/*
+ * Received ops are not applied while they are read. netReceive decodes
+ * every whole frame of a read into netConf.log, copying the payloads
+ * out of the ring, and the event loop applies the log in batches of
+ * COLED_APPLY_BATCH between keys. A replayed history or a big paste then
+ * doesn't hold up typing, and reading stops while COLED_LOG_MAX bytes
+ * are waiting. Everything runs on the loop thread, so the log needs no
+ * locking: the decoder appends at n and the applier consumes from head.
+ */
+void netLogOp(netFrame *f) {
+  opLog *log = &netConf.log;
+  if (log->n == log->cap) {
+    log->cap = log->cap ? log->cap * 2 : 64;
+    log->ops = realloc(log->ops, sizeof(loggedOp) * log->cap);
+  }
+  if (log->datalen + f->len > log->datacap) {
+    log->datacap = (log->datalen + f->len) * 2;
+    log->data = realloc(log->data, log->datacap);
+  }
+
+  loggedOp *op = &log->ops[log->n++];
+  op->op = f->op;
+  op->a = f->a;
+  op->b = f->b;
+  op->len = f->len;
+  op->off = log->datalen;
+  if (f->len) memcpy(&log->data[log->datalen], f->payload, f->len);
+  log->datalen += f->len;
+}
+
+int netOpsPending() {
+  return netConf.log.head < netConf.log.n;
+}
+
+/* edits count towards the revision, in the order the server gave them */
+int netIsEdit(int op) {
+  return (op >= OP_CHAR && op <= OP_DELRANGE) ||
+         op == OP_SEQ_INSERT || op == OP_SEQ_DELETE;
+}
+
+void netApplyOps(int max) {
+  opLog *log = &netConf.log;
+  while (max-- > 0 && log->head < log->n) {
+    loggedOp *op = &log->ops[log->head++];
+    char *payload = &log->data[op->off];
+    if (netIsEdit(op->op)) {
+      netConf.rev++;
+      netConf.seq.mirror = (seqId) {
+        COLED_MIRROR_SITE + netConf.rev % COLED_MIRROR_SITE, 1};
+    }
+    switch (op->op) {
+      case OP_ACK:
+        /* b marks the ack that ends a join, which no op waits for */
+        netConf.rev = op->a;
+        if (!op->b) netAcked();
+        break;
+      case OP_REQUEST:
+        if (netConf.connected) sendSnapshot();
+        break;
+      case OP_CHAR:
+        if (op->len == 1) netInsertChar(payload[0], op->a, op->b);
+        break;
+      case OP_INSERT:
+        netInsertText(op->a, op->b, payload, op->len);
+        break;
+      case OP_DELRANGE:
+        netDeleteText(op->a, op->b, payload, op->len);
+        break;
+      case OP_SEQ_INSERT:
+        netSeqInsert(op->a, op->b, payload, op->len);
+        break;
+      case OP_SEQ_DELETE:
+        netSeqDelete(op->a, op->b, payload, op->len);
+        break;
+      case OP_NEWLINE:
+        netInsertNewline(op->a, op->b);
+        break;
+      case OP_DELETE:
+        netDelChar(op->a, op->b);
+        break;
+      case OP_CURSOR:
+        netRemoteCursor(op->a, op->b, payload, op->len);
+        break;
     }
+  }
+  if (log->head == log->n) {
+    log->head = 0;
+    log->n = 0;
+    log->datalen = 0;
+  }
+  editorClampCursor();
+}
 
-    free(ans);
-    editorRefreshScreen();
-    //cmd and refresh
+/* Runs when the server socket is readable. */
+void netReceive() {
+  opLog *log = &netConf.log;
+  if (netOpsPending() &&
+      log->datalen - log->ops[log->head].off >= COLED_LOG_MAX) return;
+  if (netFill() <= 0) {
+    netDisconnect();
+    return;
+  }
+
+  netFrame f;
+  int res;
+  while ((res = netNextFrame(&f)) == 1) netLogOp(&f);
+  if (res < 0) netDisconnect();
+}
+
+/*
+ * Unsent and unacked edits stay queued; a session that loses its server
+ * retries and netResync sends them again. The cursors of the others go
+ * with the connection, the server sends them again on a rejoin.
+ */
+void netDisconnect() {
+  if (netConf.server != -1) {
+    editorUnwatch(netConf.server);
+    close(netConf.server);
+    netConf.server = -1;
+  }
+  netConf.connected = 0;
+  netConf.ncursors = 0;
+  netConf.cursorWait = 0;
+  editorArmTimer(netConf.flushTimer, 0, 0);
+  editorArmTimer(netConf.cursorTimer, 0, 0);
+  if (netConf.listening) {
+    editorArmTimer(netConf.retryTimer, 1, netConf.connectInterval * 1000);
+  }
+}
+
+void netReconnect() {
+  int res = netResync();
+  if (res == -1) {
+    netDisconnect();
+    return;
+  }
+  editorArmTimer(netConf.retryTimer, 0, 0);
+  if (res == -2) {
+    netConf.listening = 0;
+    netDropQueue();
+    netDisconnect();
+    editorSetStatusMessage(5, "The session is gone");
   }
 }
 
 void listenServer() {
-  pthread_t tid;
-  pthread_create(&tid, NULL, threadListen, NULL);
-  pthread_detach(tid);
+  netConf.listening = 1;
+  netConf.cursorSent = 0;
+  editorWatch(netConf.server);
+
+  /* frames read in along with a reply or snapshot won't wake the loop */
+  netFrame f;
+  while (netNextFrame(&f) == 1) netLogOp(&f);
+}
+
+int netPosValid(int cx, int cy) {
+  if (cy == E.numrows) return cx == 0;
+  return cy >= 0 && cy < E.numrows && cx >= 0 && cx <= editorRowAt(cy)->size;
 }
 
+/*
+ * Positional ops come from line-protocol clients. They are applied where
+ * they land and, in a session, mirrored into the sequence under the ids
+ * every replica gives them, of site COLED_MIRROR_SITE plus the revision,
+ * so the rows and the sequence stay in step.
+ */
 void netInsertChar(int c, int cx, int cy) {
-	if (cy > E.numrows) return;
-  if (cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
-  }
-	editorRowInsertChar(&E.row[cy], cx, c);
+  char ch = c;
+  netInsertText(cx, cy, &ch, 1);
 }
 
 void netInsertNewline(int cx, int cy) {
-	if (cy > E.numrows) return;
-	if (cy == E.numrows && cx != 0) return;
-	if (E.row[cy].size < cx) return;
-	
-	if (cx == 0) {
+  if (!netPosValid(cx, cy)) return;
+  if (cy == E.numrows) {
+    if (netConf.listening) seqInsertAt(cx, cy, "", 0, 0);
     editorInsertRow(cy, "", 0);
-  } else {
-    erow *row = &E.row[cy];
-    editorInsertRow(cy + 1, &row->chars[cx], row->size - cx);
-    row = &E.row[cy];
-    row->chars = realloc(row->chars, cx + 1); //freeing &row->chars[E.cx]
-    row->size = cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    return;
   }
+  netInsertText(cx, cy, "\n", 1);
 }
 
 void netDelChar(int cx, int cy) {
-	if (cy >= E.numrows) return;
+  if (cy >= E.numrows || cx > editorRowAt(cy)->size) return;
   if (cx == 0 && cy == 0) return;
-	if (cx > E.row[cy].size) return;
-	
-  erow *row = &E.row[cy];
+
   if (cx > 0) {
-    editorRowDelChar(row, cx - 1);
+    netDeleteSpan(cx - 1, cy, cx, cy);
   } else {
-    editorRowAppendString(&E.row[cy - 1], row->chars, row->size);
-    editorDelRow(cy);
+    netDeleteSpan(editorRowAt(cy - 1)->size, cy - 1, cx, cy);
   }
 }
 
-/*** append buffer ***/
+void netInsertText(int cx, int cy, char *s, int len) {
+  if (!netPosValid(cx, cy)) return;
+  if (netConf.listening) seqInsertAt(cx, cy, s, len, 0);
+  editorInsertText(cx, cy, s, len);
+}
 
-struct abuf {
-  char *b;
-  int len;
-};
+void netDeleteSpan(int cx, int cy, int ex, int ey) {
+  if (netConf.listening) seqDeleteAt(cx, cy, ex, ey, NULL, 0);
+  editorDeleteSpan(cx, cy, ex, ey);
+}
 
-#define ABUF_INIT {NULL, 0};
+void netDeleteText(int cx, int cy, char *s, int len) {
+	if (cy >= E.numrows || len <= 0) return;
+  if (cx > editorRowAt(cy)->size) return;
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
-  if (new == NULL) return;
+  int ex = cx, ey = cy;
+  netTextEnd(s, len, &ex, &ey);
+  if (ey >= E.numrows || ex > editorRowAt(ey)->size) return;
+  netDeleteSpan(cx, cy, ex, ey);
+}
+
+/* the ops of the sequence carry ids in front of their text */
+int netGetVarint(const char *s, int len, unsigned int *v) {
+  unsigned int res = 0;
+  for (int i = 0; i < len && i < COLED_VARINT_MAX; i++) {
+    unsigned char c = s[i];
+    res |= (unsigned int) (c & 0x7f) << (7 * i);
+    if (!(c & 0x80)) {
+      *v = res;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+int netGetIds(const char *s, int len, unsigned int *v, int n) {
+  int off = 0;
+  for (int i = 0; i < n; i++) {
+    int res = netGetVarint(&s[off], len - off, &v[i]);
+    if (res == 0) return -1;
+    off += res;
+  }
+  return off;
+}
+
+/*
+ * An op whose ids are unknown here was made against text we only have
+ * by position, a line-protocol edit mirrored under ids of our own. It
+ * falls back to the position the sender saw.
+ */
+void netSeqInsert(int cx, int cy, char *payload, int len) {
+  unsigned int v[5];
+  int off = netGetIds(payload, len, v, 5);
+  if (off < 0 || off == len || !netConf.listening) return;
+
+  seqId id = {v[0], v[1]}, origin = {v[2], v[3]};
+  char *s = &payload[off];
+  int x, y, k, bi, ri;
+  len -= off;
+  if (seqFind(id, &x, &y, &k, &bi, &ri)) return;
+  if (seqIntegrate(id, origin, s, len, 0, &x, &y) < 0) {
+    if (!netPosValid(cx, cy) || (cy == E.numrows && cy > 0)) return;
+    origin = seqOriginAt(cx, cy);
+    seqIntegrate(id, origin, s, len, 0, &x, &y);
+  }
+  editorInsertText(x, y, s, len);
+}
+
+void netSeqDelete(int cx, int cy, char *payload, int len) {
+  unsigned int v[3];
+  int off = netGetIds(payload, len, v, 3);
+  if (off < 0 || off == len || !netConf.listening) return;
+
+  seqId id = {v[0], v[1]};
+  if (seqDeleteIds(id, len - off) < 0) {
+    netDeleteText(cx, cy, &payload[off], len - off);
+  }
+}
+
+/*** sequence ***/
+
+/*
+ * In a session the text is also a sequence CRDT (RGA), so concurrent
+ * edits converge without going through anyone. The text is the rows
+ * joined by newlines and every char of it has an id, a site number handed
+ * out by the server and a Lamport clock. An insert names the char it went
+ * in after and lands after it, past any chars with greater ids, which
+ * orders concurrent inserts the same way everywhere; a delete names the
+ * ids it removes and leaves them as tombstones for later inserts to find.
+ *
+ * Ids are run-length encoded. A run is a stretch of chars from one site
+ * with consecutive clocks and holds its first id, its length and, for
+ * live runs, the newlines in it and the chars after the last one, which
+ * is all it takes to find rows; the text itself is only in the rows.
+ * Tombstones cost a run each whatever their length, and neighbours with
+ * consecutive ids are merged again once they agree on being deleted.
+ * Site 0 is the text a session started from.
+ *
+ * The runs are kept in order in blocks of up to 2 * COLED_SEQ_BLOCK, each
+ * knowing how its live runs move a position, so a place in the text is
+ * found by skipping whole blocks and walking the runs of one, and
+ * tombstones cost nothing there. A run never spans a multiple of
+ * COLED_SEQ_SPAN in its clocks, which bounds the rows walked inside it,
+ * and the slots hold the first clock and block of every run of a site in
+ * each such span, so an id is found by a binary search and a walk over
+ * the runs of one block.
+ */
+int seqCmp(seqId a, seqId b) {
+  if (a.clock != b.clock) return a.clock < b.clock ? -1 : 1;
+  if (a.site != b.site) return a.site < b.site ? -1 : 1;
+  return 0;
+}
+
+int seqBefore(int x, int y, int ex, int ey) {
+  return y < ey || (y == ey && x < ex);
+}
+
+int seqRowSize(int y) {
+  return y < E.numrows ? editorRowAt(y)->size : 0;
+}
+
+/* moves (*x, *y) over the next k chars of the rows */
+void seqAdvanceRows(int *x, int *y, int k) {
+  while (k > 0) {
+    int rest = seqRowSize(*y) - *x;
+    if (rest < 0) rest = 0;
+    if (k <= rest) {
+      *x += k;
+      return;
+    }
+    k -= rest + 1;
+    (*y)++;
+    *x = 0;
+  }
+}
+
+/* chars in the rows from (x, y) up to (ex, ey) */
+int seqRowsBetween(int x, int y, int ex, int ey) {
+  if (y == ey) return ex - x;
+  int k = seqRowSize(y) - x + 1;
+  for (int i = y + 1; i < ey; i++) k += seqRowSize(i) + 1;
+  return k + ex;
+}
+
+void seqAdvance(seqRun *r, int *x, int *y) {
+  if (r->dead) return;
+  if (r->nl) {
+    *y += r->nl;
+    *x = r->tail;
+  } else {
+    *x += r->len;
+  }
+}
+
+/* appends b to a, which holds the ids just before it */
+void seqJoin(seqRun *a, seqRun *b) {
+  a->tail = b->nl ? b->tail : a->tail + b->len;
+  a->nl += b->nl;
+  a->len += b->len;
+}
+
+/* 1 if b can be joined to a: the ids run on within a span, both live or dead */
+int seqRunsOn(seqRun *a, seqRun *b) {
+  return a->dead == b->dead && a->id.site == b->id.site &&
+    a->id.clock + a->len == b->id.clock &&
+    a->id.clock / COLED_SEQ_SPAN == b->id.clock / COLED_SEQ_SPAN;
+}
+
+/* moves (*x, *y) over the live runs of b */
+void seqBlockAdvance(seqBlock *b, int *x, int *y) {
+  if (b->stale) {
+    b->nl = 0;
+    b->tail = 0;
+    for (int i = 0; i < b->n; i++) {
+      seqRun *r = &b->runs[i];
+      if (r->dead) continue;
+      b->tail = r->nl ? r->tail : b->tail + r->len;
+      b->nl += r->nl;
+    }
+    b->stale = 0;
+  }
+  if (b->nl) {
+    *y += b->nl;
+    *x = b->tail;
+  } else {
+    *x += b->tail;
+  }
+}
+
+/* the slot of span of site, or the free one it would take */
+seqSlot *seqProbe(int site, unsigned int span) {
+  seqDoc *d = &netConf.seq;
+  unsigned int h = (site * 0x9e3779b1u + span) * 0x85ebca77u;
+  for (unsigned int i = h ^ h >> 15;; i++) {
+    seqSlot *s = &d->slots[i & (d->nslots - 1)];
+    if (s->cap == 0 || (s->site == site && s->span == span)) return s;
+  }
+}
+
+/* regrows the slots, dropping those left without blocks */
+void seqRehash() {
+  seqDoc *d = &netConf.seq;
+  seqSlot *old = d->slots;
+  int nold = d->nslots, live = 0;
+  for (int i = 0; i < nold; i++) live += old[i].n > 0;
+
+  d->nslots = 64;
+  while (d->nslots < live * 2 + 2) d->nslots *= 2;
+  d->slots = calloc(d->nslots, sizeof(seqSlot));
+  d->used = live;
+  for (int i = 0; i < nold; i++) {
+    if (old[i].n > 0) {
+      *seqProbe(old[i].site, old[i].span) = old[i];
+    } else {
+      free(old[i].refs);
+    }
+  }
+  free(old);
+}
+
+/* the slot of span of site, taken for it if add; NULL if it has none */
+seqSlot *seqSlotOf(int site, unsigned int span, int add) {
+  seqDoc *d = &netConf.seq;
+  if (add && (d->used + 1) * 4 > d->nslots * 3) seqRehash();
+  if (d->nslots == 0) return NULL;
+  seqSlot *s = seqProbe(site, span);
+  if (s->cap == 0) {
+    if (!add) return NULL;
+    s->site = site;
+    s->span = span;
+    s->cap = 2;
+    s->refs = malloc(sizeof(seqRef) * s->cap);
+    d->used++;
+  }
+  return s;
+}
+
+/* the index of the first ref of s starting past clock */
+int seqRefAfter(seqSlot *s, unsigned int clock) {
+  int lo = 0, hi = s->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (s->refs[mid].clock <= clock) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* moves the ref of run r from block from to block to; NULL adds or drops it */
+void seqIndex(seqRun *r, seqBlock *from, seqBlock *to) {
+  seqSlot *s = seqSlotOf(r->id.site, r->id.clock / COLED_SEQ_SPAN, from == NULL);
+  int j = seqRefAfter(s, r->id.clock);
+  if (from == NULL) {
+    if (s->n == s->cap) {
+      s->cap *= 2;
+      s->refs = realloc(s->refs, sizeof(seqRef) * s->cap);
+    }
+    memmove(&s->refs[j + 1], &s->refs[j], sizeof(seqRef) * (s->n - j));
+    s->refs[j].clock = r->id.clock;
+    s->refs[j].b = to;
+    s->n++;
+    return;
+  }
+
+  while (--j >= 0 && s->refs[j].clock == r->id.clock && s->refs[j].b != from);
+  if (j < 0 || s->refs[j].clock != r->id.clock) return;
+  if (to) {
+    s->refs[j].b = to;
+  } else {
+    memmove(&s->refs[j], &s->refs[j + 1], sizeof(seqRef) * (s->n - j - 1));
+    s->n--;
+  }
+}
+
+/*
+ * The run ref stands for, run *ri of block *bi, and where it starts;
+ * NULL if it is not there.
+ */
+seqRun *seqRefRun(seqRef *ref, int site, int *bi, int *ri, int *x, int *y) {
+  seqDoc *d = &netConf.seq;
+  seqBlock *b = ref->b;
+  for (int i = 0; i < b->n; i++) {
+    seqRun *r = &b->runs[i];
+    if (r->id.site != site || r->id.clock != ref->clock) continue;
+    *x = 0;
+    *y = 0;
+    *ri = i;
+    for (*bi = 0; d->blocks[*bi] != b; (*bi)++) {
+      seqBlockAdvance(d->blocks[*bi], x, y);
+    }
+    for (int m = 0; m < i; m++) seqAdvance(&b->runs[m], x, y);
+    return r;
+  }
+  return NULL;
+}
+
+seqBlock *seqAddBlock(int at) {
+  seqDoc *d = &netConf.seq;
+  if (d->nblocks == d->blockcap) {
+    d->blockcap = d->blockcap ? d->blockcap * 2 : 16;
+    d->blocks = realloc(d->blocks, sizeof(seqBlock *) * d->blockcap);
+  }
+  memmove(&d->blocks[at + 1], &d->blocks[at], sizeof(seqBlock *) * (d->nblocks - at));
+  d->blocks[at] = calloc(1, sizeof(seqBlock));
+  d->nblocks++;
+  return d->blocks[at];
+}
+
+/* frees block at, whose runs are gone */
+void seqFreeBlock(int at) {
+  seqDoc *d = &netConf.seq;
+  free(d->blocks[at]->runs);
+  free(d->blocks[at]);
+  memmove(&d->blocks[at], &d->blocks[at + 1], sizeof(seqBlock *) * (d->nblocks - at - 1));
+  d->nblocks--;
+}
+
+void seqReserveRuns(seqBlock *b, int n) {
+  if (b->n + n <= b->cap) return;
+  b->cap = b->cap ? b->cap * 2 : 16;
+  if (b->cap < b->n + n) b->cap = b->n + n;
+  b->runs = realloc(b->runs, sizeof(seqRun) * b->cap);
+}
+
+void seqInsertRun(int bi, int at, seqRun *r) {
+  seqDoc *d = &netConf.seq;
+  seqBlock *b = d->blocks[bi];
+  seqReserveRuns(b, 1);
+  memmove(&b->runs[at + 1], &b->runs[at], sizeof(seqRun) * (b->n - at));
+  b->runs[at] = *r;
+  b->n++;
+  b->stale = 1;
+  d->n++;
+  seqIndex(r, NULL, b);
+}
+
+void seqRemoveRun(int bi, int at) {
+  seqDoc *d = &netConf.seq;
+  seqBlock *b = d->blocks[bi];
+  seqIndex(&b->runs[at], b, NULL);
+  memmove(&b->runs[at], &b->runs[at + 1], sizeof(seqRun) * (b->n - at - 1));
+  b->n--;
+  b->stale = 1;
+  d->n--;
+}
+
+/* moves the runs of from from at on to the end of to */
+void seqMoveRuns(seqBlock *from, int at, seqBlock *to) {
+  seqReserveRuns(to, from->n - at);
+  for (int i = at; i < from->n; i++) seqIndex(&from->runs[i], from, to);
+  memcpy(&to->runs[to->n], &from->runs[at], sizeof(seqRun) * (from->n - at));
+  to->n += from->n - at;
+  from->n = at;
+  from->stale = 1;
+  to->stale = 1;
+}
+
+/*
+ * Splits the blocks from to to that grew past 2 * COLED_SEQ_BLOCK runs
+ * and joins them with neighbours they fit in one with, once an edit is
+ * through with them.
+ */
+void seqTidy(int from, int to) {
+  seqDoc *d = &netConf.seq;
+  if (from > 0) from--;
+  for (int bi = from; bi <= to + 1 && bi < d->nblocks; bi++) {
+    seqBlock *b = d->blocks[bi];
+    if (b->n > 2 * COLED_SEQ_BLOCK) {
+      seqMoveRuns(b, COLED_SEQ_BLOCK, seqAddBlock(bi + 1));
+      to++;
+    } else if (b->n == 0 && d->nblocks > 1) {
+      seqFreeBlock(bi--);
+      to--;
+    } else if (bi + 1 < d->nblocks &&
+               b->n + d->blocks[bi + 1]->n <= COLED_SEQ_BLOCK) {
+      seqMoveRuns(d->blocks[bi + 1], 0, b);
+      seqFreeBlock(bi + 1);
+      bi--;
+      to--;
+    }
+  }
+}
+
+/* drops all runs, leaving one empty block */
+void seqClear() {
+  seqDoc *d = &netConf.seq;
+  for (int i = 0; i < d->nblocks; i++) {
+    free(d->blocks[i]->runs);
+    free(d->blocks[i]);
+  }
+  for (int i = 0; i < d->nslots; i++) free(d->slots[i].refs);
+  free(d->slots);
+  d->slots = NULL;
+  d->nslots = 0;
+  d->used = 0;
+  d->nblocks = 0;
+  d->n = 0;
+  seqAddBlock(0);
+}
+
+/* merges run at of block bi with the one after it if their ids run on */
+int seqMerge(int bi, int at) {
+  seqBlock *b = netConf.seq.blocks[bi];
+  if (at < 0 || at + 1 >= b->n || !seqRunsOn(&b->runs[at], &b->runs[at + 1])) {
+    return 0;
+  }
+  seqJoin(&b->runs[at], &b->runs[at + 1]);
+  seqRemoveRun(bi, at + 1);
+  return 1;
+}
+
+/*
+ * Splits run i of block bi after k chars. It starts on row y0 and, if
+ * live, the split falls at (x, y).
+ */
+void seqSplit(int bi, int i, int k, int y0, int x, int y) {
+  seqRun *r = &netConf.seq.blocks[bi]->runs[i];
+  seqRun rest = *r;
+  rest.id.clock += k;
+  rest.len -= k;
+  r->len = k;
+  if (!r->dead) {
+    r->nl = y - y0;
+    r->tail = r->nl ? x : k;
+    rest.nl -= r->nl;
+    if (!rest.nl) rest.tail = rest.len;
+  }
+  seqInsertRun(bi, i + 1, &rest);
+}
+
+/*
+ * Makes chars lo to hi of run i of block bi a dead run of their own and
+ * returns its index. The run starts on row y0 and, if live, lo and hi
+ * fall at (lx, ly) and (hx, hy).
+ */
+int seqKill(int bi, int i, int lo, int hi, int y0, int lx, int ly, int hx, int hy) {
+  seqBlock *b = netConf.seq.blocks[bi];
+  if (hi < b->runs[i].len) seqSplit(bi, i, hi, y0, hx, hy);
+  if (lo > 0) {
+    seqSplit(bi, i, lo, y0, lx, ly);
+    i++;
+  }
+  seqRun *r = &b->runs[i];
+  r->dead = 1;
+  r->nl = 0;
+  r->tail = 0;
+  b->stale = 1;
+  return i;
+}
+
+/*
+ * Appends the run of len chars with ids from id on, cut at spans. A live
+ * one covers the rows from (*x, *y) on, which are moved past it.
+ */
+void seqAppend(seqId id, int len, int dead, int *x, int *y) {
+  seqDoc *d = &netConf.seq;
+  while (len > 0) {
+    seqRun r = {id, COLED_SEQ_SPAN - id.clock % COLED_SEQ_SPAN, 0, 0, dead};
+    if (r.len > len) r.len = len;
+    if (!dead) {
+      int y0 = *y;
+      seqAdvanceRows(x, y, r.len);
+      r.nl = *y - y0;
+      r.tail = r.nl ? *x : r.len;
+    }
+    if (d->blocks[d->nblocks - 1]->n >= COLED_SEQ_BLOCK) seqAddBlock(d->nblocks);
+    seqInsertRun(d->nblocks - 1, d->blocks[d->nblocks - 1]->n, &r);
+    if (d->clock < id.clock + r.len - 1) d->clock = id.clock + r.len - 1;
+    id.clock += r.len;
+    len -= r.len;
+  }
+}
+
+/*
+ * The run holding id, run *ri of block *bi, where it starts and how far
+ * into it id is; NULL if id is unknown.
+ */
+seqRun *seqFind(seqId id, int *x, int *y, int *k, int *bi, int *ri) {
+  seqSlot *s = seqSlotOf(id.site, id.clock / COLED_SEQ_SPAN, 0);
+  int j = s ? seqRefAfter(s, id.clock) - 1 : -1;
+  seqRun *r = j >= 0 ? seqRefRun(&s->refs[j], id.site, bi, ri, x, y) : NULL;
+  if (r == NULL || id.clock - r->id.clock >= (unsigned int) r->len) {
+    *x = 0;
+    *y = 0;
+    return NULL;
+  }
+  *k = id.clock - r->id.clock;
+  return r;
+}
+
+/*
+ * The live run holding the char just before (x, y), where it starts and
+ * how many of its chars come before (x, y); NULL at the start of the text.
+ */
+seqRun *seqFindPos(int x, int y, int *x0, int *y0, int *k) {
+  seqDoc *d = &netConf.seq;
+  seqRun *last = NULL;
+  int cx = 0, cy = 0, lb = -1, lx = 0, ly = 0;
+  for (int bi = 0; bi < d->nblocks && seqBefore(cx, cy, x, y); bi++) {
+    seqBlock *b = d->blocks[bi];
+    int ex = cx, ey = cy;
+    seqBlockAdvance(b, &ex, &ey);
+    if (seqBefore(ex, ey, x, y)) {
+      /* its last live run is looked up if nothing after it is live */
+      if (ex != cx || ey != cy) {
+        lb = bi;
+        lx = cx;
+        ly = cy;
+      }
+      cx = ex;
+      cy = ey;
+      continue;
+    }
+
+    for (int i = 0; i < b->n; i++) {
+      seqRun *r = &b->runs[i];
+      if (r->dead) continue;
+      if (!seqBefore(cx, cy, x, y)) break;
+
+      ex = cx;
+      ey = cy;
+      seqAdvance(r, &ex, &ey);
+      if (!seqBefore(ex, ey, x, y)) {
+        *x0 = cx;
+        *y0 = cy;
+        *k = ex == x && ey == y ? r->len : seqRowsBetween(cx, cy, x, y);
+        return r;
+      }
+      last = r;
+      lx = cx;
+      ly = cy;
+      cx = ex;
+      cy = ey;
+    }
+    break;
+  }
+
+  if (last == NULL && lb >= 0) {
+    seqBlock *b = d->blocks[lb];
+    cx = lx;
+    cy = ly;
+    for (int i = 0; i < b->n; i++) {
+      if (b->runs[i].dead) continue;
+      last = &b->runs[i];
+      lx = cx;
+      ly = cy;
+      seqAdvance(last, &cx, &cy);
+    }
+  }
+  if (last) {
+    *x0 = lx;
+    *y0 = ly;
+    *k = last->len;
+  }
+  return last;
+}
+
+seqId seqOriginAt(int x, int y) {
+  seqId origin = {0, 0};
+  int x0, y0, k;
+  seqRun *r = seqFindPos(x, y, &x0, &y0, &k);
+  if (r) {
+    origin = r->id;
+    origin.clock += k - 1;
+  }
+  return origin;
+}
+
+/*
+ * Places the len chars with ids from id on, inserted after origin, and
+ * sets (*px, *py) to where they go in the rows. -1 if origin is unknown.
+ * If exact they go right after origin, where a mirrored edit went in the
+ * rows, rather than past the inserts there with later ids.
+ */
+int seqIntegrate(seqId id, seqId origin, const char *s, int len, int exact,
+                 int *px, int *py) {
+  seqDoc *d = &netConf.seq;
+  int x = 0, y = 0, bi = 0, at = 0, scan = !exact, from;
+  if (d->nblocks == 0) seqClear();
+  if (origin.site || origin.clock) {
+    int k, ri;
+    seqRun *r = seqFind(origin, &x, &y, &k, &bi, &ri);
+    if (r == NULL) return -1;
+
+    int x0 = x, y0 = y;
+    if (!r->dead) seqAdvanceRows(&x, &y, k + 1);
+    at = ri + 1;
+    if (k + 1 < r->len) {
+      seqId rest = {r->id.site, r->id.clock + k + 1};
+      if (exact || seqCmp(rest, id) < 0) {
+        seqSplit(bi, ri, k + 1, y0, x, y);
+        scan = 0;
+      } else {
+        x = x0;
+        y = y0;
+        seqAdvance(r, &x, &y);
+      }
+    }
+  }
+  from = bi;
+  while (scan) {
+    seqBlock *b = d->blocks[bi];
+    if (at == b->n && bi + 1 < d->nblocks) {
+      bi++;
+      at = 0;
+      continue;
+    }
+    if (at == b->n || seqCmp(b->runs[at].id, id) <= 0) break;
+    seqAdvance(&b->runs[at], &x, &y);
+    at++;
+  }
+
+  if (at == 0 && bi > 0) {
+    bi--;
+    at = d->blocks[bi]->n;
+  }
+  seqBlock *b = d->blocks[bi];
+  for (int off = 0; off < len;) {
+    seqRun run = {{id.site, id.clock + off}, 0, 0, 0, 0};
+    run.len = COLED_SEQ_SPAN - run.id.clock % COLED_SEQ_SPAN;
+    if (run.len > len - off) run.len = len - off;
+    netTextEnd(&s[off], run.len, &run.tail, &run.nl);
+    if (at > 0 && seqRunsOn(&b->runs[at - 1], &run)) {
+      seqJoin(&b->runs[at - 1], &run);
+      b->stale = 1;
+    } else {
+      seqInsertRun(bi, at++, &run);
+    }
+    off += run.len;
+  }
+  seqTidy(from, bi);
+
+  if (d->clock < id.clock + len - 1) d->clock = id.clock + len - 1;
+  *px = x;
+  *py = y;
+  return 0;
+}
+
+/*
+ * Inserts s at (x, y) under new ids of ours and queues it if send. Text
+ * typed on the row past the end starts with the newline that makes it.
+ */
+void seqInsertAt(int x, int y, char *s, int len, int send) {
+  seqDoc *d = &netConf.seq;
+  if (y == E.numrows && y > 0) {
+    seqInsertAt(seqRowSize(y - 1), y - 1, "\n", 1, send);
+    x = 0;
+  }
+  if (len == 0) return;
+
+  seqId origin = seqOriginAt(x, y);
+  seqId id = {d->site, d->clock + 1};
+  int px, py;
+  if (!send) {
+    id = d->mirror;
+    d->mirror.clock += len;
+  }
+  seqIntegrate(id, origin, s, len, !send, &px, &py);
+  if (send) {
+    netQueueOp(OP_SEQ_INSERT, x, y, id, origin, s, len);
+  }
+}
+
+/*
+ * Tombstones the text from (x, y) up to (ex, ey), the rows still holding
+ * it, and queues the deletion of s if send. A char whose insert is still
+ * queued is taken back from it and forgotten, since nobody has its id.
+ */
+void seqDeleteAt(int x, int y, int ex, int ey, const char *s, int send) {
+  seqDoc *d = &netConf.seq;
+  int cx = 0, cy = 0, off = 0, from = -1, to = -1;
+  for (int bi = 0; bi < d->nblocks && seqBefore(cx, cy, ex, ey); bi++) {
+    seqBlock *b = d->blocks[bi];
+    int bx = cx, by = cy;
+    seqBlockAdvance(b, &bx, &by);
+    if (!seqBefore(x, y, bx, by)) {
+      cx = bx;
+      cy = by;
+      continue;
+    }
+
+    int first = -1, last = -1;
+    for (int i = 0; i < b->n && seqBefore(cx, cy, ex, ey); i++) {
+      seqRun *r = &b->runs[i];
+      if (r->dead) continue;
+
+      int rx = cx, ry = cy;
+      seqAdvance(r, &rx, &ry);
+      if (!seqBefore(x, y, rx, ry)) {
+        cx = rx;
+        cy = ry;
+        continue;
+      }
+
+      int lx = cx, ly = cy, hx = rx, hy = ry;
+      if (seqBefore(cx, cy, x, y)) {
+        lx = x;
+        ly = y;
+      }
+      if (seqBefore(ex, ey, rx, ry)) {
+        hx = ex;
+        hy = ey;
+      }
+      int lo = seqRowsBetween(cx, cy, lx, ly);
+      int hi = lo + seqRowsBetween(lx, ly, hx, hy);
+      i = seqKill(bi, i, lo, hi, cy, lx, ly, hx, hy);
+      if (first < 0) first = i;
+      last = i;
+
+      seqId id = b->runs[i].id;
+      int len = hi - lo;
+      if (send &&
+          netQueueOp(OP_SEQ_DELETE, x, y, id, id, &s[off], len)) {
+        /* only ever a single char, the last we inserted */
+        if (--b->runs[i].len == 0) {
+          seqRemoveRun(bi, i--);
+          last--;
+        }
+        if (d->clock == id.clock) d->clock--;
+      }
+      off += len;
+      cx = hx;
+      cy = hy;
+    }
+
+    for (int i = last; first >= 0 && i >= first - 1; i--) seqMerge(bi, i);
+    if (from < 0) from = bi;
+    to = bi;
+  }
+  if (from >= 0) seqTidy(from, to);
+}
+
+/*
+ * Tombstones len chars with ids from id on and deletes the live ones
+ * from the rows. -1 if none of the ids are known.
+ */
+int seqDeleteIds(seqId id, int len) {
+  unsigned int at = id.clock, end = id.clock + len;
+  int found = 0;
+  while (at < end) {
+    unsigned int next = (at / COLED_SEQ_SPAN + 1) * COLED_SEQ_SPAN;
+    seqSlot *s = seqSlotOf(id.site, at / COLED_SEQ_SPAN, 0);
+    int j = s ? seqRefAfter(s, at) - 1 : -1;
+    int bi, i, x, y;
+    seqRun *r = j >= 0 ? seqRefRun(&s->refs[j], id.site, &bi, &i, &x, &y) : NULL;
+    if (r == NULL || r->id.clock + r->len <= at) {
+      /* at is unknown, the next run of the span may not be */
+      r = NULL;
+      if (s && j + 1 < s->n && s->refs[j + 1].clock < end) {
+        r = seqRefRun(&s->refs[j + 1], id.site, &bi, &i, &x, &y);
+      }
+      if (r == NULL) {
+        at = j + 1 < (s ? s->n : 0) && s->refs[j + 1].clock < next ?
+          s->refs[j + 1].clock : next;
+        continue;
+      }
+    }
+
+    found = 1;
+    int lo = at > r->id.clock ? at - r->id.clock : 0;
+    int hi = end < r->id.clock + r->len ? (int) (end - r->id.clock) : r->len;
+    at = r->id.clock + hi;
+    if (r->dead) continue;
+
+    int lx = x, ly = y;
+    seqAdvanceRows(&lx, &ly, lo);
+    int hx = lx, hy = ly;
+    seqAdvanceRows(&hx, &hy, hi - lo);
+    i = seqKill(bi, i, lo, hi, y, lx, ly, hx, hy);
+    editorDeleteSpan(lx, ly, hx, hy);
+    seqMerge(bi, i);
+    seqMerge(bi, i - 1);
+    seqTidy(bi, bi);
+  }
+  return found ? 0 : -1;
+}
+
+/* the rows as the text of site 0 */
+void seqReset() {
+  seqDoc *d = &netConf.seq;
+  int len = editorTextSize();
+  int x = 0, y = 0;
 
-  memcpy(new + ab->len, s, len);
+  seqClear();
+  d->clock = len > 0 ? len - 1 : 0;
+  seqAppend((seqId) {0, 1}, len - 1, 0, &x, &y);
+}
+
+/* the runs for a snapshot: their count, then the id, length and liveness of each */
+size_t seqEncode(char **buf) {
+  seqDoc *d = &netConf.seq;
+  char *b = malloc(COLED_VARINT_MAX * (1 + 4 * d->n));
+  size_t n = netPutVarint(b, d->n);
+  for (int bi = 0; bi < d->nblocks; bi++) {
+    for (int i = 0; i < d->blocks[bi]->n; i++) {
+      seqRun *r = &d->blocks[bi]->runs[i];
+      n += netPutVarint(&b[n], r->id.site);
+      n += netPutVarint(&b[n], r->id.clock);
+      n += netPutVarint(&b[n], r->len);
+      n += netPutVarint(&b[n], r->dead);
+    }
+  }
+  *buf = b;
+  return n;
+}
+
+/* takes over the runs of a snapshot; 0 if they don't add up to the rows */
+int seqLoad(const char *s, int len) {
+  seqDoc *d = &netConf.seq;
+  unsigned int count;
+  int off = netGetVarint(s, len, &count);
+  if (off == 0) return 0;
+
+  int x = 0, y = 0;
+  seqClear();
+  d->clock = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    unsigned int v[4];
+    int res = netGetIds(&s[off], len - off, v, 4);
+    if (res < 0 || v[2] == 0) return 0;
+    off += res;
+    seqAppend((seqId) {v[0], v[1]}, v[2], v[3] != 0, &x, &y);
+  }
+
+  int last = E.numrows > 0 ? E.numrows - 1 : 0;
+  return y == last && x == seqRowSize(last);
+}
+
+/*** append buffer ***/
+
+/*
+ * The frame and line buffers live in E and are only reset between
+ * frames, growing geometrically, so a repaint allocates nothing once
+ * they have reached the size of the screen.
+ */
+void abReserve(struct abuf *ab, int len) {
+  if (ab->len + len <= ab->cap) return;
+  int cap = ab->cap * 2;
+  if (cap < ab->len + len) cap = ab->len + len;
+  char *new = realloc(ab->b, cap);
+  if (new == NULL) die("realloc");
   ab->b = new;
+  ab->cap = cap;
+}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+  if (len <= 0) return;
+  abReserve(ab, len);
+  memcpy(&ab->b[ab->len], s, len);
   ab->len += len;
 }
 
+void abFill(struct abuf *ab, char c, int n) {
+  if (n <= 0) return;
+  abReserve(ab, n);
+  memset(&ab->b[ab->len], c, n);
+  ab->len += n;
+}
+
+void abEsc(struct abuf *ab, int esc) {
+  abAppend(ab, escSeqs[esc].s, escSeqs[esc].len);
+}
+
+void abInt(struct abuf *ab, unsigned int v) {
+  static const char digits[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+  char buf[10];
+  int n = sizeof(buf);
+  while (v >= 100) {
+    n -= 2;
+    memcpy(&buf[n], &digits[(v % 100) * 2], 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    n -= 2;
+    memcpy(&buf[n], &digits[v * 2], 2);
+  } else {
+    buf[--n] = '0' + v;
+  }
+  abAppend(ab, &buf[n], sizeof(buf) - n);
+}
+
+/* cursor to 1-based row, col */
+void abMoveTo(struct abuf *ab, int row, int col) {
+  abAppend(ab, "\x1b[", 2);
+  abInt(ab, row);
+  abAppend(ab, ";", 1);
+  abInt(ab, col);
+  abAppend(ab, "H", 1);
+}
+
 void abFree(struct abuf *ab) {
   free(ab->b);
+  ab->b = NULL;
+  ab->len = 0;
+  ab->cap = 0;
 }
 
 /*** output ***/
 
+/*
+ * E.screen shadows what the terminal shows, one line of plain text per
+ * terminal row. A frame composes every line and writes only the span that
+ * differs from its shadow, cursor-addressed. When rowoff moves by less
+ * than a screen the text area is scrolled by the terminal first and the
+ * shadow shifted along, so only the lines scrolled in are drawn. The
+ * cursors of the others are cells of the lines like the text under them,
+ * so only those that moved are drawn again.
+ */
+void editorInvalidateScreen() {
+  if (E.screenHeight > E.screenlines) {
+    E.screen = realloc(E.screen, sizeof(screenLine) * E.screenHeight);
+    for (int y = E.screenlines; y < E.screenHeight; y++) {
+      E.screen[y].chars = NULL;
+      E.screen[y].cells = NULL;
+      E.screen[y].cap = 0;
+      E.screen[y].overlaid = 0;
+    }
+    E.screenlines = E.screenHeight;
+  }
+  for (int y = 0; y < E.screenlines; y++) E.screen[y].len = -1;
+}
+
+void editorScrollScreen(struct abuf *ab) {
+  int d = E.rowoff - E.screenrowoff;
+  E.screenrowoff = E.rowoff;
+  if (d == 0 || d >= E.screenrows || -d >= E.screenrows) return;
+
+  int n = abs(d);
+  abAppend(ab, "\x1b[1;", 4);
+  abInt(ab, E.screenrows);
+  abAppend(ab, "r\x1b[", 3);
+  abInt(ab, n);
+  abAppend(ab, d > 0 ? "S\x1b[r" : "T\x1b[r", 4);
+
+  screenLine tmp[n];
+  if (d > 0) {
+    memcpy(tmp, E.screen, sizeof(screenLine) * n);
+    memmove(E.screen, &E.screen[n], sizeof(screenLine) * (E.screenrows - n));
+    memcpy(&E.screen[E.screenrows - n], tmp, sizeof(screenLine) * n);
+    for (int y = E.screenrows - n; y < E.screenrows; y++) E.screen[y].len = 0;
+  } else {
+    memcpy(tmp, &E.screen[E.screenrows - n], sizeof(screenLine) * n);
+    memmove(&E.screen[n], E.screen, sizeof(screenLine) * (E.screenrows - n));
+    memcpy(E.screen, tmp, sizeof(screenLine) * n);
+    for (int y = 0; y < n; y++) E.screen[y].len = 0;
+  }
+}
+
+int editorSameCell(screenLine *l, const char *s, const char *cells, int at) {
+  return l->chars[at] == s[at] &&
+    (l->overlaid ? l->cells[at] : 0) == (cells ? cells[at] : 0);
+}
+
+/* text with each run of overlay cells in the background color they name */
+void abCells(struct abuf *ab, const char *s, const char *cells, int len, int attr) {
+  int i = 0;
+  while (i < len) {
+    int j = i + 1;
+    while (j < len && cells[j] == cells[i]) j++;
+    if (cells[i]) {
+      abAppend(ab, "\x1b[4", 3);
+      abAppend(ab, &cells[i], 1);
+      abAppend(ab, "m", 1);
+    }
+    abAppend(ab, &s[i], j - i);
+    if (cells[i]) {
+      abEsc(ab, ESC_RESET_ATTR);
+      if (attr >= 0) abEsc(ab, attr);
+    }
+    i = j;
+  }
+}
+
+/*
+ * attr, an escSeq or -1, is set around what is written and reset after.
+ * cells, if not NULL, gives the overlay cells of the line.
+ */
+void editorUpdateLine(struct abuf *ab, int y, const char *s, const char *cells, int len, int attr) {
+  screenLine *l = &E.screen[y];
+  int from = 0, to = len, erase = 1;
+  if (l->len >= 0) {
+    while (from < len && from < l->len && editorSameCell(l, s, cells, from)) from++;
+    if (len == l->len) {
+      if (from == len) return;
+      while (to > from && editorSameCell(l, s, cells, to - 1)) to--;
+    }
+    erase = l->len > len;
+  }
+
+  abMoveTo(ab, y + 1, from + 1);
+  if (attr >= 0) abEsc(ab, attr);
+  if (cells) abCells(ab, &s[from], &cells[from], to - from, attr);
+  else abAppend(ab, &s[from], to - from);
+  if (erase) abEsc(ab, ESC_ERASE_LINE);
+  if (attr >= 0) abEsc(ab, ESC_RESET_ATTR);
+
+  if (len > l->cap) {
+    l->cap = len;
+    l->chars = realloc(l->chars, l->cap);
+    l->cells = realloc(l->cells, l->cap);
+  }
+  if (len) memcpy(l->chars, s, len);
+  if (cells && len) memcpy(l->cells, cells, len);
+  l->overlaid = cells != NULL;
+  l->len = len;
+}
+
 void editorScroll() {
   E.rx = 0;
   if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
   }
 
   if (E.cy < E.rowoff) {
@@ -982,40 +3794,83 @@ void editorScroll() {
   }
 }
 
-void editorDrawRows(struct abuf *ab) {
-  int y;
-  for (y = 0; y < E.screenrows; y++) {
-    int filerow = y + E.rowoff;
-    if (filerow >= E.numrows) {
-      if (E.numrows == 0 && y == E.screenrows / 3) {
-        char welcome[80];
-        int welcomelen = snprintf(welcome, sizeof(welcome),
-          "COLED editor -- version %s", COLED_VERSION);
-        if (welcomelen > E.screencols) welcomelen = E.screencols;
-        int padding = (E.screencols - welcomelen) / 2;
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
-      } else {
+void editorDrawRow(struct abuf *ab, int y) {
+  int filerow = y + E.rowoff;
+  if (filerow >= E.numrows) {
+    if (E.numrows == 0 && y == E.screenrows / 3) {
+      char welcome[80];
+      int welcomelen = snprintf(welcome, sizeof(welcome),
+        "COLED editor -- version %s", COLED_VERSION);
+      if (welcomelen > E.screencols) welcomelen = E.screencols;
+      int padding = (E.screencols - welcomelen) / 2;
+      if (padding) {
         abAppend(ab, "~", 1);
+        padding--;
       }
+      abFill(ab, ' ', padding);
+      abAppend(ab, welcome, welcomelen);
     } else {
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0) len = 0;
-      if (len > E.screencols) len = E.screencols;
-      abAppend(ab, E.row[filerow].render + E.coloff, len);
+      abAppend(ab, "~", 1);
     }
+  } else {
+    erow *row = editorRowAt(filerow);
+    editorRowRender(row, E.coloff + E.screencols);
+    int len = row->rsize - E.coloff;
+    if (len < 0) len = 0;
+    if (len > E.screencols) len = E.screencols;
+    abAppend(ab, row->render + E.coloff, len);
+  }
+}
 
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+/*
+ * The cursors of the others in a session are drawn over the rows, each a
+ * cell in a background color picked by its site. head and next chain the
+ * ones on each screen line, col has their columns.
+ */
+void editorPlaceCursors(int *head, int *next, int *col) {
+  for (int y = 0; y < E.screenrows; y++) head[y] = -1;
+  for (int i = 0; i < netConf.ncursors; i++) {
+    int x, y, rx = 0;
+    netCursorPos(&netConf.cursors[i], &x, &y);
+    if (y < E.rowoff || y >= E.rowoff + E.screenrows || y > E.numrows) continue;
+    if (y < E.numrows) {
+      erow *row = editorRowAt(y);
+      rx = editorRowCxToRx(row, x < row->size ? x : row->size);
+    }
+    col[i] = rx - E.coloff;
+    if (col[i] < 0 || col[i] >= E.screencols) continue;
+    next[i] = head[y - E.rowoff];
+    head[y - E.rowoff] = i;
+  }
+}
+
+void editorDrawRows(struct abuf *ab) {
+  struct abuf *line = &E.line, *cells = &E.cells;
+  int head[E.screenrows], next[netConf.ncursors + 1], col[netConf.ncursors + 1];
+  editorPlaceCursors(head, next, col);
+  for (int y = 0; y < E.screenrows; y++) {
+    line->len = 0;
+    editorDrawRow(line, y);
+    if (head[y] == -1) {
+      editorUpdateLine(ab, y, line->b, NULL, line->len, -1);
+      continue;
+    }
+
+    for (int i = head[y]; i != -1; i = next[i]) {
+      if (col[i] >= line->len) abFill(line, ' ', col[i] + 1 - line->len);
+    }
+    cells->len = 0;
+    abFill(cells, 0, line->len);
+    for (int i = head[y]; i != -1; i = next[i]) {
+      cells->b[col[i]] = '1' + netConf.cursors[i].site % 6;
+    }
+    editorUpdateLine(ab, y, line->b, cells->b, line->len, -1);
   }
 }
 
 void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[7m", 4);
+  struct abuf *line = &E.line;
+  line->len = 0;
   char status[80], rstatus[80];
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %.11s",
     E.filename ? E.filename : "[No name]", E.numrows,
@@ -1023,58 +3878,72 @@ void editorDrawStatusBar(struct abuf *ab) {
   int rlen = snprintf(rstatus, sizeof(rstatus), "%d:%d",
     E.cy + 1, E.rx + 1);
   if (len > E.screencols) len = E.screencols;
-  abAppend(ab, status, len);
+  abAppend(line, status, len);
 
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
-      break;
-    }
-    abAppend(ab, " ", 1);
-    len++;
+  if (E.screencols - len >= rlen) {
+    abFill(line, ' ', E.screencols - len - rlen);
+    abAppend(line, rstatus, rlen);
+  } else {
+    abFill(line, ' ', E.screencols - len);
   }
 
-  abAppend(ab, "\r\n", 2);
+  editorUpdateLine(ab, E.screenrows, line->b, NULL, line->len, ESC_REVERSE);
 }
 
 void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
+  struct abuf *line = &E.line;
+  line->len = 0;
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols) msglen = E.screencols;
-  if (msglen && time(NULL) - E.statusmsg_time < E.statusmsg_interval) {
-    abAppend(ab, E.statusmsg, msglen);
-  } else {
-  	msglen = 0;
+  abAppend(line, E.statusmsg, msglen);
+  abFill(line, ' ', E.screencols - msglen);
+
+  editorUpdateLine(ab, E.screenrows + 1, line->b, NULL, line->len, ESC_REVERSE);
+}
+
+/*
+ * Remote ops are applied as they arrive, but the redraws they ask for,
+ * like those for keys with more keys queued behind them, are capped at
+ * one per frameInterval ms. The ones in between are coalesced into the
+ * next frame, drawn when frameTimer fires.
+ */
+void editorRequestRefresh() {
+  long wait = E.lastFrame + E.frameInterval - editorNowMs();
+  if (wait <= 0) {
+    editorRefreshScreen();
+    return;
   }
-    
-	while (msglen < E.screencols) {
-    abAppend(ab, " ", 1);
-    msglen++;
+  E.coalesced++;
+  if (!E.framePending) {
+    editorArmTimer(E.frameTimer, wait, 0);
+    E.framePending = 1;
   }
-  abAppend(ab, "\x1b[m", 3);
 }
 
 void editorRefreshScreen() {
-  editorScroll();
+  if (E.framePending) {
+    editorArmTimer(E.frameTimer, 0, 0);
+    E.framePending = 0;
+  }
+  E.lastFrame = editorNowMs();
+  E.frames++;
 
-  struct abuf ab = ABUF_INIT;
+  editorScroll();
 
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
+  struct abuf *ab = &E.frame;
+  ab->len = 0;
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  abEsc(ab, ESC_HIDE_CURSOR);
 
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                            (E.rx - E.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
+  editorScrollScreen(ab);
+  editorDrawRows(ab);
+  editorDrawStatusBar(ab);
+  editorDrawMessageBar(ab);
 
-  abAppend(&ab, "\x1b[?25h", 6);
+  abMoveTo(ab, (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+  abEsc(ab, ESC_SHOW_CURSOR);
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  write(STDOUT_FILENO, ab->b, ab->len);
 }
 
 void editorSetStatusMessage(int sec, const char *fmt, ...) {
@@ -1082,24 +3951,11 @@ void editorSetStatusMessage(int sec, const char *fmt, ...) {
   va_start(ap, fmt);
   vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
   va_end(ap);
-  E.statusmsg_time = time(NULL);
-  E.statusmsg_interval = sec;
-}
-
-void setAndFreeze(char *msg, int sec) {
-  editorSetStatusMessage(sec, msg);
-  editorRefreshScreen();
-  delay(sec);
-  editorRefreshScreen();
+  editorArmTimer(E.statusTimer, sec * 1000, 0);
 }
 
 /*** input ***/
 
-void delay(time_t t) {
-  time_t curr = time(NULL);
-  while (time(NULL) - curr < t);
-}
-
 int multipleChoice(const char *msg, int n, ...) {
   va_list ap;
   va_start(ap, n);
@@ -1158,7 +4014,7 @@ char *editorPrompt(char *prompt, size_t maxlen) {
 }
 
 void editorMoveCursor(int key) {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
 
   switch (key) {
     case ARROW_LEFT:
@@ -1166,7 +4022,7 @@ void editorMoveCursor(int key) {
         E.cx--;
       } else if (E.cy > 0) {
         E.cy--;
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowAt(E.cy)->size;
       }
       break;
     case ARROW_RIGHT:
@@ -1189,7 +4045,7 @@ void editorMoveCursor(int key) {
       break;
   }
 
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
   int rowlen = row ? row->size : 0;
   if (E.cx > rowlen) {
     E.cx = rowlen;
@@ -1201,9 +4057,6 @@ void editorProcessKeypress() {
 
   int c = editorReadKey();
 
-  while (E.netProcessing);
-  E.processing = 1;
-
   switch (c) {
     case '\r':
       editorInsertNewline();
@@ -1216,6 +4069,11 @@ void editorProcessKeypress() {
         quit_times--;
         return;
       }
+      if (E.saving) {
+        editorSetStatusMessage(5, "Waiting for save to finish...");
+        editorRefreshScreen();
+        editorFinishSave();
+      }
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
@@ -1229,11 +4087,16 @@ void editorProcessKeypress() {
       network();
       break;
 
+    case CTRL_KEY('g'):
+      editorSetStatusMessage(5, "%ld frames, %ld coalesced, %d id runs, rev %u, %d unacked",
+        E.frames, E.coalesced, netConf.seq.n, netConf.rev, netConf.unacked);
+      break;
+
     case HOME_KEY:
       E.cx = 0;
       break;
     case END_KEY:
-      if (E.cy < E.numrows) E.cx = E.row[E.cy].size;
+      if (E.cy < E.numrows) E.cx = editorRowAt(E.cy)->size;
       break;
 
     case BACKSPACE:
@@ -1274,7 +4137,6 @@ void editorProcessKeypress() {
       break;
   }
 
-  E.processing = 0;
   quit_times = COLED_QUIT_TIMES;
 }
 
@@ -1287,13 +4149,17 @@ void initEditor() {
   E.rowoff = 0;
   E.coloff = 0;
   E.numrows = 0;
-  E.row = NULL;
+  E.blocks = NULL;
+  E.nblocks = 0;
+  E.blockcap = 0;
+  E.lastblock = 0;
+  E.stale = 0;
+  E.map = NULL;
+  E.maplen = 0;
+  E.saving = NULL;
   E.dirty = 0;
   E.filename = NULL;
   E.statusmsg[0] = 0;
-  E.statusmsg_time = 0;
-  E.processing = 0;
-  E.netProcessing = 0;
 
   if (getWindowSize(&E.screenHeight, &E.screenWidth) == -1) {
     die("getWindowSize");
@@ -1301,15 +4167,96 @@ void initEditor() {
 
   E.screenrows = E.screenHeight - 2;  //for status and message bar
   E.screencols = E.screenWidth;
+  E.screen = NULL;
+  E.screenlines = 0;
+  E.screenrowoff = 0;
+  editorInvalidateScreen();
+  /* COLED_FRAME_MS in the environment overrides the cap, 0 lifting it */
+  char *ms = getenv("COLED_FRAME_MS");
+  E.frameInterval = ms && *ms ? atoi(ms) : COLED_FRAME_MS;
+  if (E.frameInterval < 0) E.frameInterval = 0;
+  E.framePending = 0;
+  E.lastFrame = 0;
+  E.frames = 0;
+  E.coalesced = 0;
+  E.frame = (struct abuf) ABUF_INIT;
+  E.line = (struct abuf) ABUF_INIT;
+  E.cells = (struct abuf) ABUF_INIT;
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  E.epfd = epoll_create1(EPOLL_CLOEXEC);
+  E.sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  E.statusTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  E.frameTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (E.epfd == -1 || E.sigfd == -1 || E.statusTimer == -1 ||
+      E.frameTimer == -1) {
+    die("initEditor");
+  }
+  editorWatch(STDIN_FILENO);
+  editorWatch(E.sigfd);
+  editorWatch(E.statusTimer);
+  editorWatch(E.frameTimer);
 }
 void initNet() {
   netConf.serverIp = "127.0.0.1";
   netConf.serverPort = 3018;
   netConf.server = -1;
   netConf.connected = 0;
+  netConf.listening = 0;
   netConf.id = NULL;
   netConf.pass = NULL;
   netConf.connectInterval = 25;
+  netConf.in.buf = NULL;
+  netConf.in.scratch = NULL;
+  netConf.in.scratchcap = 0;
+  netConf.log.ops = NULL;
+  netConf.log.head = 0;
+  netConf.log.n = 0;
+  netConf.log.cap = 0;
+  netConf.log.data = NULL;
+  netConf.log.datalen = 0;
+  netConf.log.datacap = 0;
+  netConf.seq.blocks = NULL;
+  netConf.seq.nblocks = 0;
+  netConf.seq.blockcap = 0;
+  netConf.seq.n = 0;
+  netConf.seq.slots = NULL;
+  netConf.seq.nslots = 0;
+  netConf.seq.used = 0;
+  netConf.seq.site = 0;
+  netConf.seq.clock = 0;
+  netConf.rev = 0;
+  netConf.unacked = 0;
+  netConf.flushInterval = COLED_FLUSH_MS;
+  netConf.flushTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  netConf.retryTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  netConf.cursorTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (netConf.flushTimer == -1 || netConf.retryTimer == -1 ||
+      netConf.cursorTimer == -1) {
+    die("timerfd_create");
+  }
+  editorWatch(netConf.flushTimer);
+  editorWatch(netConf.retryTimer);
+  editorWatch(netConf.cursorTimer);
+  netConf.cursors = NULL;
+  netConf.ncursors = 0;
+  netConf.cursorcap = 0;
+  netConf.cursorSent = 0;
+  netConf.cursorWait = 0;
+
+  netQueue *q = &netConf.out;
+  q->ops = NULL;
+  q->n = 0;
+  q->cap = 0;
+  q->bytes = 0;
+  q->buf = NULL;
+  q->sent = 0;
+  q->len = 0;
+  q->bufcap = 0;
+  signal(SIGPIPE, SIG_IGN);
 }
 
 int main(int argc, char *argv[]) {
@@ -1320,11 +4267,16 @@ int main(int argc, char *argv[]) {
     editorOpen(argv[1]);
   }
 
-  editorSetStatusMessage(5, "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-N = network");
+  editorSetStatusMessage(5, "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-N = network | Ctrl-G = stats");
 
   while (1) {
-    editorRefreshScreen();
+    if (editorInputPending()) {
+      editorRequestRefresh();
+    } else {
+      editorRefreshScreen();
+    }
     editorProcessKeypress();
+    netCursorMoved();
   }
 
   return 0;
@@ -0,0 +1,113 @@
+/*
+ * Times the sequence on a document of COLED_BENCH_ROWS rows of
+ * COLED_BENCH_WIDTH chars: local and remote inserts and deletes at random
+ * places, each batch on the text the one before left behind, then the
+ * bytes the sequence takes per char of it. Remote edits go through the
+ * handlers of received ops, duplicate check included. Built by make bench.
+ */
+#define main coledMain
+#include "coled.c"
+#undef main
+
+#include <time.h>
+
+#define COLED_BENCH_ROWS 20000
+#define COLED_BENCH_WIDTH 60
+#define COLED_BENCH_OPS 100000
+
+unsigned int benchSeed = 1;
+
+int benchRand(int n) {
+  benchSeed = benchSeed * 1103515245u + 12345u;
+  return (benchSeed >> 8) % n;
+}
+
+double benchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void benchPos(int *x, int *y) {
+  *y = benchRand(E.numrows);
+  *x = benchRand(editorRowAt(*y)->size + 1);
+}
+
+/* an id the text started with */
+seqId benchId() {
+  return (seqId) {0, 1 + benchRand(COLED_BENCH_ROWS * (COLED_BENCH_WIDTH + 1) - 1)};
+}
+
+/* the op a remote edit comes in, starting with its id */
+char payload[8 * COLED_VARINT_MAX];
+
+int benchPayload(int site, unsigned int clock) {
+  int len = netPutVarint(payload, site);
+  return len + netPutVarint(&payload[len], clock);
+}
+
+void benchReport(const char *name, double start) {
+  double secs = benchNow() - start;
+  printf("%-16s %10.0f ops/sec  %8d runs  %8d rows\n", name,
+         COLED_BENCH_OPS / secs, netConf.seq.n, E.numrows);
+}
+
+int main() {
+  char line[COLED_BENCH_WIDTH];
+  memset(line, 'a', sizeof(line));
+  for (int i = 0; i < COLED_BENCH_ROWS; i++) editorInsertRow(i, line, sizeof(line));
+  netConf.listening = 1;
+  netConf.seq.site = 1;
+  seqReset();
+  printf("%zu chars\n", editorTextSize());
+
+  double start = benchNow();
+  for (int i = 0; i < COLED_BENCH_OPS; i++) {
+    int x, y;
+    benchPos(&x, &y);
+    netConf.seq.mirror = (seqId) {COLED_MIRROR_SITE + i, 1};
+    netInsertText(x, y, i % 16 ? "b" : "\n", 1);
+  }
+  benchReport("local insert", start);
+
+  start = benchNow();
+  for (int i = 0; i < COLED_BENCH_OPS; i++) {
+    seqId origin = benchId();
+    int len = benchPayload(2, netConf.seq.clock + 1);
+    len += netPutVarint(&payload[len], origin.site);
+    len += netPutVarint(&payload[len], origin.clock);
+    len += netPutVarint(&payload[len], 0);
+    payload[len++] = 'c';
+    netSeqInsert(0, 0, payload, len);
+  }
+  benchReport("remote insert", start);
+
+  start = benchNow();
+  for (int i = 0; i < COLED_BENCH_OPS; i++) {
+    seqId id = benchId();
+    int len = benchPayload(id.site, id.clock);
+    len += netPutVarint(&payload[len], 0);
+    payload[len++] = 'a';
+    netSeqDelete(0, 0, payload, len);
+  }
+  benchReport("remote delete", start);
+
+  start = benchNow();
+  for (int i = 0; i < COLED_BENCH_OPS; i++) {
+    int x, y;
+    benchPos(&x, &y);
+    if (x < editorRowAt(y)->size) netDeleteSpan(x, y, x + 1, y);
+  }
+  benchReport("local delete", start);
+
+  seqDoc *d = &netConf.seq;
+  size_t bytes = sizeof(seqBlock *) * d->blockcap + sizeof(seqSlot) * d->nslots;
+  for (int i = 0; i < d->nblocks; i++) {
+    bytes += sizeof(seqBlock) + sizeof(seqRun) * d->blocks[i]->cap;
+  }
+  for (int i = 0; i < d->nslots; i++) bytes += sizeof(seqRef) * d->slots[i].cap;
+  size_t chars = editorTextSize();
+  printf("%zu chars, %zu bytes, %.2f bytes/char\n", chars, bytes,
+         (double) bytes / chars);
+  return 0;
+}
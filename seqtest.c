@@ -0,0 +1,202 @@
+/*
+ * Checks that the sequence converges: COLED_TEST_SITES replicas type at
+ * random places of the same text at once, each on its own, then take in
+ * the ops of the others, interleaved in an order of their own with some
+ * sent twice. One more replica only takes them in. After every round all
+ * of them must have the same rows and the same ids, tombstones included.
+ * Rounds start with a line-protocol edit every replica mirrors. Built with
+ * tiny blocks and spans by make test, so they split and merge all the time.
+ */
+#define main coledMain
+#include "coled.c"
+#undef main
+
+#define COLED_TEST_SITES 3
+#define COLED_TEST_REPLICAS (COLED_TEST_SITES + 1)
+#define COLED_TEST_SEEDS 20
+#define COLED_TEST_ROUNDS 100
+
+typedef struct testReplica {
+  struct editorConfig e;
+  netConfig net;
+  /* the ops it made in the round */
+  char *ops;
+  size_t len;
+} testReplica;
+
+testReplica reps[COLED_TEST_REPLICAS];
+int current;
+unsigned int testSeed;
+
+int testRand(int n) {
+  testSeed = testSeed * 1103515245u + 12345u;
+  return (testSeed >> 8) % n;
+}
+
+/* makes replica i the one the editor works on */
+void testSwitch(int i) {
+  reps[current].e = E;
+  reps[current].net = netConf;
+  E = reps[i].e;
+  netConf = reps[i].net;
+  current = i;
+}
+
+/* the chars of the rows joined by newlines */
+char *testText(size_t *len) {
+  char *s = malloc(editorTextSize() + 1);
+  size_t n = 0;
+  for (int y = 0; y < E.numrows; y++) {
+    erow *row = editorRowAt(y);
+    if (y > 0) s[n++] = '\n';
+    for (int x = 0; x < row->size; x++) s[n++] = editorRowCharAt(row, x);
+  }
+  *len = n;
+  return s;
+}
+
+/* the ids in order, three ints a char: site, clock and whether dead */
+int *testIds(int *n) {
+  seqDoc *d = &netConf.seq;
+  int live = 0, cap = 1024;
+  int *ids = malloc(sizeof(int) * cap);
+  *n = 0;
+  for (int bi = 0; bi < d->nblocks; bi++) {
+    for (int i = 0; i < d->blocks[bi]->n; i++) {
+      seqRun *r = &d->blocks[bi]->runs[i];
+      for (int k = 0; k < r->len; k++) {
+        if (*n + 3 > cap) ids = realloc(ids, sizeof(int) * (cap *= 2));
+        ids[(*n)++] = r->id.site;
+        ids[(*n)++] = r->id.clock + k;
+        ids[(*n)++] = r->dead;
+        if (!r->dead) live++;
+      }
+    }
+  }
+  size_t len;
+  free(testText(&len));
+  if ((size_t) live != len) {
+    printf("%d live ids for %zu chars\n", live, len);
+    exit(1);
+  }
+  return ids;
+}
+
+/* types a few keys at random places, as the user of replica i */
+void testType(int i) {
+  testSwitch(i);
+  int keys = 1 + testRand(20);
+  for (int k = 0; k < keys; k++) {
+    if (k == 0 || testRand(4) == 0) {
+      E.cy = testRand(E.numrows + 1);
+      E.cx = E.cy < E.numrows ? testRand(editorRowAt(E.cy)->size + 1) : 0;
+    }
+    int what = testRand(10);
+    if (what < 6) {
+      editorInsertChar('a' + testRand(3));
+    } else if (what < 7) {
+      editorInsertNewline();
+    } else {
+      editorDelChar();
+    }
+  }
+  netSerializeQueue();
+  reps[i].len = netConf.out.len;
+  if (reps[i].len > 0) {
+    reps[i].ops = realloc(reps[i].ops, reps[i].len);
+    memcpy(reps[i].ops, netConf.out.buf, reps[i].len);
+  }
+  netDropQueue();
+}
+
+/* takes in the ops of the others, the ones of each in order */
+void testReceive(int i) {
+  size_t off[COLED_TEST_SITES] = {0};
+  testSwitch(i);
+  for (;;) {
+    int left = 0;
+    for (int s = 0; s < COLED_TEST_SITES; s++) {
+      if (s != i && off[s] < reps[s].len) left++;
+    }
+    if (left == 0) break;
+    int s = testRand(COLED_TEST_SITES);
+    if (s == i || off[s] == reps[s].len) continue;
+
+    netFrame f;
+    size_t next = netFrameAt(reps[s].ops, off[s], reps[s].len, &f);
+    for (int times = testRand(8) ? 1 : 2; times > 0; times--) {
+      if (f.op == OP_SEQ_INSERT) netSeqInsert(f.a, f.b, f.payload, f.len);
+      if (f.op == OP_SEQ_DELETE) netSeqDelete(f.a, f.b, f.payload, f.len);
+    }
+    off[s] = next;
+  }
+}
+
+int main() {
+  for (unsigned int seed = 1; seed <= COLED_TEST_SEEDS; seed++) {
+    testSeed = seed;
+    for (int i = 0; i < COLED_TEST_REPLICAS; i++) {
+      memset(&E, 0, sizeof(E));
+      memset(&netConf, 0, sizeof(netConf));
+      netConf.flushTimer = -1;
+      netConf.listening = 1;
+      editorInsertRow(0, "hello world", 11);
+      editorInsertRow(1, "", 0);
+      editorInsertRow(2, "goodbye", 7);
+      seqReset();
+      netConf.seq.site = i + 1;
+      reps[i].e = E;
+      reps[i].net = netConf;
+      reps[i].len = 0;
+    }
+    current = 0;
+    E = reps[0].e;
+    netConf = reps[0].net;
+
+    for (int round = 1; round <= COLED_TEST_ROUNDS; round++) {
+      int y = testRand(E.numrows), x = testRand(editorRowAt(y)->size + 1);
+      int del = testRand(3) == 0 && x < editorRowAt(y)->size;
+      for (int i = 0; i < COLED_TEST_REPLICAS; i++) {
+        testSwitch(i);
+        netConf.seq.mirror = (seqId) {COLED_MIRROR_SITE + round, 1};
+        if (del) {
+          netDeleteSpan(x, y, x + 1, y);
+        } else {
+          netInsertText(x, y, "P", 1);
+        }
+      }
+
+      for (int i = 0; i < COLED_TEST_SITES; i++) testType(i);
+      for (int i = 0; i < COLED_TEST_REPLICAS; i++) testReceive(i);
+
+      testSwitch(0);
+      size_t len;
+      int n;
+      char *text = testText(&len);
+      int *ids = testIds(&n);
+      for (int i = 1; i < COLED_TEST_REPLICAS; i++) {
+        testSwitch(i);
+        size_t len2;
+        int n2;
+        char *text2 = testText(&len2);
+        int *ids2 = testIds(&n2);
+        if (len2 != len || memcmp(text, text2, len) != 0) {
+          printf("seed %u round %d: replica %d has %.*s, replica 1 %.*s\n",
+                 seed, round, i + 1, (int) len2, text2, (int) len, text);
+          return 1;
+        }
+        if (n2 != n || memcmp(ids, ids2, sizeof(int) * n) != 0) {
+          printf("seed %u round %d: the ids of replica %d differ\n", seed, round, i + 1);
+          return 1;
+        }
+        free(text2);
+        free(ids2);
+      }
+      free(text);
+      free(ids);
+      testSwitch(0);
+    }
+  }
+  printf("%d seeds of %d rounds converged\n", COLED_TEST_SEEDS, COLED_TEST_ROUNDS);
+  return 0;
+}
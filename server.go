@@ -2,45 +2,2318 @@ package main
 
 import (
 	"bufio"
+	"bytes"
+	"encoding/binary"
+	"errors"
 	"fmt"
-	"log"
+	"hash/crc32"
+	"io"
 	"os"
+	"os/signal"
 	"net"
-	"strings"
+	"slices"
+	"sort"
 	"strconv"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
 	"github.com/rs/xid"
 )
 
+// Session orders the edits of its participants. Every relayed edit gets
+// the next revision under mu, so all participants see the same order,
+// and the last historyLen edits are kept to transform late ones against.
+// The edits are applied to doc as they are ordered, once the creator has
+// uploaded the text it started from and closed ready.
 type Session struct {
 	id, pass string
-	participants map[*net.Conn]struct{}
-	host *net.Conn
+	participants map[*Client]struct{}
+	host *Client
+	// sites numbers the participants for the ids of their edits;
+	// joining counts those given one and not added yet
+	sites int
+	joining int
+
+	mu sync.Mutex
+	rev int
+	history []histEntry
+	doc Doc
+	loaded bool
+	ready chan struct{}
+	// snap is the last snapshot made for a joiner
+	snap *Snapshot
+}
+
+type histEntry struct {
+	from *Client
+	f Frame
+}
+
+const historyLen = 1024
+
+// uploadTimeout is how long joiners wait for the text the creator of a
+// session uploads; a var so tests can shorten it.
+var uploadTimeout = time.Minute
+
+func (s *Session) Add(c *Client) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	s.participants[c] = struct{}{}
+	c.rev = s.rev
+}
+
+// Join sends c the text of the session and the revision it is at, and
+// adds it. The snapshot is copied out under mu, where c is added, and
+// queued after: a joiner on a slow link holds up neither the edits of
+// the session nor other joins. What is sent to c meanwhile is held back
+// and queued behind the snapshot.
+//
+// Binary clients asking for chunks with joinChunks in flags get the
+// session's last Snapshot while the history still reaches back to it,
+// followed by the edits made since; resume names the revision and chunk
+// a dropped joiner got to, which it goes on from if that snapshot is
+// still the last one. A client coming back with joinSince gets only the
+// edits since the revision in resume instead, led by an opSync, if the
+// history still has them all.
+func (s *Session) Join(c *Client, flags int, resume Frame) error {
+	s.mu.Lock()
+	var buf []byte
+	var sn *Snapshot
+	start := 0
+	since := resume.a
+	if c.binary && flags & joinSince != 0 && resume.op == opResume &&
+		since <= s.rev && s.rev - since <= historyLen {
+		buf = Frame{op: opSync, a: since}.AppendBinary(buf)
+		buf = s.appendSince(buf, since)
+	} else if c.binary && flags & joinChunks != 0 {
+		sn = s.snap
+		if sn == nil || s.rev - sn.rev > historyLen {
+			sn = &Snapshot{rev: s.rev, body: s.doc.AppendBody(nil)}
+			s.snap = sn
+		}
+		if resume.op == opResume && resume.a == sn.rev && resume.b < sn.Chunks() {
+			start = resume.b
+		}
+		buf = s.appendSince(buf, sn.rev)
+	} else {
+		buf = s.doc.AppendSnapshot(nil, c)
+	}
+	for part := range s.participants {
+		if part.cursor.op != 0 {
+			buf = c.Append(buf, part.cursor)
+		}
+	}
+	// b marks the ack as the end of the join rather than that of an op.
+	buf = c.Append(buf, Frame{op: opAck, a: s.rev, b: 1})
+	s.joining--
+	s.participants[c] = struct{}{}
+	c.rev = s.rev
+	c.holding = true
+	s.mu.Unlock()
+
+	var err error
+	if sn != nil {
+		err = sn.Send(c, start, flags & joinPacked != 0)
+	}
+	if err == nil {
+		err = c.Put(buf)
+	}
+
+	// What was held meanwhile is put unlocked too, until none is left.
+	// The snapshot is let drain first, so that what is queued next finds
+	// room.
+	for {
+		c.wait(outHighWater / 2)
+		s.mu.Lock()
+		held := c.held
+		c.held = nil
+		if err != nil || len(held) == 0 {
+			c.holding = false
+			s.mu.Unlock()
+			return err
+		}
+		s.mu.Unlock()
+		err = c.Put(held)
+	}
+}
+
+// appendSince encodes the edits after revision rev, which the history
+// must still hold.
+func (s *Session) appendSince(dst []byte, rev int) []byte {
+	for rev++; rev <= s.rev; rev++ {
+		dst = s.history[rev % historyLen].f.AppendBinary(dst)
+	}
+	return dst
+}
+
+// Upload takes over the text the creator started the session from.
+func (s *Session) Upload(rows [][]byte, runs []byte) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	s.load(rows, runs)
+}
+
+func (s *Session) load(rows [][]byte, runs []byte) {
+	if s.loaded {
+		return
+	}
+	s.doc.Load(rows, runs)
+	s.loaded = true
+	close(s.ready)
+}
+
+// NextSite numbers a joiner, which keeps the session alive until Join
+// adds it; 0 if the session has been deleted meanwhile.
+func (s *Session) NextSite() int {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if s.Empty() {
+		return 0
+	}
+	s.joining++
+	s.sites++
+	return s.sites
+}
+
+// AwaitUpload waits for the text of the session on behalf of a joiner
+// NextSite numbered, up to uploadTimeout or until c is cut off: a creator
+// that stalls before its upload is not to hold its joiners forever. One
+// giving up no longer keeps the session alive.
+func (s *Session) AwaitUpload(c *Client) bool {
+	timer := time.NewTimer(uploadTimeout)
+	defer timer.Stop()
+	select {
+	case <-s.ready:
+		return true
+	case <-timer.C:
+	case <-c.done:
+	}
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	s.joining--
+	if s.Empty() {
+		sessions.Remove(s.id)
+	}
+	return false
+}
+
+func (s *Session) Delete(c *Client) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if _, ok := s.participants[c]; !ok {
+		return
+	}
+	delete(s.participants, c)
+	if c.cursor.op != 0 {
+		s.Broadcast(c, Frame{op: opCursor, payload: binary.AppendUvarint(nil, uint64(c.site))})
+	}
+	// c may go on to another session, where none of this applies
+	c.cursor = Frame{}
+	c.cursorDue = false
+	// a creator gone before its upload leaves joiners an empty text
+	s.load(nil, nil)
+	if s.Empty() {
+		sessions.Remove(s.id)
+		logger.Info("Deleting session %s, %s", s.id, sessions.Stats())
+	} else if s.host == c {
+		for newhost := range s.participants {
+			s.host = newhost
+			logger.Info("New host of %s is %s", s.id, newhost.conn.RemoteAddr())
+			break
+		}
+	}
+}
+
+// IsHost tells if c is the participant the session takes uploads from.
+func (s *Session) IsHost(c *Client) bool {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	return s.host == c
+}
+
+func (s *Session) Empty() bool {
+	return len(s.participants) == 0 && s.joining == 0
+}
+
+func (s *Session) Init() {
+	s.participants = make(map[*Client]struct{})
+	s.history = make([]histEntry, historyLen)
+	s.ready = make(chan struct{})
+}
+
+// Relay gives an edit from c the next revision and sends it on. Its
+// position is transformed past the edits of others that c had not seen
+// when it made it: binary clients say which revision that was, for line
+// clients it is the last one sent to them. The sender gets an ack
+// carrying the revision, in order with the edits it is sent.
+func (s *Session) Relay(c *Client, f Frame) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+
+	if s.loaded && s.doc.Applied(f) {
+		// Sent again after a reconnect; all that is owed is the ack.
+		if c.binary {
+			c.Send(Frame{op: opAck, a: s.rev})
+		}
+		return
+	}
+
+	base := c.rev
+	if c.binary {
+		if b, ok := f.SeqBase(); ok {
+			base = b
+		}
+	}
+	if base > s.rev {
+		base = s.rev
+	}
+	if base < s.rev - historyLen {
+		base = s.rev - historyLen
+	}
+	a, b := f.a, f.b
+	for rev := base + 1; rev <= s.rev; rev++ {
+		h := &s.history[rev % historyLen]
+		if h.from == c {
+			continue
+		}
+		if e, ok := h.f.Edit(); ok {
+			f.a, f.b = e.Shift(f.a, f.b)
+		}
+	}
+	if f.a != a || f.b != b {
+		f.raw = nil
+	}
+
+	s.rev++
+	s.history[s.rev % historyLen] = histEntry{from: c, f: f}
+	if s.loaded {
+		s.doc.Apply(f, s.rev)
+	}
+	s.Broadcast(c, f)
+	c.rev = s.rev
+	if c.binary {
+		c.Send(Frame{op: opAck, a: s.rev})
+	}
+}
+
+// Cursor passes on where the cursor of c is, after the char of an id
+// that follows it through edits, with its position as a fallback. Moves
+// within presenceInterval of the last one passed on are coalesced, the
+// latest winning, and go out when it is up. Cursors are not edits: they
+// get no revision and stay out of the history, and joiners get the last
+// one of everyone instead. Others get it led by the site of c, and that
+// alone once c leaves.
+func (s *Session) Cursor(c *Client, f Frame) {
+	if _, rest, ok := f.SeqIDs(); !ok || len(rest) > 0 {
+		return
+	}
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if _, ok := s.participants[c]; !ok {
+		return
+	}
+	payload := binary.AppendUvarint(nil, uint64(c.site))
+	c.cursor = Frame{op: opCursor, a: f.a, b: f.b, payload: append(payload, f.payload...)}
+	if c.cursorDue {
+		return
+	}
+	if wait := presenceInterval - time.Since(c.cursorSent); wait > 0 {
+		c.cursorDue = true
+		time.AfterFunc(wait, func() {
+			s.mu.Lock()
+			defer s.mu.Unlock()
+			if _, ok := s.participants[c]; ok {
+				c.cursorDue = false
+				s.sendCursor(c)
+			}
+		})
+		return
+	}
+	s.sendCursor(c)
+}
+
+func (s *Session) sendCursor(c *Client) {
+	c.cursorSent = time.Now()
+	s.Broadcast(c, c.cursor)
+}
+
+// Broadcast forwards f to everyone in the session but from, encoding it
+// at most once per protocol and queueing the same bytes for each.
+func (s *Session) Broadcast(from *Client, f Frame) {
+	var bin, text []byte
+	for part := range s.participants {
+		if part == from {continue}
+		part.rev = s.rev
+		var buf []byte
+		if part.binary {
+			if bin == nil {
+				bin = f.raw
+			}
+			if bin == nil {
+				bin = f.AppendBinary(nil)
+			}
+			buf = bin
+		} else {
+			if text == nil {
+				text = f.AppendText(nil)
+			}
+			if len(text) == 0 {continue}
+			buf = text
+		}
+		if part.holding {
+			if len(part.held) > outHighWater {
+				part.drop()
+			} else {
+				part.held = append(part.held, buf...)
+			}
+			continue
+		}
+		part.Queue(buf)
+		if logger.Tracing() {
+			logger.Trace("Writing to %s", part.conn.RemoteAddr())
+		}
+	}
+}
+
+// Snapshot is the text of a session at rev as chunked joins get it, the
+// body of Doc.AppendBody cut into chunks of snapChunk bytes. A chunk goes
+// with the CRC-32 of its bytes and, to joiners that take it, packed with
+// lzPack when that makes it smaller; packing happens once per snapshot,
+// outside the session lock.
+type Snapshot struct {
+	rev int
+	body []byte
+	once sync.Once
+	packed [][]byte
+}
+
+const (
+	snapChunk = 256 << 10
+	// joinChunks, joinPacked and joinSince are the flags of a join
+	joinChunks = 1
+	joinPacked = 2
+	joinSince = 4
+)
+
+func (sn *Snapshot) Chunks() int {
+	return (len(sn.body) + snapChunk - 1) / snapChunk
+}
+
+func (sn *Snapshot) chunk(i int) []byte {
+	end := (i + 1) * snapChunk
+	if end > len(sn.body) {
+		end = len(sn.body)
+	}
+	return sn.body[i*snapChunk : end]
+}
+
+func (sn *Snapshot) pack() {
+	sn.packed = make([][]byte, sn.Chunks())
+	for i := range sn.packed {
+		sn.packed[i] = lzPack(sn.chunk(i))
+	}
+}
+
+// Send queues the snapshot for c from chunk start on: a head with the
+// number of chunks, the revision and start, then a frame per chunk with
+// its index, its unpacked length if packed, and the checksum and bytes.
+// The bytes are queued as they are, shared by every joiner.
+func (sn *Snapshot) Send(c *Client, start int, packed bool) error {
+	if packed {
+		sn.once.Do(sn.pack)
+	}
+	head := Frame{op: opChunks, a: sn.Chunks(), b: sn.rev, payload: binary.AppendUvarint(nil, uint64(start))}
+	if err := c.Put(head.AppendBinary(nil)); err != nil {
+		return err
+	}
+	for i := start; i < sn.Chunks(); i++ {
+		raw := sn.chunk(i)
+		data, n := raw, 0
+		if packed && sn.packed[i] != nil {
+			data, n = sn.packed[i], len(raw)
+		}
+		buf := make([]byte, 0, 1 + 3 * binary.MaxVarintLen64 + 4)
+		buf = append(buf, opChunk)
+		buf = binary.AppendUvarint(buf, uint64(i))
+		buf = binary.AppendUvarint(buf, uint64(n))
+		buf = binary.AppendUvarint(buf, uint64(4 + len(data)))
+		buf = binary.LittleEndian.AppendUint32(buf, crc32.ChecksumIEEE(raw))
+		if err := c.Put(buf); err != nil {
+			return err
+		}
+		if err := c.Put(data); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// lzPack packs src as an LZ4 style block: sequences of a token holding
+// the literal count in its high nibble and the match length less 4 in
+// its low one, 15 meaning the rest follows in bytes while they are 255,
+// then the literals, the match offset in two little endian bytes and the
+// rest of its length. The last sequence has literals only. Matches are
+// found greedily through a hash of the next 4 bytes. nil if it comes out
+// no smaller.
+func lzPack(src []byte) []byte {
+	const minMatch = 4
+	var table [1 << 14]int32
+	dst := make([]byte, 0, len(src))
+	anchor, i := 0, 0
+	for i + minMatch <= len(src) {
+		v := binary.LittleEndian.Uint32(src[i:])
+		h := v * 2654435761 >> 18
+		ref := int(table[h]) - 1
+		table[h] = int32(i + 1)
+		if ref < 0 || i - ref > 0xffff || binary.LittleEndian.Uint32(src[ref:]) != v {
+			i++
+			continue
+		}
+		n := minMatch
+		for i + n < len(src) && src[ref+n] == src[i+n] {
+			n++
+		}
+		dst = lzSequence(dst, src[anchor:i], i - ref, n)
+		if len(dst) >= len(src) {
+			return nil
+		}
+		i += n
+		anchor = i
+	}
+	dst = lzSequence(dst, src[anchor:], 0, 0)
+	if len(dst) >= len(src) {
+		return nil
+	}
+	return dst
+}
+
+// lzSequence appends a sequence of lzPack, a match of n at off after lit.
+func lzSequence(dst, lit []byte, off, n int) []byte {
+	l, m := len(lit), n - 4
+	token := byte(min(l, 15)) << 4
+	if n > 0 {
+		token |= byte(min(m, 15))
+	}
+	dst = append(dst, token)
+	if l >= 15 {
+		dst = lzLength(dst, l - 15)
+	}
+	dst = append(dst, lit...)
+	if n == 0 {
+		return dst
+	}
+	dst = append(dst, byte(off), byte(off >> 8))
+	if m >= 15 {
+		dst = lzLength(dst, m - 15)
+	}
+	return dst
+}
+
+func lzLength(dst []byte, n int) []byte {
+	for ; n >= 255; n -= 255 {
+		dst = append(dst, 255)
+	}
+	return append(dst, byte(n))
+}
+
+// Client is one connection. Clients that open with the hello line speak
+// binary frames, everybody else the original line protocol.
+//
+// What is sent to a client is queued for a goroutine of its own that
+// writes it out, so a slow client holds up nobody sending to it; it is
+// cut off instead once it falls too far behind.
+type Client struct {
+	conn net.Conn
+	reader *bufio.Reader
+	binary bool
+	// rev is the last revision of its session sent to it
+	rev int
+	// held is what was sent to it while holding, during its snapshot
+	holding bool
+	held []byte
+	// site numbers it in its session. cursor is the last place it said
+	// its cursor is, passed on at cursorSent or, while cursorDue, once
+	// presenceInterval is up; all three are under the mu of the session.
+	site int
+	cursor Frame
+	cursorSent time.Time
+	cursorDue bool
+
+	// out is the queue of writeLoop and queued the bytes waiting in it;
+	// room is signalled as they go out. done is closed by Close.
+	out chan []byte
+	queued atomic.Int64
+	room chan struct{}
+	done chan struct{}
+	gone, closed atomic.Bool
+}
+
+const (
+	// outQueue writes or outHighWater bytes waiting make a client slow
+	outQueue = 1024
+	outHighWater = 4 << 20
+	writeBuf = 64 << 10
+	// presenceInterval is how often the cursor of a client is passed on
+	presenceInterval = 50 * time.Millisecond
+)
+
+var errGone = errors.New("client cut off")
+
+func newClient(conn net.Conn) *Client {
+	c := &Client{
+		conn: conn,
+		reader: bufio.NewReader(conn),
+		out: make(chan []byte, outQueue),
+		room: make(chan struct{}, 1),
+		done: make(chan struct{}),
+	}
+	go c.writeLoop()
+	return c
+}
+
+// writeLoop writes out what is queued for c through a buffer that is
+// flushed whenever the queue runs dry, so frames queued together leave
+// in one write. Once a write fails the rest is dropped. conn is closed
+// once the queue is and what was in it has gone out.
+func (c *Client) writeLoop() {
+	w := bufio.NewWriterSize(c.conn, writeBuf)
+	for {
+		var buf []byte
+		select {
+		case buf = <-c.out:
+		case <-c.done:
+			select {
+			case buf = <-c.out:
+			default:
+				c.conn.Close()
+				return
+			}
+		}
+		c.queued.Add(-int64(len(buf)))
+		select {
+		case c.room <- struct{}{}:
+		default:
+		}
+		if c.gone.Load() {
+			continue
+		}
+		_, err := w.Write(buf)
+		if err == nil && len(c.out) == 0 {
+			err = w.Flush()
+		}
+		if err != nil {
+			c.drop()
+		}
+	}
+}
+
+// drop cuts c off; its reader fails then and takes it out of its session,
+// and a join it waits on gives up. The connection is reset rather than
+// left to drain what the kernel still buffers for it.
+func (c *Client) drop() {
+	if !c.gone.Swap(true) {
+		if tc, ok := c.conn.(*net.TCPConn); ok {
+			tc.SetLinger(0)
+		}
+		c.conn.Close()
+		c.Close()
+	}
+}
+
+// wait waits while more than n bytes are queued for c.
+func (c *Client) wait(n int64) {
+	for c.queued.Load() > n && !c.gone.Load() {
+		<-c.room
+	}
+}
+
+// Close ends the queue of c. What is queued after is dropped: a session
+// broadcasting to c as it leaves is not to be held up by it.
+func (c *Client) Close() {
+	if !c.closed.Swap(true) {
+		close(c.done)
+	}
+}
+
+// Queue hands buf to the writer of c without waiting. A client that
+// lets outQueue writes or outHighWater bytes pile up is cut off rather
+// than buffered without bound: binary ones come back with joinSince and
+// catch up from the history, or from a snapshot if it moved on too far.
+func (c *Client) Queue(buf []byte) error {
+	if len(buf) == 0 {
+		return nil
+	}
+	if c.gone.Load() || c.closed.Load() {
+		return errGone
+	}
+	if c.queued.Add(int64(len(buf))) <= outHighWater {
+		select {
+		case c.out <- buf:
+			return nil
+		default:
+		}
+	}
+	c.queued.Add(-int64(len(buf)))
+	logger.Info("Cutting off slow client %s", c.conn.RemoteAddr())
+	c.drop()
+	return errGone
+}
+
+// Put hands buf to the writer of c, waiting while outHighWater bytes are
+// queued. Only the goroutine of c itself puts, which the wait holds up
+// alone.
+func (c *Client) Put(buf []byte) error {
+	c.wait(outHighWater)
+	if c.gone.Load() || c.closed.Load() {
+		return errGone
+	}
+	c.queued.Add(int64(len(buf)))
+	c.out <- buf
+	return nil
+}
+
+// Append encodes f in the protocol of c.
+func (c *Client) Append(dst []byte, f Frame) []byte {
+	if c.binary {
+		return f.AppendBinary(dst)
+	}
+	return f.AppendText(dst)
+}
+
+func (c *Client) Send(f Frame) error {
+	return c.Queue(c.Append(nil, f))
+}
+
+// ReadMsg returns the next message as a frame whatever the protocol.
+// Unknown text commands come back with op 0.
+func (c *Client) ReadMsg() (Frame, error) {
+	if c.binary {
+		return ReadFrame(c.reader)
+	}
+
+	line, err := c.readLine()
+	if logger.Tracing() {
+		logger.Trace("msg: %q", string(line))
+	}
+	if err != nil {
+		return Frame{}, err
+	}
+
+	if string(line) == helloBin {
+		c.binary = true
+		if err := c.Queue([]byte("bin\n")); err != nil {
+			return Frame{}, err
+		}
+		return c.ReadMsg()
+	}
+	return c.parseLine(line)
+}
+
+// readLine returns the next line without its newline. It is a view into
+// the buffer of the reader, valid until the next read, and only copied
+// out if it is longer than that.
+func (c *Client) readLine() ([]byte, error) {
+	line, err := c.reader.ReadSlice('\n')
+	if err == bufio.ErrBufferFull {
+		line = append([]byte(nil), line...)
+		var rest []byte
+		rest, err = c.reader.ReadBytes('\n')
+		line = append(line, rest...)
+	}
+	if err != nil {
+		return line, err
+	}
+	return line[:len(line)-1], nil
+}
+
+// parseLine turns a line of the text protocol into a frame: a command and
+// its params, separated by single spaces. The char of a char command is
+// the byte after its space, which may be a space itself. The edits, which
+// come a char at a time, are parsed without allocating: their payload is
+// a slice of byteValues.
+func (c *Client) parseLine(line []byte) (Frame, error) {
+	cmd, rest := cutField(line)
+	switch string(cmd) {
+	case "create":
+		pass, rest := cutField(rest)
+		if len(pass) == 0 || rest != nil {
+			return Frame{}, nil
+		}
+		return Frame{op: opCreate, payload: append([]byte(nil), pass...)}, nil
+	case "join":
+		id, rest := cutField(rest)
+		pass, rest := cutField(rest)
+		if len(id) == 0 || len(pass) == 0 || rest != nil {
+			return Frame{}, nil
+		}
+		payload := append(append(make([]byte, 0, len(id) + len(pass)), id...), pass...)
+		return Frame{op: opJoin, a: len(id), payload: payload}, nil
+	case "response":
+		if len(rest) > 0 {
+			return Frame{}, nil
+		}
+		count, err := c.readLine()
+		if err != nil {
+			return Frame{}, err
+		}
+		rows, ok := atoi(bytes.TrimSpace(count))
+		if !ok {
+			logger.Error("Bad row count from %s: %q", c.conn.RemoteAddr(), string(count))
+			return Frame{}, nil
+		}
+		return Frame{op: opSnapshot, a: rows}, nil
+	case "char":
+		if len(rest) < 2 || rest[1] != ' ' {
+			return Frame{}, nil
+		}
+		ch := int(rest[0])
+		if x, y, ok := parsePos(rest[2:]); ok {
+			return Frame{op: opChar, a: x, b: y, payload: byteValues[ch : ch+1 : ch+1]}, nil
+		}
+	case "newline", "delete":
+		if x, y, ok := parsePos(rest); ok {
+			op := opNewline
+			if cmd[0] == 'd' {
+				op = opDelete
+			}
+			return Frame{op: op, a: x, b: y}, nil
+		}
+	}
+	return Frame{}, nil
+}
+
+// byteValues holds every byte value once, for one byte payloads.
+var byteValues = func() (b [256]byte) {
+	for i := range b {
+		b[i] = byte(i)
+	}
+	return
+}()
+
+// cutField splits s at its first space; rest is nil if there is none.
+func cutField(s []byte) (field, rest []byte) {
+	if i := bytes.IndexByte(s, ' '); i >= 0 {
+		return s[:i], s[i+1:]
+	}
+	return s, nil
+}
+
+// parsePos parses the "cx cy" a text edit ends with.
+func parsePos(s []byte) (int, int, bool) {
+	xs, rest := cutField(s)
+	ys, rest := cutField(rest)
+	x, ok1 := atoi(xs)
+	y, ok2 := atoi(ys)
+	return x, y, ok1 && ok2 && rest == nil
+}
+
+// atoi parses a decimal of digits only, up to maxPayload.
+func atoi(s []byte) (int, bool) {
+	n := 0
+	for _, c := range s {
+		if c < '0' || c > '9' {
+			return 0, false
+		}
+		if n = n * 10 + int(c - '0'); n > maxPayload {
+			return 0, false
+		}
+	}
+	return n, len(s) > 0
+}
+
+// ReadRow reads one frame of the text a creator uploads, a row or the
+// sequence runs that follow the rows.
+func (c *Client) ReadRow() (Frame, error) {
+	if c.binary {
+		f, err := ReadFrame(c.reader)
+		if err != nil {
+			return f, err
+		}
+		if f.op != opRow && f.op != opSeqRuns {
+			return f, errFrame
+		}
+		return f, nil
+	}
+
+	row, err := c.reader.ReadBytes('\n')
+	if err != nil {
+		return Frame{}, err
+	}
+	return Frame{op: opRow, payload: row[:len(row)-1]}, nil
+}
+
+// Frame is one message of the binary protocol: an opcode byte, then the
+// two args (cx/cy for edits) and the payload length as uvarints, then the
+// payload. The same opcodes describe text-protocol messages.
+//
+// Sequence ops start their payload with uvarint ids, site and clock of
+// the text and for inserts of the char it went in after, then the
+// revision the sender had seen. They keep cx/cy as the position the
+// sender saw, which the server transforms; the ids it only relays.
+type Frame struct {
+	op byte
+	a, b int
+	payload []byte
+	// raw is the frame as read, the payload a slice of it; it is sent on
+	// as is while a and b are unchanged
+	raw []byte
+}
+
+const (
+	opCreate byte = iota + 1
+	opJoin
+	opReply
+	opRequest
+	opSnapshot
+	opRow
+	opChar
+	opNewline
+	opDelete
+	opInsert
+	opDelRange
+	_ // 12 was replace-lines, which nothing sent
+	opSeqInsert
+	opSeqDelete
+	opSeqRuns
+	opAck
+	opChunks
+	opChunk
+	opResume
+	opSync
+	opCursor
+)
+
+const (
+	helloBin = "hello bin"
+	maxPayload = 1 << 30
+	// maxID bounds the uvarints of ids, which clients keep in 32 bits
+	maxID = 1 << 32 - 1
+)
+
+var errFrame = errors.New("malformed frame")
+
+// ReadFrame reads the next frame, all of it into raw.
+func ReadFrame(r *bufio.Reader) (Frame, error) {
+	var f Frame
+	var head [1 + 3 * binary.MaxVarintLen64]byte
+	op, err := r.ReadByte()
+	if err != nil {
+		return f, err
+	}
+	f.op = op
+	head[0] = op
+	n := 1
+
+	var args [3]uint64
+	for i := range args {
+		args[i], err = binary.ReadUvarint(r)
+		if err != nil {
+			return f, err
+		}
+		if args[i] > maxPayload {
+			return f, errFrame
+		}
+		n += len(binary.AppendUvarint(head[n:n], args[i]))
+	}
+	f.a, f.b = int(args[0]), int(args[1])
+
+	f.raw = make([]byte, n + int(args[2]))
+	copy(f.raw, head[:n])
+	f.payload = f.raw[n:]
+	_, err = io.ReadFull(r, f.payload)
+	return f, err
+}
+
+func (f Frame) AppendBinary(dst []byte) []byte {
+	if f.raw != nil {
+		return append(dst, f.raw...)
+	}
+	dst = append(dst, f.op)
+	dst = binary.AppendUvarint(dst, uint64(f.a))
+	dst = binary.AppendUvarint(dst, uint64(f.b))
+	dst = binary.AppendUvarint(dst, uint64(len(f.payload)))
+	return append(dst, f.payload...)
+}
+
+// seqFields is how many uvarints lead the payload of a sequence op.
+func (f Frame) seqFields() int {
+	switch f.op {
+	case opSeqInsert:
+		return 5
+	case opCursor:
+		return 2
+	}
+	return 3
+}
+
+// SeqText returns the text of a sequence op, past its uvarints.
+func (f Frame) SeqText() ([]byte, bool) {
+	p := f.payload
+	for i := 0; i < f.seqFields(); i++ {
+		_, k := binary.Uvarint(p)
+		if k <= 0 {
+			return nil, false
+		}
+		p = p[k:]
+	}
+	return p, true
+}
+
+// SeqIDs returns the leading uvarints of a sequence op and its text.
+func (f Frame) SeqIDs() ([5]int, []byte, bool) {
+	var v [5]int
+	p := f.payload
+	for i := 0; i < f.seqFields(); i++ {
+		u, k := binary.Uvarint(p)
+		if k <= 0 || u > maxID {
+			return v, nil, false
+		}
+		v[i] = int(u)
+		p = p[k:]
+	}
+	return v, p, true
+}
+
+// SeqBase returns the revision a sequence op was made at.
+func (f Frame) SeqBase() (int, bool) {
+	if f.op != opSeqInsert && f.op != opSeqDelete {
+		return 0, false
+	}
+	p := f.payload
+	var v uint64
+	for i := 0; i < f.seqFields(); i++ {
+		var k int
+		v, k = binary.Uvarint(p)
+		if k <= 0 {
+			return 0, false
+		}
+		p = p[k:]
+	}
+	return int(v), true
+}
+
+// Edit is where an edit went and how far its text reaches: nl newlines
+// and tail chars after the last one.
+type Edit struct {
+	del bool
+	x, y int
+	nl, tail int
+}
+
+// Edit returns the positional effect of f. A delete at the start of a
+// line protocol row joins it to a row whose length the server doesn't
+// know and isn't transformed against.
+func (f Frame) Edit() (Edit, bool) {
+	e := Edit{x: f.a, y: f.b}
+	var text []byte
+	ok := true
+	switch f.op {
+	case opSeqInsert, opSeqDelete:
+		text, ok = f.SeqText()
+		e.del = f.op == opSeqDelete
+	case opInsert, opChar:
+		text = f.payload
+	case opDelRange:
+		text, e.del = f.payload, true
+	case opNewline:
+		text = []byte{'\n'}
+	case opDelete:
+		if f.a == 0 {
+			return e, false
+		}
+		text, e.del, e.x = []byte{' '}, true, f.a - 1
+	default:
+		return e, false
+	}
+	if !ok || len(text) == 0 {
+		return e, false
+	}
+	for _, c := range text {
+		if c == '\n' {
+			e.nl++
+			e.tail = 0
+		} else {
+			e.tail++
+		}
+	}
+	return e, true
+}
+
+// Shift moves the position (x, y) over e, as if made after it. An insert
+// at the same position goes after the one already ordered.
+func (e Edit) Shift(x, y int) (int, int) {
+	if !e.del {
+		if y == e.y && x >= e.x {
+			if e.nl > 0 {
+				return x - e.x + e.tail, y + e.nl
+			}
+			return x + e.tail, y
+		}
+		if y > e.y {
+			return x, y + e.nl
+		}
+		return x, y
+	}
+
+	ex, ey := e.x + e.tail, e.y
+	if e.nl > 0 {
+		ex, ey = e.tail, e.y + e.nl
+	}
+	switch {
+	case y < e.y || y == e.y && x <= e.x:
+		return x, y
+	case y < ey || y == ey && x < ex:
+		return e.x, e.y
+	case y == ey:
+		return e.x + x - ex, e.y
+	}
+	return x, y - e.nl
+}
+
+// Doc is a session's text as the server holds it: the rows and, over
+// them, the sequence runs the clients keep, following the sequence
+// section of coled.c op for op. Every relayed edit is applied to it in
+// revision order, so joiners get their snapshot from here and no
+// participant is asked for one; the creator uploads the text the session
+// starts from once, right after creating it.
+//
+// Both are kept in blocks like the client keeps them, so an edit under
+// the session lock costs a block's worth of moves and a walk over block
+// summaries however big the text is. The rows are in rowBlocks of up to
+// 2 * rowBlockRows. The runs are in runBlocks of up to 2 * seqBlockRuns,
+// each knowing how its live runs move a position; a run never spans a
+// multiple of seqSpan in its clocks and index holds the first clock and
+// block of every run of a site in each such span, so an id is found by a
+// binary search and a walk over the runs of one block.
+type Doc struct {
+	rows []rowBlock
+	nrows int
+	// rows[i].first is right for i < stale; last is the block hit last
+	stale, last int
+	blocks []*runBlock
+	nruns int
+	index map[seqKey][]seqRef
+	clock int
+	// the id the next mirrored char gets
+	mirror seqID
+}
+
+// The sizes of the blocks and spans, vars so tests can make them small.
+var (
+	rowBlockRows = 1024
+	seqBlockRuns = 128
+	seqSpan = 1024
+)
+
+// mirrored chars are of sites from here on, one per revision
+const mirrorSite = 1 << 30
+
+// rowBlock holds rows from row first on.
+type rowBlock struct {
+	first int
+	rows [][]byte
+}
+
+// seqID is the id of a char, its site and Lamport clock. Positional
+// edits are mirrored by every replica under the site mirrorSite plus the
+// edit's revision, with clocks from 1, so all of them give those chars
+// the same ids.
+type seqID struct {
+	site, clock int
+}
+
+// seqRun is a stretch of ids from one site with consecutive clocks. Live
+// runs know the newlines in them and the chars after the last one.
+type seqRun struct {
+	id seqID
+	len int
+	nl, tail int
+	dead bool
+}
+
+// runBlock holds runs in order; live sums up the live ones unless stale.
+type runBlock struct {
+	runs []seqRun
+	live seqRun
+	stale bool
+}
+
+// seqKey names the ids of a site with clocks in one seqSpan.
+type seqKey struct {
+	site, span int
+}
+
+// seqRef is a run starting at clock and the block holding it.
+type seqRef struct {
+	clock int
+	b *runBlock
+}
+
+func seqCmp(a, b seqID) int {
+	switch {
+	case a.clock < b.clock, a.clock == b.clock && a.site < b.site:
+		return -1
+	case a == b:
+		return 0
+	}
+	return 1
+}
+
+func seqBefore(x, y, ex, ey int) bool {
+	return y < ey || y == ey && x < ex
+}
+
+// seqRunsOn tells whether b can be joined to a: their ids run on within
+// a span and both are live or dead.
+func seqRunsOn(a, b *seqRun) bool {
+	return a.dead == b.dead && a.id.site == b.id.site &&
+		a.id.clock + a.len == b.id.clock && a.id.clock / seqSpan == b.id.clock / seqSpan
+}
+
+// textEnd moves (x, y) past s.
+func textEnd(s []byte, x, y int) (int, int) {
+	for {
+		i := bytes.IndexByte(s, '\n')
+		if i < 0 {
+			return x + len(s), y
+		}
+		x, y, s = 0, y + 1, s[i+1:]
+	}
+}
+
+// insertBytes inserts s into row at at, or at its end if at is past it.
+func insertBytes(row []byte, at int, s []byte) []byte {
+	if at < 0 || at > len(row) {
+		at = len(row)
+	}
+	n := len(row)
+	row = append(row, s...)
+	copy(row[at+len(s):], row[at:n])
+	copy(row[at:], s)
+	return row
+}
+
+// blockAt returns the block holding row at, the last one for at == nrows.
+func (d *Doc) blockAt(at int) int {
+	if i := d.last; i < d.stale && i < len(d.rows) && at >= d.rows[i].first &&
+	   at < d.rows[i].first + len(d.rows[i].rows) {
+		return i
+	}
+	for ; d.stale < len(d.rows); d.stale++ {
+		if i := d.stale; i > 0 {
+			d.rows[i].first = d.rows[i-1].first + len(d.rows[i-1].rows)
+		} else {
+			d.rows[i].first = 0
+		}
+	}
+	i := sort.Search(len(d.rows), func(i int) bool { return d.rows[i].first > at }) - 1
+	d.last = max(i, 0)
+	return d.last
+}
+
+// row returns row y, which must exist.
+func (d *Doc) row(y int) *[]byte {
+	b := &d.rows[d.blockAt(y)]
+	return &b.rows[y-b.first]
+}
+
+func (d *Doc) rowSize(y int) int {
+	if y >= 0 && y < d.nrows {
+		return len(*d.row(y))
+	}
+	return 0
+}
+
+// setRows takes over rows, cut into blocks.
+func (d *Doc) setRows(rows [][]byte) {
+	d.rows, d.nrows, d.stale, d.last = d.rows[:0], len(rows), 0, 0
+	for len(rows) > 0 {
+		n := min(len(rows), rowBlockRows)
+		d.rows = append(d.rows, rowBlock{rows: rows[:n:n]})
+		rows = rows[n:]
+	}
+}
+
+// openRows makes room for count nil rows at at. Rows that would overflow
+// their block are cut into new ones with the rows after them, so a big
+// paste moves those once.
+func (d *Doc) openRows(at, count int) {
+	if len(d.rows) == 0 {
+		d.rows = append(d.rows, rowBlock{})
+	}
+	i := d.blockAt(at)
+	b := &d.rows[i]
+	k := at - b.first
+	d.nrows += count
+	if len(b.rows) + count <= 2 * rowBlockRows {
+		b.rows = slices.Insert(b.rows, k, make([][]byte, count)...)
+		d.stale = min(d.stale, i + 1)
+		return
+	}
+
+	rows := make([][]byte, 0, len(b.rows) + count)
+	rows = append(rows, b.rows[:k]...)
+	rows = append(rows, make([][]byte, count)...)
+	rows = append(rows, b.rows[k:]...)
+	var cut []rowBlock
+	for len(rows) > 0 {
+		n := min(len(rows), rowBlockRows)
+		cut = append(cut, rowBlock{rows: rows[:n:n]})
+		rows = rows[n:]
+	}
+	d.rows = slices.Replace(d.rows, i, i + 1, cut...)
+	d.stale = min(d.stale, i)
+}
+
+// delRows deletes count rows from at on.
+func (d *Doc) delRows(at, count int) {
+	d.nrows -= count
+	for count > 0 {
+		i := d.blockAt(at)
+		b := &d.rows[i]
+		k := at - b.first
+		m := min(len(b.rows) - k, count)
+		b.rows = slices.Delete(b.rows, k, k + m)
+		count -= m
+		if len(b.rows) == 0 && len(d.rows) > 1 {
+			d.rows = slices.Delete(d.rows, i, i + 1)
+			d.stale = min(d.stale, i)
+		} else {
+			d.stale = min(d.stale, i + 1)
+		}
+	}
+}
+
+func (d *Doc) insertRow(at int, s []byte) {
+	if at < 0 || at > d.nrows {
+		return
+	}
+	d.openRows(at, 1)
+	*d.row(at) = append([]byte(nil), s...)
+}
+
+// insertText inserts s at (cx, cy) of the rows, a new row if cy is the
+// one past the end.
+func (d *Doc) insertText(cx, cy int, s []byte) {
+	if cy > d.nrows {
+		return
+	}
+	if cy == d.nrows {
+		d.insertRow(cy, nil)
+	}
+	row := *d.row(cy)
+	if cx > len(row) {
+		return
+	}
+	nl := bytes.IndexByte(s, '\n')
+	if nl < 0 {
+		*d.row(cy) = insertBytes(row, cx, s)
+		return
+	}
+
+	// the rest of the row moves behind the last inserted line
+	lines := bytes.Count(s, []byte{'\n'})
+	d.openRows(cy + 1, lines)
+	*d.row(cy + lines) = append([]byte(nil), row[cx:]...)
+	*d.row(cy) = append(row[:cx], s[:nl]...)
+	at := cy + 1
+	for s = s[nl+1:]; ; s = s[nl+1:] {
+		if nl = bytes.IndexByte(s, '\n'); nl < 0 {
+			break
+		}
+		*d.row(at) = append([]byte(nil), s[:nl]...)
+		at++
+	}
+	*d.row(at) = insertBytes(*d.row(at), 0, s)
+}
+
+// deleteSpan deletes the rows' text from (cx, cy) up to (ex, ey).
+func (d *Doc) deleteSpan(cx, cy, ex, ey int) {
+	if cy < 0 || ey >= d.nrows || cx < 0 || cx > d.rowSize(cy) || ex > d.rowSize(ey) {
+		return
+	}
+	row := *d.row(cy)
+	if ey == cy {
+		if ex > cx {
+			*d.row(cy) = append(row[:cx], row[ex:]...)
+		}
+		return
+	}
+	*d.row(cy) = append(row[:cx], (*d.row(ey))[ex:]...)
+	d.delRows(cy + 1, ey - cy)
+}
+
+// advanceRows moves (x, y) over the next k chars of the rows.
+func (d *Doc) advanceRows(x, y, k int) (int, int) {
+	for k > 0 {
+		rest := d.rowSize(y) - x
+		if rest < 0 {
+			rest = 0
+		}
+		if k <= rest {
+			return x + k, y
+		}
+		k -= rest + 1
+		x, y = 0, y + 1
+	}
+	return x, y
+}
+
+// rowsBetween counts the chars in the rows from (x, y) up to (ex, ey).
+func (d *Doc) rowsBetween(x, y, ex, ey int) int {
+	if y == ey {
+		return ex - x
+	}
+	k := d.rowSize(y) - x + 1
+	for i := y + 1; i < ey; i++ {
+		k += d.rowSize(i) + 1
+	}
+	return k + ex
+}
+
+func (r *seqRun) advance(x, y int) (int, int) {
+	switch {
+	case r.dead:
+		return x, y
+	case r.nl > 0:
+		return r.tail, y + r.nl
+	}
+	return x + r.len, y
+}
+
+// join appends b to r, which holds the ids just before it.
+func (r *seqRun) join(b seqRun) {
+	if b.nl > 0 {
+		r.tail = b.tail
+	} else {
+		r.tail += b.len
+	}
+	r.nl += b.nl
+	r.len += b.len
+}
+
+// advance moves (x, y) over the live runs of b.
+func (b *runBlock) advance(x, y int) (int, int) {
+	if b.stale {
+		b.live = seqRun{}
+		for i := range b.runs {
+			if !b.runs[i].dead {
+				b.live.join(b.runs[i])
+			}
+		}
+		b.stale = false
+	}
+	return b.live.advance(x, y)
+}
+
+// indexRun moves the ref of run r from block from to block to; nil adds
+// or drops it.
+func (d *Doc) indexRun(r *seqRun, from, to *runBlock) {
+	if d.index == nil {
+		d.index = make(map[seqKey][]seqRef)
+	}
+	key := seqKey{r.id.site, r.id.clock / seqSpan}
+	refs := d.index[key]
+	j := refAfter(refs, r.id.clock)
+	if from == nil {
+		d.index[key] = slices.Insert(refs, j, seqRef{r.id.clock, to})
+		return
+	}
+
+	j--
+	for j >= 0 && refs[j].clock == r.id.clock && refs[j].b != from {
+		j--
+	}
+	switch {
+	case j < 0 || refs[j].clock != r.id.clock:
+	case to != nil:
+		refs[j].b = to
+	case len(refs) == 1:
+		delete(d.index, key)
+	default:
+		d.index[key] = slices.Delete(refs, j, j + 1)
+	}
+}
+
+// refAfter returns the index of the first of refs starting past clock.
+func refAfter(refs []seqRef, clock int) int {
+	return sort.Search(len(refs), func(j int) bool { return refs[j].clock > clock })
+}
+
+// refRun returns the block index and index of the run ref stands for and
+// where it starts; i is -1 if it is not there.
+func (d *Doc) refRun(ref seqRef, site int) (bi, i, x, y int) {
+	for i := range ref.b.runs {
+		if r := &ref.b.runs[i]; r.id.site == site && r.id.clock == ref.clock {
+			bi, x, y := d.locate(ref.b, i)
+			return bi, i, x, y
+		}
+	}
+	return 0, -1, 0, 0
+}
+
+func (d *Doc) addBlock(at int) *runBlock {
+	b := &runBlock{}
+	d.blocks = slices.Insert(d.blocks, at, b)
+	return b
+}
+
+func (d *Doc) insertRun(bi, at int, r seqRun) {
+	b := d.blocks[bi]
+	b.runs = slices.Insert(b.runs, at, r)
+	b.stale = true
+	d.nruns++
+	d.indexRun(&r, nil, b)
+}
+
+func (d *Doc) removeRun(bi, at int) {
+	b := d.blocks[bi]
+	d.indexRun(&b.runs[at], b, nil)
+	b.runs = slices.Delete(b.runs, at, at + 1)
+	b.stale = true
+	d.nruns--
+}
+
+// moveRuns moves the runs of from from at on to the end of to.
+func (d *Doc) moveRuns(from *runBlock, at int, to *runBlock) {
+	for i := at; i < len(from.runs); i++ {
+		d.indexRun(&from.runs[i], from, to)
+	}
+	to.runs = append(to.runs, from.runs[at:]...)
+	from.runs = from.runs[:at]
+	from.stale, to.stale = true, true
+}
+
+// tidy splits the blocks from to to that grew past 2 * seqBlockRuns runs
+// and joins them with neighbours they fit in one with, once an edit is
+// through with them.
+func (d *Doc) tidy(from, to int) {
+	for bi := max(from - 1, 0); bi <= to + 1 && bi < len(d.blocks); bi++ {
+		b := d.blocks[bi]
+		switch {
+		case len(b.runs) > 2 * seqBlockRuns:
+			d.moveRuns(b, seqBlockRuns, d.addBlock(bi + 1))
+			to++
+		case len(b.runs) == 0 && len(d.blocks) > 1:
+			d.blocks = slices.Delete(d.blocks, bi, bi + 1)
+			bi--
+			to--
+		case bi + 1 < len(d.blocks) && len(b.runs) + len(d.blocks[bi+1].runs) <= seqBlockRuns:
+			d.moveRuns(d.blocks[bi+1], 0, b)
+			d.blocks = slices.Delete(d.blocks, bi + 1, bi + 2)
+			bi--
+			to--
+		}
+	}
 }
 
-func (s *Session) Add(c *net.Conn) {
-	s.participants[c] = struct{}{}
+// clearRuns drops all runs, leaving one empty block.
+func (d *Doc) clearRuns() {
+	d.blocks = append(d.blocks[:0], &runBlock{})
+	d.nruns, d.index = 0, nil
 }
 
-func (s *Session) Delete(c *net.Conn) {
-	delete(s.participants, c)
-	if s.Empty() {
-		delete(sessions, s.id)
-		log.Printf("Deleting session %s\n", s.id)
-	} else if s.host == c {
-		for newhost := range s.participants {
-			s.host = newhost
-			log.Printf("New host of %s is %s", s.id, (*newhost).RemoteAddr().String())
+// appendRun appends the run of n chars with ids from id on, cut at
+// spans. A live one covers the rows from (x, y) on; it returns where it
+// ends.
+func (d *Doc) appendRun(id seqID, n int, dead bool, x, y int) (int, int) {
+	for n > 0 {
+		r := seqRun{id: id, len: min(seqSpan - id.clock % seqSpan, n), dead: dead}
+		if !dead {
+			y0 := y
+			x, y = d.advanceRows(x, y, r.len)
+			r.nl, r.tail = y - y0, r.len
+			if r.nl > 0 {
+				r.tail = x
+			}
+		}
+		last := len(d.blocks) - 1
+		if len(d.blocks[last].runs) >= seqBlockRuns {
+			d.addBlock(last + 1)
+			last++
+		}
+		d.insertRun(last, len(d.blocks[last].runs), r)
+		d.clock = max(d.clock, id.clock + r.len - 1)
+		id.clock += r.len
+		n -= r.len
+	}
+	return x, y
+}
+
+// merge merges run at of block bi with the one after it if their ids run
+// on.
+func (d *Doc) merge(bi, at int) bool {
+	b := d.blocks[bi]
+	if at < 0 || at + 1 >= len(b.runs) || !seqRunsOn(&b.runs[at], &b.runs[at+1]) {
+		return false
+	}
+	b.runs[at].join(b.runs[at+1])
+	d.removeRun(bi, at + 1)
+	return true
+}
+
+// split splits run i of block bi after k chars. It starts on row y0 and,
+// if live, the split falls at (x, y).
+func (d *Doc) split(bi, i, k, y0, x, y int) {
+	r := &d.blocks[bi].runs[i]
+	rest := *r
+	rest.id.clock += k
+	rest.len -= k
+	r.len = k
+	if !r.dead {
+		r.nl = y - y0
+		r.tail = k
+		if r.nl > 0 {
+			r.tail = x
+		}
+		rest.nl -= r.nl
+		if rest.nl == 0 {
+			rest.tail = rest.len
+		}
+	}
+	d.insertRun(bi, i + 1, rest)
+}
+
+// kill makes chars lo to hi of run i of block bi a dead run of their own
+// and returns its index. The run starts on row y0 and, if live, lo and hi
+// fall at (lx, ly) and (hx, hy).
+func (d *Doc) kill(bi, i, lo, hi, y0, lx, ly, hx, hy int) int {
+	b := d.blocks[bi]
+	if hi < b.runs[i].len {
+		d.split(bi, i, hi, y0, hx, hy)
+	}
+	if lo > 0 {
+		d.split(bi, i, lo, y0, lx, ly)
+		i++
+	}
+	r := &b.runs[i]
+	r.dead, r.nl, r.tail = true, 0, 0
+	b.stale = true
+	return i
+}
+
+// locate returns the index of block b and the position of run i of it.
+func (d *Doc) locate(b *runBlock, i int) (int, int, int) {
+	bi, x, y := 0, 0, 0
+	for ; d.blocks[bi] != b; bi++ {
+		x, y = d.blocks[bi].advance(x, y)
+	}
+	for j := 0; j < i; j++ {
+		x, y = b.runs[j].advance(x, y)
+	}
+	return bi, x, y
+}
+
+// find returns the run holding id as its block and index, where it
+// starts and how far into it id is; i is -1 if id is unknown.
+func (d *Doc) find(id seqID) (bi, i, x, y, k int) {
+	refs := d.index[seqKey{id.site, id.clock / seqSpan}]
+	if j := refAfter(refs, id.clock) - 1; j >= 0 {
+		if bi, i, x, y = d.refRun(refs[j], id.site); i >= 0 {
+			if k = id.clock - refs[j].clock; k < d.blocks[bi].runs[i].len {
+				return bi, i, x, y, k
+			}
+		}
+	}
+	return 0, -1, 0, 0, 0
+}
+
+// findPos returns the live run holding the char just before (x, y),
+// where it starts and how many of its chars come before (x, y); nil at
+// the start of the text.
+func (d *Doc) findPos(x, y int) (*seqRun, int, int, int) {
+	var last *seqRun
+	cx, cy, lb, lx, ly := 0, 0, -1, 0, 0
+	for bi := 0; bi < len(d.blocks) && seqBefore(cx, cy, x, y); bi++ {
+		b := d.blocks[bi]
+		ex, ey := b.advance(cx, cy)
+		if seqBefore(ex, ey, x, y) {
+			// its last live run is looked up if nothing after it is live
+			if ex != cx || ey != cy {
+				lb, lx, ly = bi, cx, cy
+			}
+			cx, cy = ex, ey
+			continue
+		}
+
+		for i := range b.runs {
+			r := &b.runs[i]
+			if r.dead {
+				continue
+			}
+			if !seqBefore(cx, cy, x, y) {
+				break
+			}
+			ex, ey := r.advance(cx, cy)
+			if !seqBefore(ex, ey, x, y) {
+				k := r.len
+				if ex != x || ey != y {
+					k = d.rowsBetween(cx, cy, x, y)
+				}
+				return r, cx, cy, k
+			}
+			last, lx, ly = r, cx, cy
+			cx, cy = ex, ey
+		}
+		break
+	}
+
+	if last == nil && lb >= 0 {
+		b := d.blocks[lb]
+		cx, cy = lx, ly
+		for i := range b.runs {
+			if r := &b.runs[i]; !r.dead {
+				last, lx, ly = r, cx, cy
+				cx, cy = r.advance(cx, cy)
+			}
+		}
+	}
+	if last != nil {
+		return last, lx, ly, last.len
+	}
+	return nil, 0, 0, 0
+}
+
+func (d *Doc) originAt(x, y int) seqID {
+	r, _, _, k := d.findPos(x, y)
+	if r == nil {
+		return seqID{}
+	}
+	origin := r.id
+	origin.clock += k - 1
+	return origin
+}
+
+// integrate places the chars of s with ids from id on, inserted after
+// origin, and returns where they go in the rows; false if origin is
+// unknown. Exact puts them right after origin, where a mirrored edit
+// went in the rows, rather than past the inserts there with later ids.
+func (d *Doc) integrate(id, origin seqID, s []byte, exact bool) (int, int, bool) {
+	x, y, bi, at, scan := 0, 0, 0, 0, !exact
+	if len(d.blocks) == 0 {
+		d.clearRuns()
+	}
+	if origin != (seqID{}) {
+		fb, i, fx, fy, k := d.find(origin)
+		if i < 0 {
+			return 0, 0, false
+		}
+		r := &d.blocks[fb].runs[i]
+		bi, x, y = fb, fx, fy
+		if !r.dead {
+			x, y = d.advanceRows(x, y, k + 1)
+		}
+		at = i + 1
+		if k + 1 < r.len {
+			if exact || seqCmp(seqID{r.id.site, r.id.clock + k + 1}, id) < 0 {
+				d.split(bi, i, k + 1, fy, x, y)
+				scan = false
+			} else {
+				x, y = r.advance(fx, fy)
+			}
+		}
+	}
+	from := bi
+	for scan {
+		b := d.blocks[bi]
+		if at == len(b.runs) && bi + 1 < len(d.blocks) {
+			bi, at = bi + 1, 0
+			continue
+		}
+		if at == len(b.runs) || seqCmp(b.runs[at].id, id) <= 0 {
 			break
 		}
+		x, y = b.runs[at].advance(x, y)
+		at++
+	}
+
+	if at == 0 && bi > 0 {
+		bi--
+		at = len(d.blocks[bi].runs)
+	}
+	b := d.blocks[bi]
+	for off := 0; off < len(s); {
+		run := seqRun{id: seqID{id.site, id.clock + off}}
+		run.len = min(seqSpan - run.id.clock % seqSpan, len(s) - off)
+		run.tail, run.nl = textEnd(s[off:off+run.len], 0, 0)
+		if at > 0 && seqRunsOn(&b.runs[at-1], &run) {
+			b.runs[at-1].join(run)
+			b.stale = true
+		} else {
+			d.insertRun(bi, at, run)
+			at++
+		}
+		off += run.len
 	}
+	d.tidy(from, bi)
+
+	d.clock = max(d.clock, id.clock + len(s) - 1)
+	return x, y, true
 }
 
-func (s *Session) Empty() bool {
-	return len(s.participants) == 0
+// insertAt mirrors an insert of s at (x, y) into the sequence. Text on
+// the row past the end starts with the newline that makes it.
+func (d *Doc) insertAt(x, y int, s []byte) {
+	if y == d.nrows && y > 0 {
+		d.insertAt(d.rowSize(y - 1), y - 1, []byte{'\n'})
+		x = 0
+	}
+	if len(s) == 0 {
+		return
+	}
+	id := d.mirror
+	d.mirror.clock += len(s)
+	d.integrate(id, d.originAt(x, y), s, true)
 }
 
-func (s *Session) Init() {
-	s.participants = make(map[*net.Conn]struct{})
+// deleteAt tombstones the text from (x, y) up to (ex, ey), the rows
+// still holding it.
+func (d *Doc) deleteAt(x, y, ex, ey int) {
+	cx, cy, from, to := 0, 0, -1, -1
+	for bi := 0; bi < len(d.blocks) && seqBefore(cx, cy, ex, ey); bi++ {
+		b := d.blocks[bi]
+		if bx, by := b.advance(cx, cy); !seqBefore(x, y, bx, by) {
+			cx, cy = bx, by
+			continue
+		}
+
+		first, last := -1, -1
+		for i := 0; i < len(b.runs) && seqBefore(cx, cy, ex, ey); i++ {
+			r := &b.runs[i]
+			if r.dead {
+				continue
+			}
+			rx, ry := r.advance(cx, cy)
+			if !seqBefore(x, y, rx, ry) {
+				cx, cy = rx, ry
+				continue
+			}
+
+			lx, ly, hx, hy := cx, cy, rx, ry
+			if seqBefore(cx, cy, x, y) {
+				lx, ly = x, y
+			}
+			if seqBefore(ex, ey, rx, ry) {
+				hx, hy = ex, ey
+			}
+			lo := d.rowsBetween(cx, cy, lx, ly)
+			hi := lo + d.rowsBetween(lx, ly, hx, hy)
+			i = d.kill(bi, i, lo, hi, cy, lx, ly, hx, hy)
+			if first < 0 {
+				first = i
+			}
+			last = i
+			cx, cy = hx, hy
+		}
+		for i := last; first >= 0 && i >= first - 1; i-- {
+			d.merge(bi, i)
+		}
+		if from < 0 {
+			from = bi
+		}
+		to = bi
+	}
+	if from >= 0 {
+		d.tidy(from, to)
+	}
+}
+
+// nextRun returns the first run of site holding ids from at on up to
+// end, as refRun does; i is -1 if there is none up to the end of at's
+// span, and next is where to look on from then.
+func (d *Doc) nextRun(site, at, end int) (bi, i, x, y, next int) {
+	refs := d.index[seqKey{site, at / seqSpan}]
+	j := refAfter(refs, at) - 1
+	if j >= 0 {
+		if bi, i, x, y = d.refRun(refs[j], site); i >= 0 && refs[j].clock + d.blocks[bi].runs[i].len > at {
+			return bi, i, x, y, at
+		}
+	}
+	if j + 1 < len(refs) && refs[j+1].clock < end {
+		bi, i, x, y = d.refRun(refs[j+1], site)
+		return bi, i, x, y, refs[j+1].clock
+	}
+	return 0, -1, 0, 0, (at / seqSpan + 1) * seqSpan
+}
+
+// deleteIDs tombstones n chars with ids from id on and deletes the live
+// ones from the rows; false if none of the ids are known.
+func (d *Doc) deleteIDs(id seqID, n int) bool {
+	found := false
+	for at, end := id.clock, id.clock + n; at < end; {
+		bi, i, x, y, next := d.nextRun(id.site, at, end)
+		if i < 0 {
+			at = next
+			continue
+		}
+		found = true
+		r := &d.blocks[bi].runs[i]
+		lo := max(at - r.id.clock, 0)
+		hi := min(end - r.id.clock, r.len)
+		at = r.id.clock + hi
+		if r.dead {
+			continue
+		}
+
+		lx, ly := d.advanceRows(x, y, lo)
+		hx, hy := d.advanceRows(lx, ly, hi - lo)
+		i = d.kill(bi, i, lo, hi, y, lx, ly, hx, hy)
+		d.deleteSpan(lx, ly, hx, hy)
+		d.merge(bi, i)
+		d.merge(bi, i - 1)
+		d.tidy(bi, bi)
+	}
+	return found
+}
+
+// Reset makes the rows the text of site 0.
+func (d *Doc) Reset() {
+	n := 0
+	for _, b := range d.rows {
+		for _, row := range b.rows {
+			n += len(row) + 1
+		}
+	}
+	d.clearRuns()
+	d.clock = max(n - 1, 0)
+	d.appendRun(seqID{0, 1}, n - 1, false, 0, 0)
+}
+
+// Load takes over an uploaded text, resetting the runs if it came without
+// any or they don't add up to the rows.
+func (d *Doc) Load(rows [][]byte, runs []byte) {
+	d.setRows(rows)
+	if runs == nil || !d.loadRuns(runs) {
+		d.Reset()
+	}
+}
+
+func (d *Doc) loadRuns(p []byte) bool {
+	count, k := binary.Uvarint(p)
+	if k <= 0 {
+		return false
+	}
+	p = p[k:]
+
+	x, y := 0, 0
+	d.clearRuns()
+	d.clock = 0
+	for i := uint64(0); i < count; i++ {
+		var v [4]uint64
+		for j := range v {
+			v[j], k = binary.Uvarint(p)
+			if k <= 0 || v[j] > maxID {
+				return false
+			}
+			p = p[k:]
+		}
+		if v[2] == 0 {
+			return false
+		}
+		x, y = d.appendRun(seqID{int(v[0]), int(v[1])}, int(v[2]), v[3] != 0, x, y)
+	}
+
+	last := max(d.nrows - 1, 0)
+	return y == last && x == d.rowSize(last)
+}
+
+// AppendRuns encodes the runs for a snapshot: their count, then the id,
+// length and liveness of each.
+func (d *Doc) AppendRuns(dst []byte) []byte {
+	dst = binary.AppendUvarint(dst, uint64(d.nruns))
+	for _, b := range d.blocks {
+		for _, r := range b.runs {
+			dead := uint64(0)
+			if r.dead {
+				dead = 1
+			}
+			dst = binary.AppendUvarint(dst, uint64(r.id.site))
+			dst = binary.AppendUvarint(dst, uint64(r.id.clock))
+			dst = binary.AppendUvarint(dst, uint64(r.len))
+			dst = binary.AppendUvarint(dst, dead)
+		}
+	}
+	return dst
+}
+
+// AppendBody encodes the text for a chunked snapshot: the row count,
+// each row after its length, then the runs.
+func (d *Doc) AppendBody(dst []byte) []byte {
+	dst = binary.AppendUvarint(dst, uint64(d.nrows))
+	for _, b := range d.rows {
+		for _, row := range b.rows {
+			dst = binary.AppendUvarint(dst, uint64(len(row)))
+			dst = append(dst, row...)
+		}
+	}
+	return d.AppendRuns(dst)
+}
+
+// AppendSnapshot encodes the text the way a host used to send it, for
+// clients that don't take chunks: the row count, the rows, then the runs.
+func (d *Doc) AppendSnapshot(dst []byte, c *Client) []byte {
+	dst = c.Append(dst, Frame{op: opSnapshot, a: d.nrows, b: 1})
+	for _, b := range d.rows {
+		for _, row := range b.rows {
+			dst = c.Append(dst, Frame{op: opRow, payload: row})
+		}
+	}
+	return c.Append(dst, Frame{op: opSeqRuns, payload: d.AppendRuns(nil)})
+}
+
+func (d *Doc) posValid(cx, cy int) bool {
+	if cy == d.nrows {
+		return cx == 0
+	}
+	return cy >= 0 && cy < d.nrows && cx >= 0 && cx <= d.rowSize(cy)
+}
+
+// Apply applies an edit the way a client applies it when received, as
+// revision rev. Positional edits are mirrored into the sequence, sequence
+// edits found by their ids or else by the position their sender saw.
+func (d *Doc) Apply(f Frame, rev int) {
+	d.mirror = seqID{mirrorSite + rev % mirrorSite, 1}
+	switch f.op {
+	case opChar, opInsert:
+		d.insert(f.a, f.b, f.payload)
+	case opNewline:
+		if d.posValid(f.a, f.b) && f.b == d.nrows {
+			d.insertAt(f.a, f.b, nil)
+			d.insertRow(f.b, nil)
+		} else {
+			d.insert(f.a, f.b, []byte{'\n'})
+		}
+	case opDelete:
+		d.delChar(f.a, f.b)
+	case opDelRange:
+		d.deleteText(f.a, f.b, f.payload)
+	case opSeqInsert:
+		v, s, ok := f.SeqIDs()
+		if !ok || len(s) == 0 {
+			return
+		}
+		id := seqID{v[0], v[1]}
+		if _, i, _, _, _ := d.find(id); i >= 0 {
+			return
+		}
+		x, y, ok := d.integrate(id, seqID{v[2], v[3]}, s, false)
+		if !ok {
+			if !d.posValid(f.a, f.b) || f.b == d.nrows && f.b > 0 {
+				return
+			}
+			x, y, _ = d.integrate(id, d.originAt(f.a, f.b), s, false)
+		}
+		d.insertText(x, y, s)
+	case opSeqDelete:
+		v, s, ok := f.SeqIDs()
+		if ok && len(s) > 0 && !d.deleteIDs(seqID{v[0], v[1]}, len(s)) {
+			d.deleteText(f.a, f.b, s)
+		}
+	}
+}
+
+// Applied tells whether f is a sequence op with nothing left to do: an
+// insert whose ids are known or a delete of chars all gone already.
+// Clients send ops again after a reconnect when they can't tell whether
+// those got through.
+func (d *Doc) Applied(f Frame) bool {
+	if f.op != opSeqInsert && f.op != opSeqDelete {
+		return false
+	}
+	v, s, ok := f.SeqIDs()
+	if !ok || len(s) == 0 {
+		return false
+	}
+	id := seqID{v[0], v[1]}
+	if f.op == opSeqInsert {
+		_, i, _, _, _ := d.find(id)
+		return i >= 0
+	}
+	found := 0
+	for at, end := id.clock, id.clock + len(s); at < end; {
+		bi, i, _, _, next := d.nextRun(id.site, at, end)
+		if i < 0 {
+			at = next
+			continue
+		}
+		r := &d.blocks[bi].runs[i]
+		if !r.dead {
+			return false
+		}
+		found += min(r.id.clock + r.len, end) - max(r.id.clock, at)
+		at = r.id.clock + r.len
+	}
+	return found == len(s)
+}
+
+func (d *Doc) insert(cx, cy int, s []byte) {
+	if !d.posValid(cx, cy) {
+		return
+	}
+	d.insertAt(cx, cy, s)
+	d.insertText(cx, cy, s)
+}
+
+func (d *Doc) deleteRange(cx, cy, ex, ey int) {
+	d.deleteAt(cx, cy, ex, ey)
+	d.deleteSpan(cx, cy, ex, ey)
+}
+
+func (d *Doc) delChar(cx, cy int) {
+	if cy < 0 || cy >= d.nrows || cx < 0 || cx > d.rowSize(cy) || cx == 0 && cy == 0 {
+		return
+	}
+	if cx > 0 {
+		d.deleteRange(cx - 1, cy, cx, cy)
+	} else {
+		d.deleteRange(d.rowSize(cy-1), cy - 1, cx, cy)
+	}
+}
+
+func (d *Doc) deleteText(cx, cy int, s []byte) {
+	if cy < 0 || cy >= d.nrows || cx < 0 || cx > d.rowSize(cy) || len(s) == 0 {
+		return
+	}
+	ex, ey := textEnd(s, cx, cy)
+	if ey >= d.nrows || ex > d.rowSize(ey) {
+		return
+	}
+	d.deleteRange(cx, cy, ex, ey)
+}
+
+// AppendText encodes f the way the line protocol sends it to clients,
+// one param per line. Inserts are spelled out as a run of chars and
+// newlines, deleted ranges as a run of deletes at their start; sequence
+// ops the same at the position their sender saw. The sequence runs of a
+// snapshot mean nothing to these clients and encode to nothing, as do
+// cursors.
+func (f Frame) AppendText(dst []byte) []byte {
+	switch f.op {
+	case opSeqInsert, opSeqDelete:
+		op := opInsert
+		if f.op == opSeqDelete {
+			op = opDelRange
+		}
+		text, ok := f.SeqText()
+		if !ok || len(text) == 0 {
+			return dst
+		}
+		return Frame{op: op, a: f.a, b: f.b, payload: text}.AppendText(dst)
+	case opSeqRuns, opAck, opChunks, opChunk, opResume, opSync, opCursor:
+		return dst
+	case opReply, opRow:
+		dst = append(dst, f.payload...)
+	case opRequest:
+		dst = append(dst, "request"...)
+	case opSnapshot:
+		dst = strconv.AppendInt(dst, int64(f.a), 10)
+	case opChar:
+		dst = append(dst, "char\n"...)
+		dst = append(dst, f.payload...)
+		dst = append(dst, '\n')
+		dst = strconv.AppendInt(dst, int64(f.a), 10)
+		dst = append(dst, '\n')
+		dst = strconv.AppendInt(dst, int64(f.b), 10)
+	case opInsert:
+		x, y := f.a, f.b
+		for i, c := range f.payload {
+			if i > 0 {
+				dst = append(dst, '\n')
+			}
+			if c == '\n' {
+				dst = append(dst, "newline\n"...)
+			} else {
+				dst = append(dst, "char\n"...)
+				dst = append(dst, c, '\n')
+			}
+			dst = strconv.AppendInt(dst, int64(x), 10)
+			dst = append(dst, '\n')
+			dst = strconv.AppendInt(dst, int64(y), 10)
+			if c == '\n' {
+				x, y = 0, y + 1
+			} else {
+				x++
+			}
+		}
+	case opDelRange:
+		// each delete removes the char right after the start of the range
+		for i, c := range f.payload {
+			if i > 0 {
+				dst = append(dst, '\n')
+			}
+			dst = append(dst, "delete\n"...)
+			if c == '\n' {
+				dst = append(dst, "0\n"...)
+				dst = strconv.AppendInt(dst, int64(f.b + 1), 10)
+			} else {
+				dst = strconv.AppendInt(dst, int64(f.a + 1), 10)
+				dst = append(dst, '\n')
+				dst = strconv.AppendInt(dst, int64(f.b), 10)
+			}
+		}
+	case opNewline, opDelete:
+		if f.op == opNewline {
+			dst = append(dst, "newline\n"...)
+		} else {
+			dst = append(dst, "delete\n"...)
+		}
+		dst = strconv.AppendInt(dst, int64(f.a), 10)
+		dst = append(dst, '\n')
+		dst = strconv.AppendInt(dst, int64(f.b), 10)
+	}
+	return append(dst, '\n')
+}
+
+// Registry holds the live sessions by id. They are spread over
+// registryShards shards by a hash of the id, so sessions coming and going
+// lock only their own shard and lookups share it.
+type Registry struct {
+	shards [registryShards]registryShard
+	// created, joined and deleted count the sessions over the run
+	created, joined, deleted atomic.Int64
+}
+
+type registryShard struct {
+	mu sync.RWMutex
+	sessions map[string]*Session
+}
+
+const registryShards = 64
+
+func (r *Registry) Init() {
+	for i := range r.shards {
+		r.shards[i].sessions = make(map[string]*Session)
+	}
+}
+
+// shard picks the shard of id by its FNV-1a hash.
+func (r *Registry) shard(id string) *registryShard {
+	h := uint32(2166136261)
+	for i := 0; i < len(id); i++ {
+		h = (h ^ uint32(id[i])) * 16777619
+	}
+	return &r.shards[h % registryShards]
+}
+
+func (r *Registry) Add(s *Session) {
+	sh := r.shard(s.id)
+	sh.mu.Lock()
+	sh.sessions[s.id] = s
+	sh.mu.Unlock()
+	r.created.Add(1)
+}
+
+// Get looks up the session a client joins; joined is counted once the
+// join is through.
+func (r *Registry) Get(id string) (*Session, bool) {
+	sh := r.shard(id)
+	sh.mu.RLock()
+	s, ok := sh.sessions[id]
+	sh.mu.RUnlock()
+	return s, ok
+}
+
+func (r *Registry) Remove(id string) {
+	sh := r.shard(id)
+	sh.mu.Lock()
+	delete(sh.sessions, id)
+	sh.mu.Unlock()
+	r.deleted.Add(1)
+}
+
+func (r *Registry) Stats() string {
+	created, deleted := r.created.Load(), r.deleted.Load()
+	return fmt.Sprintf("%d live, %d created, %d joins, %d deleted", created - deleted, created, r.joined.Load(), deleted)
+}
+
+// Logger writes the server log from a goroutine of its own, so logging
+// never makes a caller wait on stderr. Entries pass through a ring of
+// logRing slots and are formatted on the way out, so their arguments must
+// not change after the call; those finding the ring full are counted and
+// reported as dropped. Trace entries, one or more per op, are off unless
+// switched on with SIGUSR1; callers check Tracing first, which leaves a
+// branch on the hot path. While the ring is over half full only one in
+// traceSample of them is kept.
+type Logger struct {
+	ring chan logEntry
+	tracing atomic.Bool
+	traced atomic.Uint64
+	dropped atomic.Int64
+}
+
+type logEntry struct {
+	t time.Time
+	level string
+	format string
+	args []any
+}
+
+const (
+	logRing = 4096
+	traceSample = 16
+	logTime = "2006/01/02 15:04:05"
+)
+
+var logger Logger
+
+func (l *Logger) Init() {
+	l.ring = make(chan logEntry, logRing)
+	go l.writeLoop(os.Stderr)
+
+	sig := make(chan os.Signal, 1)
+	signal.Notify(sig, syscall.SIGUSR1)
+	go func() {
+		for range sig {
+			on := !l.tracing.Load()
+			l.tracing.Store(on)
+			l.Info("Tracing %v", on)
+		}
+	}()
+}
+
+func (l *Logger) Tracing() bool {
+	return l.tracing.Load()
+}
+
+func (l *Logger) Trace(format string, args ...any) {
+	if len(l.ring) > logRing / 2 && l.traced.Add(1) % traceSample != 0 {
+		return
+	}
+	l.put("TRACE", format, args)
+}
+
+func (l *Logger) Info(format string, args ...any) {
+	l.put("INFO", format, args)
+}
+
+func (l *Logger) Error(format string, args ...any) {
+	l.put("ERROR", format, args)
+}
+
+func (l *Logger) put(level, format string, args []any) {
+	select {
+	case l.ring <- logEntry{time.Now(), level, format, args}:
+	default:
+		l.dropped.Add(1)
+	}
+}
+
+// writeLoop formats entries into a buffer that is flushed whenever the
+// ring runs dry.
+func (l *Logger) writeLoop(out io.Writer) {
+	w := bufio.NewWriter(out)
+	for e := range l.ring {
+		if n := l.dropped.Swap(0); n > 0 {
+			fmt.Fprintf(w, "%s ERROR %d log entries dropped\n", e.t.Format(logTime), n)
+		}
+		fmt.Fprintf(w, "%s %s ", e.t.Format(logTime), e.level)
+		fmt.Fprintf(w, e.format, e.args...)
+		w.WriteByte('\n')
+		if len(l.ring) == 0 {
+			w.Flush()
+		}
+	}
 }
 
 const (
@@ -50,14 +2323,13 @@ const (
 )
 
 var (
-	sessions map[string]*Session
-	copyRows chan []byte = make(chan []byte, 1)
-	rowsLen chan int = make(chan int)
+	sessions Registry
 )
 
 func main() {
-	sessions = make(map[string]*Session)
-	
+	sessions.Init()
+	logger.Init()
+
 	fmt.Println("Starting " + connType + " server on " + connHost + ":" + connPort)
 	l, err := net.Listen(connType, connHost+":"+connPort)
 
@@ -74,139 +2346,115 @@ func main() {
 			return
 		}
 
-		fmt.Println("Client " + c.RemoteAddr().String() + " connected.")
+		logger.Info("Client %s connected", c.RemoteAddr())
 		go handleConn(c)
 	}
 }
 
 func handleConn(c net.Conn) {
 	var currentSess *Session = nil
-	reader := bufio.NewReader(c)
+	client := newClient(c)
 	connected := false
+	// resume is where a joiner dropped during its snapshot got to
+	var resume Frame
 	for true {
-		buffer, err := reader.ReadBytes('\n')
-		log.Print("msg: " + string(buffer))
-		
+		msg, err := client.ReadMsg()
+
 		if err != nil {
-			currentSess.Delete(&c)
-			log.Printf("Client %s left: ", c.RemoteAddr().String())
-			fmt.Println(err)
-			c.Close()
+			if currentSess != nil {
+				currentSess.Delete(client)
+			}
+			logger.Info("Client %s left: %v", c.RemoteAddr(), err)
+			client.Close()
 			return
 		}
-		
-		log.Println(buffer)
-		log.Printf("Len of buffer is %d\n", len(buffer))
-		if len(buffer) == 0 {
-			c.Write([]byte("Unknown command\n"))
-			continue;
-		}
-		
-		params := SplitString(string(buffer[:len(buffer)-1]), ' ')
-		log.Println(params)
-		log.Printf("Len of params is %d\n", len(params))
-		if len(params) == 2 && params[0] == "create" {
+
+		if msg.op == opCreate {
+			if currentSess != nil {
+				currentSess.Delete(client)
+			}
 			currentSess = &Session{}
 			currentSess.Init()
-			
+
 			guid := xid.New()
 			currentSess.id = guid.String()
-			currentSess.pass = params[1];
-			sessions[currentSess.id] = currentSess
-			currentSess.Add(&c)
-			currentSess.host = &c
-			c.Write([]byte(guid.String() + "\n"))
+			currentSess.pass = string(msg.payload)
+			currentSess.Add(client)
+			currentSess.host = client
+			sessions.Add(currentSess)
+			currentSess.sites = 1
+			client.site = 1
+			client.Send(Frame{op: opReply, a: 1, payload: []byte(guid.String())})
+			client.Send(Frame{op: opRequest})
 			connected = true
-			log.Println(guid.String())
-		} else if len(params) == 3 && params[0] == "join" {
-				currSess, ok := sessions[params[1]]
-				currentSess = currSess
-				if !ok {
-					c.Write([]byte("invalid id\n"))
-					continue
-				}
-				if params[2] != currentSess.pass {
-					c.Write([]byte("invalid pass\n"))
-					continue
-				}
-
-				currentSess.Add(&c)
-				c.Write([]byte("success\n"))
+			logger.Info("Created session %s", currentSess.id)
+		} else if msg.op == opJoin && msg.a <= len(msg.payload) {
+			// A failed join leaves the client where it was.
+			sess, ok := sessions.Get(string(msg.payload[:msg.a]))
+			if !ok {
+				client.Send(Frame{op: opReply, payload: []byte("invalid id")})
+				continue
+			}
+			if string(msg.payload[msg.a:]) != sess.pass {
+				client.Send(Frame{op: opReply, payload: []byte("invalid pass")})
+				continue
+			}
+			site := sess.NextSite()
+			if site == 0 {
+				client.Send(Frame{op: opReply, payload: []byte("invalid id")})
+				continue
+			}
+			if !sess.AwaitUpload(client) {
+				client.Send(Frame{op: opReply, payload: []byte("no text")})
+				continue
+			}
 
-				host := *currentSess.host
-				host.Write([]byte("request\n"))
-				bsrowsnum := <- copyRows
-				rowsnum, err := strconv.Atoi(string(bsrowsnum[:len(bsrowsnum)-1]))
-				if err != nil {
-					log.Println("err ->")
-					log.Println(err)
-				}
-				rowsLen <- rowsnum
+			if currentSess != nil {
+				currentSess.Delete(client)
+			}
+			// Join adds the client even if it fails sending to it.
+			currentSess, connected = sess, false
+			client.site = site
+			client.Send(Frame{op: opReply, a: site, payload: []byte("success")})
 
-				c.Write(bsrowsnum)
-				for i := 0; i < rowsnum; i++ {
-					row := <- copyRows
-					c.Write(row)
-				}
-				connected = true
-		} else if len(params) == 1 && strings.Compare(params[0], "response") == 0 && connected && currentSess.host == &c {
-			log.Println("Received response")
-			bsrowsnum, err := reader.ReadBytes('\n')
+			err := sess.Join(client, msg.b, resume)
+			resume = Frame{}
 			if err != nil {
-				log.Printf("Client %s left: ", c.RemoteAddr().String())
-				fmt.Println(err)
-				c.Close()
-				return
+				continue
 			}
-			log.Println(bsrowsnum)		
-			copyRows <- bsrowsnum
-			rowsnum := <- rowsLen
-			log.Println(rowsnum)
-			for i := 0; i < rowsnum; i++ {
-				row, err := reader.ReadBytes('\n')
+			sessions.joined.Add(1)
+			connected = true
+		} else if msg.op == opResume {
+			resume = msg
+		} else if msg.op == opSnapshot && connected && currentSess.IsHost(client) {
+			logger.Info("Received upload of %d rows for %s", msg.a, currentSess.id)
+			var rows [][]byte
+			var runs []byte
+			for i := 0; i < msg.a + msg.b; i++ {
+				f, err := client.ReadRow()
 				if err != nil {
-					log.Println("Error receive rows")
-					break;
+					logger.Error("Error receive rows from %s: %v", c.RemoteAddr(), err)
+					break
+				}
+				if f.op == opSeqRuns {
+					runs = f.payload
+				} else if i < msg.a {
+					rows = append(rows, f.payload)
 				}
-				log.Printf("row %d: %s", i, string(row))
-				copyRows <- row
 			}
+			currentSess.Upload(rows, runs)
+		} else if connected && msg.op == opCursor {
+			currentSess.Cursor(client, msg)
 		} else if connected {
-		 	if len(params) == 4 && params[0] == "char" || 
-		 	 len(params) == 3 && (params[0] == "newline" || params[0] == "delete") {
-		 	 	log.Println("Valid cmd")
-		 	 	for part := range currentSess.participants {
-		 	 		if part == &c {continue}
-		 	 		for _, param := range params {
-		 	 			(*part).Write([]byte(param))
-		 	 			(*part).Write([]byte("\n"))
-		 	 		}
-		 	 		log.Printf("Writing to %s", (*part).RemoteAddr().String())
+		 	if msg.op == opChar && len(msg.payload) == 1 ||
+			 	 (msg.op == opInsert || msg.op == opDelRange) && len(msg.payload) > 0 ||
+			 	 (msg.op == opSeqInsert || msg.op == opSeqDelete) && len(msg.payload) > 0 ||
+		 	 msg.op == opNewline || msg.op == opDelete {
+		 	 	if logger.Tracing() {
+		 	 		logger.Trace("Valid cmd %d from %s", msg.op, c.RemoteAddr())
 		 	 	}
+		 	 	currentSess.Relay(client, msg)
 		 	 }
 		}
 	}
 }
-
-func SplitString(str string, sep rune) []string {
-	strs := make([]string, 0)
-	var curr strings.Builder
-	
-	for _, c := range []rune(str) {
-		if c == sep {
-			if curr.Len() != 0 {
-				strs = append(strs, curr.String())
-				curr.Reset()
-				continue
-			}
-		}
-		curr.Grow(curr.Cap() + 1)
-		curr.WriteRune(c)
-	}
-	
-	if curr.Len() != 0 {
-		strs = append(strs, curr.String())
-	}
-	return strs
-}
-
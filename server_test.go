@@ -0,0 +1,1446 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"fmt"
+	"hash/crc32"
+	"math/rand"
+	"io"
+	"net"
+	"os"
+	"slices"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+	"unsafe"
+)
+
+func TestMain(m *testing.M) {
+	sessions.Init()
+	logger.ring = make(chan logEntry, logRing)
+	go logger.writeLoop(io.Discard)
+	os.Exit(m.Run())
+}
+
+// peer is the far end of a connection served by handleConn, speaking
+// the binary protocol over a net.Pipe.
+type peer struct {
+	conn net.Conn
+	r *bufio.Reader
+}
+
+func dial() (*peer, error) {
+	a, b := net.Pipe()
+	go handleConn(b)
+	p := &peer{conn: a, r: bufio.NewReader(a)}
+	p.conn.Write([]byte(helloBin + "\n"))
+	if line, err := p.r.ReadString('\n'); err != nil || line != "bin\n" {
+		a.Close()
+		return nil, fmt.Errorf("handshake: %q, %v", line, err)
+	}
+	return p, nil
+}
+
+func mustDial(tb testing.TB) *peer {
+	p, err := dial()
+	if err != nil {
+		tb.Fatal(err)
+	}
+	return p
+}
+
+func (p *peer) send(f Frame) error {
+	_, err := p.conn.Write(f.AppendBinary(nil))
+	return err
+}
+
+// expect reads frames up to the next one with op.
+func (p *peer) expect(op byte) (Frame, error) {
+	for {
+		f, err := ReadFrame(p.r)
+		if err != nil || f.op == op {
+			return f, err
+		}
+	}
+}
+
+// create opens a session on rows and returns its id.
+func create(pass string, rows [][]byte) (*peer, string, error) {
+	p, err := dial()
+	if err != nil {
+		return nil, "", err
+	}
+	p.send(Frame{op: opCreate, payload: []byte(pass)})
+	reply, err := p.expect(opReply)
+	if err == nil {
+		_, err = p.expect(opRequest)
+	}
+	if err != nil {
+		p.conn.Close()
+		return nil, "", fmt.Errorf("create: %v", err)
+	}
+	p.send(Frame{op: opSnapshot, a: len(rows)})
+	for _, row := range rows {
+		p.send(Frame{op: opRow, payload: row})
+	}
+	return p, string(reply.payload), nil
+}
+
+// mustCreate opens a session on a text of one row.
+func mustCreate(tb testing.TB, pass string) (*peer, string) {
+	p, id, err := create(pass, [][]byte{[]byte("hello")})
+	if err != nil {
+		tb.Fatal(err)
+	}
+	return p, id
+}
+
+// join joins session id with flags and reads up to the ack ending it,
+// returning the revision it joined at.
+func (p *peer) join(id, pass string, flags int) (int, error) {
+	p.send(Frame{op: opJoin, a: len(id), b: flags, payload: []byte(id + pass)})
+	reply, err := p.expect(opReply)
+	if err != nil {
+		return 0, err
+	}
+	if string(reply.payload) != "success" {
+		return 0, fmt.Errorf("join: %s", reply.payload)
+	}
+	for {
+		f, err := p.expect(opAck)
+		if err != nil || f.b == 1 {
+			return f.a, err
+		}
+	}
+}
+
+// drain reads until the connection ends, counting the frames with op.
+func (p *peer) drain(op byte, n *atomic.Int64) {
+	for {
+		f, err := ReadFrame(p.r)
+		if err != nil {
+			return
+		}
+		if f.op == op {
+			n.Add(1)
+		}
+	}
+}
+
+// waitFor waits up to 10s for n to reach want.
+func waitFor(tb testing.TB, what string, n *atomic.Int64, want int64) {
+	deadline := time.Now().Add(10 * time.Second)
+	for n.Load() < want {
+		if time.Now().After(deadline) {
+			tb.Fatalf("%s: %d of %d", what, n.Load(), want)
+		}
+		time.Sleep(time.Millisecond)
+	}
+}
+
+// TestManyParticipants has 1000 participants join one session at once
+// while one of them edits, and checks everyone gets every edit.
+func TestManyParticipants(t *testing.T) {
+	const participants, edits = 1000, 100
+	host, id := mustCreate(t, "pw")
+	defer host.conn.Close()
+	var acks atomic.Int64
+	go host.drain(opAck, &acks)
+
+	peers := make([]*peer, participants - 1)
+	revs := make([]int, len(peers))
+	got := make([]atomic.Int64, len(peers))
+	errs := make(chan error, len(peers))
+	var wg sync.WaitGroup
+	for i := range peers {
+		peers[i] = mustDial(t)
+		defer peers[i].conn.Close()
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			rev, err := peers[i].join(id, "pw", 0)
+			if err != nil {
+				errs <- err
+				return
+			}
+			revs[i] = rev
+			go peers[i].drain(opInsert, &got[i])
+		}(i)
+	}
+
+	start := time.Now()
+	for i := 0; i < edits; i++ {
+		host.send(Frame{op: opInsert, payload: []byte("x")})
+	}
+	wg.Wait()
+	close(errs)
+	for err := range errs {
+		t.Fatal(err)
+	}
+	waitFor(t, "acks", &acks, edits)
+	// the edits made before a join came in its snapshot
+	for i := range got {
+		waitFor(t, fmt.Sprintf("participant %d", i), &got[i], int64(edits - revs[i]))
+	}
+	t.Logf("%d participants, %d edits in %v", participants, edits, time.Since(start))
+}
+
+// TestAckOrder has two participants edit at once and checks that each
+// gets the acks of its edits in revision order with the edits of the
+// other: an ack names the revision right after the edits before it.
+func TestAckOrder(t *testing.T) {
+	const edits = 200
+	host, id := mustCreate(t, "pw")
+	defer host.conn.Close()
+	p := mustDial(t)
+	defer p.conn.Close()
+	start, err := p.join(id, "pw", 0)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	var wg sync.WaitGroup
+	revs := make([]int, 2)
+	for i, q := range []*peer{host, p} {
+		wg.Add(1)
+		go func(i int, q *peer) {
+			defer wg.Done()
+			for k := 0; k < edits; k++ {
+				q.send(Frame{op: opInsert, payload: []byte{byte('a' + i)}})
+			}
+			rev, acks, got := start, 0, 0
+			for acks < edits || got < edits {
+				f, err := ReadFrame(q.r)
+				if err != nil {
+					t.Error(err)
+					return
+				}
+				switch f.op {
+				case opInsert:
+					rev++
+					got++
+				case opAck:
+					if f.a != rev + 1 {
+						t.Errorf("participant %d: ack of %d after revision %d", i, f.a, rev)
+						return
+					}
+					rev = f.a
+					acks++
+				}
+			}
+			revs[i] = rev
+		}(i, q)
+	}
+	wg.Wait()
+	if revs[0] != start + 2 * edits || revs[1] != revs[0] {
+		t.Fatalf("revisions %v, want %d", revs, start + 2 * edits)
+	}
+}
+
+// TestSlowConsumer checks that a participant that stops reading is cut
+// off once outHighWater bytes wait for it, holding up nobody else.
+func TestSlowConsumer(t *testing.T) {
+	host, id := mustCreate(t, "pw")
+	defer host.conn.Close()
+	var acks atomic.Int64
+	go host.drain(opAck, &acks)
+	fast, slow := mustDial(t), mustDial(t)
+	defer fast.conn.Close()
+	defer slow.conn.Close()
+	for _, p := range []*peer{fast, slow} {
+		if _, err := p.join(id, "pw", 0); err != nil {
+			t.Fatal(err)
+		}
+	}
+	var got atomic.Int64
+	go fast.drain(opInsert, &got)
+
+	text := bytes.Repeat([]byte("x"), 64 << 10)
+	edits := int64(outHighWater / len(text) + 8)
+	for i := int64(0); i < edits; i++ {
+		if err := host.send(Frame{op: opInsert, payload: text}); err != nil {
+			t.Fatal(err)
+		}
+	}
+	waitFor(t, "acks", &acks, edits)
+	waitFor(t, "edits of the fast participant", &got, edits)
+
+	slow.conn.SetReadDeadline(time.Now().Add(10 * time.Second))
+	n, err := io.Copy(io.Discard, slow.r)
+	if err != nil {
+		t.Fatalf("slow participant not cut off: %v", err)
+	}
+	if n >= edits * int64(len(text)) {
+		t.Fatalf("slow participant got all %d bytes", n)
+	}
+}
+
+// TestRecreate checks that a participant creating a session of its own
+// leaves the one it was in, which goes on without it once it is gone.
+func TestRecreate(t *testing.T) {
+	p, id := mustCreate(t, "pw")
+	q := mustDial(t)
+	defer q.conn.Close()
+	if _, err := q.join(id, "pw", 0); err != nil {
+		t.Fatal(err)
+	}
+	var acks atomic.Int64
+	go q.drain(opAck, &acks)
+
+	p.send(Frame{op: opCreate, payload: []byte("pw")})
+	reply, err := p.expect(opReply)
+	if err != nil {
+		t.Fatal(err)
+	}
+	p.conn.Close()
+	// gone once the session it created is
+	for {
+		if _, ok := sessions.Get(string(reply.payload)); !ok {
+			break
+		}
+		time.Sleep(time.Millisecond)
+	}
+	for i := int64(1); i <= 10; i++ {
+		q.send(Frame{op: opInsert, payload: []byte("x")})
+		waitFor(t, "acks", &acks, i)
+	}
+}
+
+// TestFailedJoin checks that a join that fails leaves a participant in
+// the session it was in.
+func TestFailedJoin(t *testing.T) {
+	host, id := mustCreate(t, "pw")
+	defer host.conn.Close()
+	var got atomic.Int64
+	go host.drain(opInsert, &got)
+	p := mustDial(t)
+	defer p.conn.Close()
+	if _, err := p.join(id, "pw", 0); err != nil {
+		t.Fatal(err)
+	}
+
+	for _, bad := range [][2]string{{"nosuchid", "pw"}, {id, "wrong"}} {
+		if _, err := p.join(bad[0], bad[1], 0); err == nil {
+			t.Fatalf("joined %q with %q", bad[0], bad[1])
+		}
+		p.send(Frame{op: opInsert, payload: []byte("x")})
+		if _, err := p.expect(opAck); err != nil {
+			t.Fatal(err)
+		}
+	}
+	waitFor(t, "edits relayed to the host", &got, 2)
+}
+
+// TestCursorFlood has a participant send its cursor every few ms and
+// checks that the others get it at most about once per presenceInterval,
+// the last place it was sent from included.
+func TestCursorFlood(t *testing.T) {
+	host, id := mustCreate(t, "pw")
+	defer host.conn.Close()
+	go host.drain(0, new(atomic.Int64))
+	p, q := mustDial(t), mustDial(t)
+	defer p.conn.Close()
+	defer q.conn.Close()
+	for _, c := range []*peer{p, q} {
+		if _, err := c.join(id, "pw", 0); err != nil {
+			t.Fatal(err)
+		}
+	}
+	go p.drain(0, new(atomic.Int64))
+	var got atomic.Int64
+	var last atomic.Value
+	go func() {
+		for {
+			f, err := q.expect(opCursor)
+			if err != nil {
+				return
+			}
+			got.Add(1)
+			last.Store(f)
+		}
+	}()
+
+	const moves = 200
+	start := time.Now()
+	for i := 1; i <= moves; i++ {
+		p.send(seqFrame(opCursor, i, 0, []int{0, i}, nil))
+		time.Sleep(2 * time.Millisecond)
+	}
+	elapsed := time.Since(start)
+	time.Sleep(3 * presenceInterval)
+
+	if max := int64(elapsed / presenceInterval) + 2; got.Load() > max || got.Load() < 2 {
+		t.Fatalf("%d cursors passed on in %v, want 2 to %d", got.Load(), elapsed, max)
+	}
+	f := last.Load().(Frame)
+	site, k := binary.Uvarint(f.payload)
+	want := seqFrame(opCursor, moves, 0, []int{0, moves}, nil).payload
+	if f.a != moves || site == 0 || string(f.payload[k:]) != string(want) {
+		t.Fatalf("last cursor at %d, payload %v", f.a, f.payload)
+	}
+}
+
+// TestRejoinSince has a participant drop and come back with joinSince,
+// first while the history still holds the edits it missed, which it gets
+// after an opSync, then once it no longer does, when it gets a snapshot.
+// Each time it sends its last op again, which the server must ack
+// without relaying it twice.
+func TestRejoinSince(t *testing.T) {
+	host, id := mustCreate(t, "pw")
+	defer host.conn.Close()
+	var hostAcks atomic.Int64
+	go host.drain(opAck, &hostAcks)
+	edit := func(n int64) {
+		want := hostAcks.Load() + n
+		for i := int64(0); i < n; i++ {
+			host.send(Frame{op: opInsert, payload: []byte("h")})
+		}
+		waitFor(t, "acks of the host", &hostAcks, want)
+	}
+	q := mustDial(t)
+	defer q.conn.Close()
+	if _, err := q.join(id, "pw", 0); err != nil {
+		t.Fatal(err)
+	}
+	var relayed, inserts atomic.Int64
+	go func() {
+		for {
+			f, err := ReadFrame(q.r)
+			if err != nil {
+				return
+			}
+			if f.op == opSeqInsert {
+				relayed.Add(1)
+			} else if f.op == opInsert {
+				inserts.Add(1)
+			}
+		}
+	}()
+
+	p := mustDial(t)
+	start, err := p.join(id, "pw", 0)
+	if err != nil {
+		t.Fatal(err)
+	}
+	op := seqFrame(opSeqInsert, 0, 0, []int{7, 100, 0, 0, start}, []byte("p"))
+	p.send(op)
+	ack, err := p.expect(opAck)
+	if err != nil {
+		t.Fatal(err)
+	}
+	waitFor(t, "the op relayed", &relayed, 1)
+
+	// rejoin comes back from revision rev with joinSince and reads up to
+	// the ack ending the join, returning the first frame after the reply
+	// and the edits.
+	rejoin := func(rev int) (*peer, Frame, int) {
+		p.conn.Close()
+		p = mustDial(t)
+		p.send(Frame{op: opResume, a: rev})
+		p.send(Frame{op: opJoin, a: len(id), b: joinChunks | joinPacked | joinSince, payload: []byte(id + "pw")})
+		if _, err := p.expect(opReply); err != nil {
+			t.Fatal(err)
+		}
+		var first Frame
+		edits := 0
+		for {
+			f, err := ReadFrame(p.r)
+			if err != nil {
+				t.Fatal(err)
+			}
+			if first.op == 0 {
+				first = f
+			}
+			if f.op == opInsert {
+				edits++
+			}
+			if f.op == opAck && f.b == 1 {
+				return p, first, edits
+			}
+		}
+	}
+	resend := func() {
+		p.send(op)
+		if _, err := p.expect(opAck); err != nil {
+			t.Fatal(err)
+		}
+		// the host's next edit reaches q behind anything the resend caused
+		want := inserts.Load() + 1
+		edit(1)
+		waitFor(t, "the host's edit", &inserts, want)
+		if n := relayed.Load(); n != 1 {
+			t.Fatalf("op relayed %d times", n)
+		}
+	}
+
+	edit(3)
+	p, first, edits := rejoin(ack.a)
+	if first.op != opSync || first.a != ack.a || edits != 3 {
+		t.Fatalf("rejoined with op %d at %d and %d edits", first.op, first.a, edits)
+	}
+	resend()
+
+	edit(historyLen + 1)
+	p, first, edits = rejoin(ack.a)
+	defer p.conn.Close()
+	if first.op != opChunks || edits != 0 {
+		t.Fatalf("rejoined with op %d and %d edits past the history", first.op, edits)
+	}
+	resend()
+}
+
+// TestParseLine checks the frames text commands parse to, chars that are
+// spaces, malformed and overflowing numbers and stray spaces included;
+// what doesn't parse comes back with op 0.
+func TestParseLine(t *testing.T) {
+	tests := []struct {
+		line string
+		op byte
+		a, b int
+		payload string
+	}{
+		{"char x 12 345", opChar, 12, 345, "x"},
+		{"char   0 0", opChar, 0, 0, " "},
+		{"char \t 1 2", opChar, 1, 2, "\t"},
+		{"char x 1073741824 0", opChar, 1 << 30, 0, "x"},
+		{"newline 13 345", opNewline, 13, 345, ""},
+		{"delete 0 7", opDelete, 0, 7, ""},
+		{"create pw", opCreate, 0, 0, "pw"},
+		{"join abc pw", opJoin, 3, 0, "abcpw"},
+		{"char", 0, 0, 0, ""},
+		{"char x", 0, 0, 0, ""},
+		{"char x 1", 0, 0, 0, ""},
+		{"char xy 1 2", 0, 0, 0, ""},
+		{"char x 1 2 3", 0, 0, 0, ""},
+		{"char x -1 2", 0, 0, 0, ""},
+		{"char x 1a 2", 0, 0, 0, ""},
+		{"char x 1073741825 0", 0, 0, 0, ""},
+		{"char x 0 99999999999999999999", 0, 0, 0, ""},
+		{"newline 13", 0, 0, 0, ""},
+		{"newline  13 345", 0, 0, 0, ""},
+		{"newline 13  345", 0, 0, 0, ""},
+		{"newline 13 345 ", 0, 0, 0, ""},
+		{"delete 13 345 1", 0, 0, 0, ""},
+		{"delete", 0, 0, 0, ""},
+		{"create", 0, 0, 0, ""},
+		{"create pw x", 0, 0, 0, ""},
+		{"join abc", 0, 0, 0, ""},
+		{"bogus 1 2", 0, 0, 0, ""},
+		{"", 0, 0, 0, ""},
+	}
+	c := &Client{}
+	for _, tt := range tests {
+		f, err := c.parseLine([]byte(tt.line))
+		if err != nil || f.op != tt.op || f.a != tt.a || f.b != tt.b || string(f.payload) != tt.payload {
+			t.Errorf("%q: op %d, a %d, b %d, payload %q, %v; want op %d, a %d, b %d, payload %q",
+				tt.line, f.op, f.a, f.b, f.payload, err, tt.op, tt.a, tt.b, tt.payload)
+		}
+	}
+}
+
+// TestShift moves positions over inserts and deletes of one char, a
+// newline, several lines and a range, made on the same row, before it
+// and after it. An insert at the very position goes first.
+func TestShift(t *testing.T) {
+	tests := []struct {
+		name string
+		f Frame
+		x, y, wx, wy int
+	}{
+		{"insert after", Frame{op: opInsert, a: 2, b: 1, payload: []byte("ab")}, 5, 1, 7, 1},
+		{"insert before", Frame{op: opInsert, a: 2, b: 1, payload: []byte("ab")}, 1, 1, 1, 1},
+		{"insert tie", Frame{op: opInsert, a: 2, b: 1, payload: []byte("ab")}, 2, 1, 4, 1},
+		{"insert row before", Frame{op: opInsert, a: 2, b: 1, payload: []byte("ab")}, 9, 0, 9, 0},
+		{"insert row after", Frame{op: opInsert, a: 2, b: 1, payload: []byte("ab")}, 3, 2, 3, 2},
+		{"char tie", Frame{op: opChar, a: 0, b: 0, payload: []byte("a")}, 0, 0, 1, 0},
+		{"newline after", Frame{op: opNewline, a: 2, b: 1}, 5, 1, 3, 2},
+		{"newline tie", Frame{op: opNewline, a: 2, b: 1}, 2, 1, 0, 2},
+		{"newline before", Frame{op: opNewline, a: 2, b: 1}, 1, 1, 1, 1},
+		{"newline row before", Frame{op: opNewline, a: 2, b: 1}, 9, 0, 9, 0},
+		{"newline row after", Frame{op: opNewline, a: 2, b: 1}, 3, 2, 3, 3},
+		{"lines after", Frame{op: opInsert, a: 2, b: 1, payload: []byte("x\nyz")}, 5, 1, 5, 2},
+		{"lines tie", Frame{op: opInsert, a: 2, b: 1, payload: []byte("x\nyz")}, 2, 1, 2, 2},
+		{"lines row after", Frame{op: opInsert, a: 2, b: 1, payload: []byte("x\nyz\n")}, 3, 4, 3, 6},
+		{"range before", Frame{op: opDelRange, a: 2, b: 1, payload: []byte("cd")}, 1, 1, 1, 1},
+		{"range at start", Frame{op: opDelRange, a: 2, b: 1, payload: []byte("cd")}, 2, 1, 2, 1},
+		{"range inside", Frame{op: opDelRange, a: 2, b: 1, payload: []byte("cd")}, 3, 1, 2, 1},
+		{"range at end", Frame{op: opDelRange, a: 2, b: 1, payload: []byte("cd")}, 4, 1, 2, 1},
+		{"range after", Frame{op: opDelRange, a: 2, b: 1, payload: []byte("cd")}, 6, 1, 4, 1},
+		{"range row before", Frame{op: opDelRange, a: 2, b: 1, payload: []byte("cd")}, 9, 0, 9, 0},
+		{"range row after", Frame{op: opDelRange, a: 2, b: 1, payload: []byte("cd")}, 3, 2, 3, 2},
+		{"lines range inside", Frame{op: opDelRange, a: 2, b: 1, payload: []byte("cd\nef")}, 1, 2, 2, 1},
+		{"lines range at end", Frame{op: opDelRange, a: 2, b: 1, payload: []byte("cd\nef")}, 2, 2, 2, 1},
+		{"lines range after", Frame{op: opDelRange, a: 2, b: 1, payload: []byte("cd\nef")}, 6, 2, 6, 1},
+		{"lines range row after", Frame{op: opDelRange, a: 2, b: 1, payload: []byte("cd\nef")}, 3, 3, 3, 2},
+		{"delete after", Frame{op: opDelete, a: 3, b: 1}, 5, 1, 4, 1},
+		{"delete at", Frame{op: opDelete, a: 3, b: 1}, 3, 1, 2, 1},
+		{"seq insert tie", seqFrame(opSeqInsert, 2, 1, []int{2, 5, 0, 1, 0}, []byte("ab")), 2, 1, 4, 1},
+		{"seq delete after", seqFrame(opSeqDelete, 2, 1, []int{2, 5, 0}, []byte("ab")), 6, 1, 4, 1},
+	}
+	for _, tt := range tests {
+		e, ok := tt.f.Edit()
+		if !ok {
+			t.Errorf("%s: no edit", tt.name)
+			continue
+		}
+		if x, y := e.Shift(tt.x, tt.y); x != tt.wx || y != tt.wy {
+			t.Errorf("%s: (%d, %d) shifted to (%d, %d), want (%d, %d)", tt.name, tt.x, tt.y, x, y, tt.wx, tt.wy)
+		}
+	}
+	// a delete at the start of a row is of a row the server can't tell
+	if _, ok := (Frame{op: opDelete, a: 0, b: 1}).Edit(); ok {
+		t.Error("delete joining rows shifts")
+	}
+}
+
+// TestRelayShift checks that Relay moves an edit past those its sender
+// had not seen, by the revision a sequence op names, and no further.
+func TestRelayShift(t *testing.T) {
+	host, id := mustCreate(t, "pw")
+	defer host.conn.Close()
+	p := mustDial(t)
+	defer p.conn.Close()
+	start, err := p.join(id, "pw", 0)
+	if err != nil {
+		t.Fatal(err)
+	}
+	go p.drain(0, new(atomic.Int64))
+
+	host.send(Frame{op: opInsert, a: 0, b: 0, payload: []byte("x\ny")})
+	ack, err := host.expect(opAck)
+	if err != nil {
+		t.Fatal(err)
+	}
+	for i, c := range []struct{ base, x, y, wx, wy int }{
+		{start, 3, 0, 4, 1},
+		{ack.a, 3, 0, 3, 0},
+		{start, 0, 1, 0, 2},
+	} {
+		p.send(seqFrame(opSeqInsert, c.x, c.y, []int{2, 100 + i, 0, 1, c.base}, []byte("z")))
+		f, err := host.expect(opSeqInsert)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if f.a != c.wx || f.b != c.wy {
+			t.Errorf("(%d, %d) seen at %d relayed at (%d, %d), want (%d, %d)", c.x, c.y, c.base, f.a, f.b, c.wx, c.wy)
+		}
+	}
+}
+
+// TestStalledUpload checks that joiners of a session whose creator never
+// uploads its text give up after uploadTimeout, staying where they were,
+// and that the session goes with its creator.
+func TestStalledUpload(t *testing.T) {
+	defer func(d time.Duration) { uploadTimeout = d }(uploadTimeout)
+	uploadTimeout = 50 * time.Millisecond
+	host := mustDial(t)
+	host.send(Frame{op: opCreate, payload: []byte("pw")})
+	reply, err := host.expect(opReply)
+	if err != nil {
+		t.Fatal(err)
+	}
+	go host.drain(0, new(atomic.Int64))
+	id := string(reply.payload)
+	other, otherID := mustCreate(t, "pw")
+	defer other.conn.Close()
+	var got atomic.Int64
+	go other.drain(opInsert, &got)
+
+	p := mustDial(t)
+	defer p.conn.Close()
+	if _, err := p.join(otherID, "pw", 0); err != nil {
+		t.Fatal(err)
+	}
+	for i := int64(1); i <= 3; i++ {
+		if _, err := p.join(id, "pw", joinChunks); err == nil {
+			t.Fatal("joined a session with no text")
+		}
+		p.send(Frame{op: opInsert, payload: []byte("x")})
+		if _, err := p.expect(opAck); err != nil {
+			t.Fatal(err)
+		}
+		waitFor(t, "edits relayed in the session joined before", &got, i)
+	}
+
+	sess, _ := sessions.Get(id)
+	sess.mu.Lock()
+	joining := sess.joining
+	sess.mu.Unlock()
+	if joining != 0 {
+		t.Fatalf("%d joiners left", joining)
+	}
+	host.conn.Close()
+	for {
+		if _, ok := sessions.Get(id); !ok {
+			break
+		}
+		time.Sleep(time.Millisecond)
+	}
+}
+
+// lzUnpack unpacks src the way netUnpack in coled.c does, into at most
+// max bytes; -1 if it is malformed.
+func lzUnpack(src []byte, max int) ([]byte, int) {
+	var dst []byte
+	length := func(i, n int) (int, int) {
+		for c := 255; n >= 15 && c == 255; n += c {
+			if i == len(src) {
+				return i, -1
+			}
+			c = int(src[i])
+			i++
+		}
+		return i, n
+	}
+	for i, n := 0, 0; i < len(src); {
+		token := int(src[i])
+		i, n = length(i + 1, token >> 4)
+		if n < 0 || n > len(src) - i || n > max - len(dst) {
+			return nil, -1
+		}
+		dst = append(dst, src[i:i+n]...)
+		if i += n; i == len(src) {
+			break
+		}
+		if len(src) - i < 2 {
+			return nil, -1
+		}
+		off := int(src[i]) | int(src[i+1]) << 8
+		i, n = length(i + 2, token & 15)
+		if n += 4; n < 4 || off == 0 || off > len(dst) || n > max - len(dst) {
+			return nil, -1
+		}
+		for k := 0; k < n; k++ {
+			dst = append(dst, dst[len(dst) - off])
+		}
+	}
+	return dst, len(dst)
+}
+
+// TestLZPack packs random, repetitive and incompressible inputs and
+// unpacks them the way coled does, then checks that a chunk cut short or
+// with a byte changed never passes its length and CRC check with bytes
+// that are wrong.
+func TestLZPack(t *testing.T) {
+	r := rand.New(rand.NewSource(1))
+	noise := make([]byte, 64 << 10)
+	r.Read(noise)
+	words := make([]byte, 0, 256 << 10)
+	for len(words) < cap(words) - 16 {
+		words = append(words, []string{"the ", "quick ", "brown ", "fox\n", "jumps "}[r.Intn(5)]...)
+		if r.Intn(8) == 0 {
+			words = append(words, byte('0' + r.Intn(10)))
+		}
+	}
+	inputs := map[string][]byte{
+		"empty": nil,
+		"short": []byte("abc"),
+		"zeros": make([]byte, 100000),
+		"period 3": bytes.Repeat([]byte("abc"), 5000),
+		"long literals": append(append(append([]byte(nil), noise[:1000]...), make([]byte, 1000)...), noise[1000:1300]...),
+		"words": words,
+		"noise": noise,
+		"far match": append(append([]byte(nil), noise...), noise[:100]...),
+	}
+	for name, src := range inputs {
+		packed := lzPack(src)
+		if packed == nil {
+			if name != "noise" && name != "empty" && name != "short" && name != "far match" {
+				t.Errorf("%s: %d bytes not packed", name, len(src))
+			}
+			continue
+		}
+		if len(packed) >= len(src) {
+			t.Errorf("%s: packed to %d of %d", name, len(packed), len(src))
+		}
+		if got, n := lzUnpack(packed, len(src)); n != len(src) || !bytes.Equal(got, src) {
+			t.Fatalf("%s: unpacked %d of %d bytes wrong", name, n, len(src))
+		}
+		sum := crc32.ChecksumIEEE(src)
+		accepted := func(p []byte) bool {
+			got, n := lzUnpack(p, len(src))
+			if n != len(src) || crc32.ChecksumIEEE(got) != sum {
+				return false
+			}
+			if !bytes.Equal(got, src) {
+				t.Fatalf("%s: wrong bytes pass", name)
+			}
+			return true
+		}
+		for i := 0; i < 200; i++ {
+			cut := r.Intn(len(packed))
+			accepted(packed[:cut])
+			bad := append([]byte(nil), packed...)
+			bad[r.Intn(len(bad))] ^= byte(1 + r.Intn(255))
+			accepted(bad)
+		}
+	}
+}
+
+// TestResumeJoin drops a chunked join part of the way through and
+// resumes it on a new connection, which must get the rest of the chunks
+// of the same snapshot, each good; a resume naming a snapshot that is
+// not the last one starts over.
+func TestResumeJoin(t *testing.T) {
+	rows := make([][]byte, 20000)
+	for i := range rows {
+		rows[i] = []byte(fmt.Sprintf("%5d the quick brown fox jumps over the lazy dog", i))
+	}
+	host, id, err := create("pw", rows)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer host.conn.Close()
+	go host.drain(opAck, new(atomic.Int64))
+
+	// chunks reads the head and then the chunks of a join up to n of
+	// them, checking and unpacking each.
+	chunks := func(p *peer, n int) (Frame, []byte) {
+		head, err := p.expect(opChunks)
+		if err != nil {
+			t.Fatal(err)
+		}
+		start, _ := binary.Uvarint(head.payload)
+		var body []byte
+		for i := int(start); i < head.a && i < n; i++ {
+			f, err := ReadFrame(p.r)
+			if err != nil || f.op != opChunk || f.a != i || len(f.payload) < 4 {
+				t.Fatalf("chunk %d: %v, %v", i, f.op, err)
+			}
+			data, sum := f.payload[4:], binary.LittleEndian.Uint32(f.payload)
+			if f.b > 0 {
+				if data, _ = lzUnpack(data, f.b); len(data) != f.b {
+					t.Fatalf("chunk %d does not unpack", i)
+				}
+			}
+			if crc32.ChecksumIEEE(data) != sum {
+				t.Fatalf("chunk %d: bad CRC", i)
+			}
+			body = append(body, data...)
+		}
+		return head, body
+	}
+	joiner := func() *peer {
+		p := mustDial(t)
+		p.send(Frame{op: opJoin, a: len(id), b: joinChunks | joinPacked, payload: []byte(id + "pw")})
+		if _, err := p.expect(opReply); err != nil {
+			t.Fatal(err)
+		}
+		return p
+	}
+
+	p := joiner()
+	head, body := chunks(p, 2)
+	p.conn.Close()
+	if head.a < 4 {
+		t.Fatalf("only %d chunks", head.a)
+	}
+
+	p = mustDial(t)
+	defer p.conn.Close()
+	p.send(Frame{op: opResume, a: head.b, b: 2})
+	p.send(Frame{op: opJoin, a: len(id), b: joinChunks | joinPacked, payload: []byte(id + "pw")})
+	if _, err := p.expect(opReply); err != nil {
+		t.Fatal(err)
+	}
+	again, rest := chunks(p, head.a)
+	if start, _ := binary.Uvarint(again.payload); start != 2 || again.b != head.b {
+		t.Fatalf("resumed at chunk %d of revision %d", start, again.b)
+	}
+	if _, err := p.expect(opAck); err != nil {
+		t.Fatal(err)
+	}
+	sess, _ := sessions.Get(id)
+	sess.mu.Lock()
+	want := sess.doc.AppendBody(nil)
+	sess.mu.Unlock()
+	if !bytes.Equal(append(body, rest...), want) {
+		t.Fatal("resumed snapshot differs")
+	}
+
+	q := mustDial(t)
+	defer q.conn.Close()
+	q.send(Frame{op: opResume, a: head.b + 1, b: 2})
+	q.send(Frame{op: opJoin, a: len(id), b: joinChunks, payload: []byte(id + "pw")})
+	if _, err := q.expect(opReply); err != nil {
+		t.Fatal(err)
+	}
+	if head, _ := chunks(q, 0); head.payload[0] != 0 {
+		t.Fatalf("stale resume starts at %d", head.payload[0])
+	}
+}
+
+// TestMixedSession has a text client edit beside a binary one that names
+// the chars it mirrored by the ids it gave them, at positions that are
+// off, and checks the server's copy and a joiner's snapshot agree.
+func TestMixedSession(t *testing.T) {
+	host, id := mustCreate(t, "pw")
+	defer host.conn.Close()
+	go host.drain(opAck, new(atomic.Int64))
+	bin := mustDial(t)
+	defer bin.conn.Close()
+	rev, err := bin.join(id, "pw", 0)
+	if err != nil {
+		t.Fatal(err)
+	}
+	a, b := net.Pipe()
+	go handleConn(b)
+	defer a.Close()
+	go io.Copy(io.Discard, a)
+	text := func(line string) {
+		a.Write([]byte(line + "\n"))
+		if _, err := bin.expect(opChar); err != nil {
+			t.Fatal(err)
+		}
+		rev++
+	}
+	seq := func(f Frame) {
+		bin.send(f)
+		ack, err := bin.expect(opAck)
+		if err != nil {
+			t.Fatal(err)
+		}
+		rev = ack.a
+	}
+	a.Write([]byte("join " + id + " pw\n"))
+
+	text("char a 0 0")
+	mirrored := seqID{mirrorSite + rev, 1}
+	seq(seqFrame(opSeqInsert, 5, 0, []int{2, 100, mirrored.site, mirrored.clock, rev}, []byte("x")))
+	text("char b 0 0")
+	seq(seqFrame(opSeqDelete, 6, 0, []int{mirrored.site, mirrored.clock, rev}, []byte("a")))
+	text("char c 3 0")
+
+	sess, _ := sessions.Get(id)
+	sess.mu.Lock()
+	got := docText(&sess.doc)
+	sess.mu.Unlock()
+	if got != "bxhcello" {
+		t.Fatalf("server has %q", got)
+	}
+
+	p := mustDial(t)
+	defer p.conn.Close()
+	p.send(Frame{op: opJoin, a: len(id), payload: []byte(id + "pw")})
+	var rows [][]byte
+	var runs []byte
+	for {
+		f, err := ReadFrame(p.r)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if f.op == opRow {
+			rows = append(rows, f.payload)
+		} else if f.op == opSeqRuns {
+			runs = f.payload
+		} else if f.op == opAck {
+			break
+		}
+	}
+	var d Doc
+	d.Load(rows, runs)
+	if got := docText(&d); got != "bxhcello" {
+		t.Fatalf("joiner has %q", got)
+	}
+	for _, c := range []struct {
+		id seqID
+		dead bool
+	}{{mirrored, true}, {seqID{mirrorSite + rev - 2, 1}, false}, {seqID{mirrorSite + rev, 1}, false}, {seqID{2, 100}, false}} {
+		if bi, i, _, _, _ := d.find(c.id); i < 0 || d.blocks[bi].runs[i].dead != c.dead {
+			t.Errorf("id %v: found %v", c.id, i >= 0)
+		}
+	}
+}
+
+// modelChar is a char of the sequence as TestDoc models it, one by one.
+type modelChar struct {
+	id seqID
+	c byte
+	dead bool
+}
+
+// docModel is the sequence of TestDoc the plain way: every char in
+// order, tombstones too.
+type docModel struct {
+	chars []modelChar
+	clock int
+}
+
+func (m *docModel) text() string {
+	var b []byte
+	for _, c := range m.chars {
+		if !c.dead {
+			b = append(b, c.c)
+		}
+	}
+	return string(b)
+}
+
+// index is where the char with id is in chars, -1 if nowhere.
+func (m *docModel) index(id seqID) int {
+	for i, c := range m.chars {
+		if c.id == id {
+			return i
+		}
+	}
+	return -1
+}
+
+// offset is where (x, y) is in the text, -1 if past the end of its row.
+func (m *docModel) offset(x, y int) int {
+	t := m.text()
+	p := 0
+	for ; y > 0; y-- {
+		i := strings.IndexByte(t[p:], '\n')
+		if i < 0 {
+			return -1
+		}
+		p += i + 1
+	}
+	if end := strings.IndexByte(t[p:] + "\n", '\n'); x > end {
+		return -1
+	}
+	return p + x
+}
+
+// before is the index in chars of the live char before offset p, -1 if
+// p is 0.
+func (m *docModel) before(p int) int {
+	last := -1
+	for i, c := range m.chars {
+		if !c.dead {
+			if p == 0 {
+				break
+			}
+			last = i
+			p--
+		}
+	}
+	return last
+}
+
+// put places s under ids from id at i.
+func (m *docModel) put(i int, id seqID, s []byte) {
+	for k, c := range s {
+		m.chars = slices.Insert(m.chars, i + k, modelChar{id: seqID{id.site, id.clock + k}, c: c})
+	}
+	m.clock = max(m.clock, id.clock + len(s) - 1)
+}
+
+// mirror puts s right after the live char before p, as a positional
+// edit of revision rev is mirrored.
+func (m *docModel) mirror(p int, s []byte, rev int) {
+	m.put(m.before(p) + 1, seqID{mirrorSite + rev, 1}, s)
+}
+
+// integrate puts s after the char at i past the chars with later ids.
+func (m *docModel) integrate(i int, id seqID, s []byte) {
+	for i++; i < len(m.chars) && seqCmp(m.chars[i].id, id) > 0; i++ {
+	}
+	m.put(i, id, s)
+}
+
+// kill tombstones the live chars from offset p to e.
+func (m *docModel) kill(p, e int) {
+	for i := m.before(p) + 1; p < e; i++ {
+		if !m.chars[i].dead {
+			m.chars[i].dead = true
+			p++
+		}
+	}
+}
+
+// TestDoc applies random edits of every kind to a Doc with tiny blocks
+// and spans, so they split, merge and move all the time, and checks it
+// against docModel after each: the text, the ids in order, which of the
+// sequence ops it takes for applied already and its clock. Now and then
+// the Doc is reloaded from what a snapshot holds of it.
+func TestDoc(t *testing.T) {
+	defer func(r, b, s int) {
+		rowBlockRows, seqBlockRuns, seqSpan = r, b, s
+	}(rowBlockRows, seqBlockRuns, seqSpan)
+	rowBlockRows, seqBlockRuns, seqSpan = 2, 2, 4
+
+	for seed := int64(1); seed <= 20; seed++ {
+		r := rand.New(rand.NewSource(seed))
+		var d Doc
+		d.Load([][]byte{[]byte("hello"), []byte("world")}, nil)
+		var m docModel
+		m.put(0, seqID{0, 1}, []byte("hello\nworld"))
+		var sent []Frame
+		rev := 0
+		pos := func() (int, int) {
+			rows := strings.Split(m.text(), "\n")
+			y := r.Intn(len(rows) + 1)
+			if y == len(rows) {
+				return 0, y
+			}
+			return r.Intn(len(rows[y]) + 1), y
+		}
+		text := func() []byte {
+			s := make([]byte, 1 + r.Intn(5))
+			for i := range s {
+				s[i] = "ab\n"[r.Intn(3)]
+			}
+			return s
+		}
+
+		for step := 0; step < 1000; step++ {
+			x, y := pos()
+			var f Frame
+			applied := false
+			switch r.Intn(10) {
+			case 0, 1:
+				f = Frame{op: opInsert, a: x, b: y, payload: text()}
+				if p := m.offset(x, y); p >= 0 {
+					m.mirror(p, f.payload, rev + 1)
+				} else if x == 0 {
+					// on the row past the end, after the newline making it
+					m.mirror(len(m.text()), append([]byte{'\n'}, f.payload...), rev + 1)
+				}
+			case 2:
+				f = Frame{op: opNewline, a: x, b: y}
+				if p := m.offset(x, y); p >= 0 {
+					m.mirror(p, []byte{'\n'}, rev + 1)
+				} else if x == 0 {
+					m.mirror(len(m.text()), []byte{'\n'}, rev + 1)
+				}
+			case 3:
+				f = Frame{op: opDelete, a: x, b: y}
+				if p := m.offset(x, y); p > 0 {
+					m.kill(p - 1, p)
+				}
+			case 4:
+				f = Frame{op: opDelRange, a: x, b: y, payload: text()}
+				ex, ey := textEnd(f.payload, x, y)
+				if p, e := m.offset(x, y), m.offset(ex, ey); p >= 0 && e >= 0 {
+					m.kill(p, e)
+				}
+			case 5, 6:
+				id := seqID{1 + r.Intn(3), m.clock + 1}
+				s := text()
+				i := -1
+				origin := seqID{}
+				switch k := r.Intn(len(m.chars) + 2); {
+				case k < len(m.chars):
+					i, origin = k, m.chars[k].id
+				case k == len(m.chars):
+					// unknown, so placed by the position
+					origin = seqID{9, 1}
+					if p := m.offset(x, y); p >= 0 && (y == 0 || p < len(m.text())) {
+						i = m.before(p)
+					} else {
+						id.clock = 0
+					}
+				}
+				f = seqFrame(opSeqInsert, x, y, []int{id.site, id.clock, origin.site, origin.clock, rev}, s)
+				if id.clock == 0 {
+					f = Frame{}
+				} else {
+					m.integrate(i, id, s)
+				}
+			case 7:
+				c := m.chars[r.Intn(len(m.chars))].id
+				n := 1 + r.Intn(4)
+				f = seqFrame(opSeqDelete, x, y, []int{c.site, c.clock, rev}, bytes.Repeat([]byte{'z'}, n))
+				applied = true
+				for k := 0; k < n; k++ {
+					if i := m.index(seqID{c.site, c.clock + k}); i < 0 || !m.chars[i].dead {
+						applied = false
+					}
+				}
+				for k := 0; k < n; k++ {
+					if i := m.index(seqID{c.site, c.clock + k}); i >= 0 {
+						m.chars[i].dead = true
+					}
+				}
+			case 8:
+				if len(sent) == 0 {
+					continue
+				}
+				f = sent[r.Intn(len(sent))]
+				applied = true
+				if f.op == opSeqDelete {
+					v, s, _ := f.SeqIDs()
+					for k := range s {
+						if m.index(seqID{v[0], v[1] + k}) < 0 {
+							applied = false
+						}
+					}
+				}
+			case 9:
+				rows := bytes.Split([]byte(docText(&d)), []byte{'\n'})
+				runs := d.AppendRuns(nil)
+				d = Doc{}
+				d.Load(rows, runs)
+			}
+
+			if f.op != 0 {
+				if got := d.Applied(f); got != applied {
+					t.Fatalf("seed %d step %d: %v applied %v", seed, step, f, got)
+				}
+				if !applied {
+					rev++
+					d.Apply(f, rev)
+				}
+				if f.op == opSeqInsert || f.op == opSeqDelete {
+					sent = append(sent, f)
+				}
+			}
+
+			if got, want := docText(&d), m.text(); got != want {
+				t.Fatalf("seed %d step %d: text %q, want %q", seed, step, got, want)
+			}
+			if d.clock != m.clock {
+				t.Fatalf("seed %d step %d: clock %d, want %d", seed, step, d.clock, m.clock)
+			}
+			i, runs := 0, 0
+			for _, b := range d.blocks {
+				if len(b.runs) > 2 * seqBlockRuns || len(b.runs) == 0 && len(d.blocks) > 1 {
+					t.Fatalf("seed %d step %d: block of %d runs", seed, step, len(b.runs))
+				}
+				runs += len(b.runs)
+				for _, run := range b.runs {
+					for k := 0; k < run.len; k++ {
+						id := seqID{run.id.site, run.id.clock + k}
+						if i >= len(m.chars) || m.chars[i].id != id || m.chars[i].dead != run.dead {
+							t.Fatalf("seed %d step %d: char %d is %v, dead %v", seed, step, i, id, run.dead)
+						}
+						i++
+					}
+				}
+			}
+			if i != len(m.chars) || runs != d.nruns {
+				t.Fatalf("seed %d step %d: %d chars in %d runs, want %d in %d", seed, step, i, runs, len(m.chars), d.nruns)
+			}
+			for _, rb := range d.rows {
+				if len(rb.rows) > 2 * rowBlockRows {
+					t.Fatalf("seed %d step %d: block of %d rows", seed, step, len(rb.rows))
+				}
+			}
+			c := m.chars[r.Intn(len(m.chars))].id
+			if bi, i, _, _, k := d.find(c); i < 0 || d.blocks[bi].runs[i].id.clock + k != c.clock {
+				t.Fatalf("seed %d step %d: %v not found", seed, step, c)
+			}
+		}
+	}
+}
+
+// BenchmarkCreateJoinLeave has each goroutine create a session, join it
+// from a second connection and drop both, over and over; run with -cpu
+// to see how it scales.
+func BenchmarkCreateJoinLeave(b *testing.B) {
+	b.ReportAllocs()
+	b.RunParallel(func(pb *testing.PB) {
+		for pb.Next() {
+			host, id, err := create("pw", nil)
+			if err != nil {
+				b.Error(err)
+				return
+			}
+			p, err := dial()
+			if err == nil {
+				_, err = p.join(id, "pw", 0)
+				p.conn.Close()
+			}
+			host.conn.Close()
+			if err != nil {
+				b.Error(err)
+				return
+			}
+		}
+	})
+}
+
+// BenchmarkRegistry looks up live sessions while others come and go, the
+// mix of a busy server.
+func BenchmarkRegistry(b *testing.B) {
+	var r Registry
+	r.Init()
+	for i := 0; i < 10000; i++ {
+		r.Add(&Session{id: fmt.Sprint("live", i)})
+	}
+	var next atomic.Int64
+	b.RunParallel(func(pb *testing.PB) {
+		for pb.Next() {
+			n := next.Add(1)
+			if n % 8 == 0 {
+				id := fmt.Sprint("new", n)
+				r.Add(&Session{id: id})
+				r.Remove(id)
+			} else if _, ok := r.Get(fmt.Sprint("live", n % 10000)); !ok {
+				b.Error("live session not found")
+			}
+		}
+	})
+}
+
+// BenchmarkJoin has N joiners at a time fetch the snapshots of M sessions
+// of 1000 rows, chunked and packed as coled asks for them; an op is one
+// join from connecting up to the ack that ends it.
+func BenchmarkJoin(b *testing.B) {
+	rows := make([][]byte, 1000)
+	for i := range rows {
+		rows[i] = []byte(fmt.Sprintf("%4d the quick brown fox jumps over the lazy dog", i))
+	}
+	for _, m := range []int{1, 16} {
+		for _, n := range []int{16, 256} {
+			b.Run(fmt.Sprintf("sessions=%d/joiners=%d", m, n), func(b *testing.B) {
+				ids := make([]string, m)
+				for i := range ids {
+					host, id, err := create("pw", rows)
+					if err != nil {
+						b.Fatal(err)
+					}
+					defer host.conn.Close()
+					go host.drain(opAck, new(atomic.Int64))
+					ids[i] = id
+				}
+				b.ReportAllocs()
+				b.ResetTimer()
+
+				var next atomic.Int64
+				var wg sync.WaitGroup
+				for w := 0; w < n; w++ {
+					wg.Add(1)
+					go func(id string) {
+						defer wg.Done()
+						for next.Add(1) <= int64(b.N) {
+							p, err := dial()
+							if err == nil {
+								_, err = p.join(id, "pw", joinChunks | joinPacked)
+								p.conn.Close()
+							}
+							if err != nil {
+								b.Error(err)
+								return
+							}
+						}
+					}(ids[w % m])
+				}
+				wg.Wait()
+			})
+		}
+	}
+}
+
+// BenchmarkParseLine parses the text commands clients send a char at a
+// time, which should not allocate.
+func BenchmarkParseLine(b *testing.B) {
+	lines := [][]byte{[]byte("char x 12 345"), []byte("char   0 0"), []byte("newline 13 345"), []byte("delete 13 345")}
+	c := &Client{}
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		if f, err := c.parseLine(lines[i % len(lines)]); err != nil || f.op == 0 {
+			b.Fatalf("%q: %v", lines[i % len(lines)], err)
+		}
+	}
+}
+
+// BenchmarkReadFrame reads sequence inserts of a char each, the bulk of
+// what binary clients send; raw is the one allocation per frame.
+func BenchmarkReadFrame(b *testing.B) {
+	var buf []byte
+	for i := 0; i < 1024; i++ {
+		buf = Frame{op: opSeqInsert, a: i % 80, b: i, payload: []byte{2, byte(i & 0x7f), 2, byte(i & 0x7f), 5, 'x'}}.AppendBinary(buf)
+	}
+	src := bytes.NewReader(buf)
+	r := bufio.NewReader(src)
+	b.ReportAllocs()
+	b.SetBytes(int64(len(buf) / 1024))
+	for i := 0; i < b.N; i++ {
+		if i % 1024 == 0 {
+			src.Reset(buf)
+			r.Reset(src)
+		}
+		if _, err := ReadFrame(r); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+// seqFrame makes a sequence op of the uvarints v and the text s.
+func seqFrame(op byte, x, y int, v []int, s []byte) Frame {
+	var p []byte
+	for _, u := range v {
+		p = binary.AppendUvarint(p, uint64(u))
+	}
+	return Frame{op: op, a: x, b: y, payload: append(p, s...)}
+}
+
+// docText is the text of the rows of d.
+func docText(d *Doc) string {
+	var b []byte
+	for y := 0; y < d.nrows; y++ {
+		if y > 0 {
+			b = append(b, '\n')
+		}
+		b = append(b, *d.row(y)...)
+	}
+	return string(b)
+}
+
+// BenchmarkDoc applies edits at random places of a session's text of
+// 20000 rows of 60 chars, 1.22M in all, the way relayed edits are
+// applied under the session lock; b.N edits fragment the runs as they
+// go. B/char is what the rows' blocks and the runs take per char.
+func BenchmarkDoc(b *testing.B) {
+	edits := map[string]func(d *Doc, r *rand.Rand, x, y, id int) Frame{
+		"insert": func(d *Doc, r *rand.Rand, x, y, id int) Frame {
+			return Frame{op: opInsert, a: x, b: y, payload: []byte{'b'}}
+		},
+		"newline": func(d *Doc, r *rand.Rand, x, y, id int) Frame {
+			return Frame{op: opNewline, a: x, b: y}
+		},
+		"delete": func(d *Doc, r *rand.Rand, x, y, id int) Frame {
+			return Frame{op: opDelete, a: x, b: y}
+		},
+		"seqinsert": func(d *Doc, r *rand.Rand, x, y, id int) Frame {
+			return seqFrame(opSeqInsert, x, y, []int{2, d.clock + 1, 0, id, 0}, []byte{'c'})
+		},
+		"seqdelete": func(d *Doc, r *rand.Rand, x, y, id int) Frame {
+			return seqFrame(opSeqDelete, x, y, []int{0, id, 0}, []byte{'a'})
+		},
+	}
+	for _, name := range []string{"insert", "newline", "delete", "seqinsert", "seqdelete"} {
+		b.Run(name, func(b *testing.B) {
+			rows := make([][]byte, 20000)
+			for i := range rows {
+				rows[i] = bytes.Repeat([]byte{'a'}, 60)
+			}
+			var d Doc
+			d.Load(rows, nil)
+			chars := d.clock
+			r := rand.New(rand.NewSource(1))
+			b.ReportAllocs()
+			b.ResetTimer()
+
+			for i := 0; i < b.N; i++ {
+				y := r.Intn(d.nrows)
+				x := r.Intn(d.rowSize(y) + 1)
+				f := edits[name](&d, r, x, y, 1 + r.Intn(chars))
+				if !d.Applied(f) {
+					d.Apply(f, i + 1)
+				}
+			}
+
+			b.StopTimer()
+			size := int(unsafe.Sizeof(rowBlock{})) * cap(d.rows)
+			for _, rb := range d.rows {
+				size += int(unsafe.Sizeof([]byte(nil))) * cap(rb.rows)
+			}
+			for _, rb := range d.blocks {
+				size += int(unsafe.Sizeof(*rb)) + int(unsafe.Sizeof(seqRun{})) * cap(rb.runs)
+			}
+			for _, refs := range d.index {
+				size += int(unsafe.Sizeof(seqKey{}) + unsafe.Sizeof(refs)) + int(unsafe.Sizeof(seqRef{})) * cap(refs)
+			}
+			b.ReportMetric(float64(size) / float64(chars), "B/char")
+			b.ReportMetric(float64(d.nruns), "runs")
+		})
+	}
+}